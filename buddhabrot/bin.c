@@ -0,0 +1,82 @@
+/**
+ * Binning of points by tile before they're drawn: see struct binner
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bin.h"
+
+int binner_init(struct binner *binner, size_t pixels, int shift,
+		size_t max_points)
+{
+	memset(binner, 0, sizeof(*binner));
+	binner->shift = shift;
+	binner->n_bins = ((pixels - 1) >> shift) + 1;
+	binner->max_points = max_points;
+
+	binner->points = malloc(max_points * sizeof(*binner->points));
+	binner->sorted = malloc(max_points * sizeof(*binner->sorted));
+	binner->start = calloc(binner->n_bins + 1, sizeof(*binner->start));
+	if (!binner->points || !binner->sorted || !binner->start) {
+		perror("malloc");
+		binner_free(binner);
+		return -1;
+	}
+	return 0;
+}
+
+void binner_add(struct binner *binner, const struct point_batch *batch,
+		uint *image)
+{
+	struct binned_point *points;
+	size_t *count;
+	uint i, p;
+
+	if (binner->n_points + batch->n_points > binner->max_points)
+		binner_flush(binner, image);
+
+	/* counting the points in each tile as they come, in start[tile + 1] */
+	points = binner->points + binner->n_points;
+	count = binner->start + 1;
+	for (i = 0; i < batch->n_points; i++) {
+		p = batch->point[i];
+		points[i].index = p & POINT_INDEX_MASK;
+		points[i].colour = batch->colour[p >> POINT_INDEX_BITS];
+		count[points[i].index >> binner->shift]++;
+	}
+	binner->n_points += batch->n_points;
+}
+
+void binner_flush(struct binner *binner, uint *image)
+{
+	const struct binned_point *p, *end = binner->points + binner->n_points;
+	size_t *start = binner->start;
+	size_t bin, sum, n;
+
+	/* from the count of points in each tile, where each tile's points
+	 * go: start[bin + 1] is where tile bin's go, and is moved on over
+	 * them as they're placed */
+	for (bin = 0, sum = 0; bin <= binner->n_bins; bin++) {
+		n = start[bin];
+		start[bin] = sum;
+		sum += n;
+	}
+	for (p = binner->points; p < end; p++)
+		binner->sorted[start[(p->index >> binner->shift) + 1]++] = *p;
+
+	/* and draw them, a tile at a time */
+	for (p = binner->sorted, end = p + binner->n_points; p < end; p++)
+		image[p->index] += p->colour;
+
+	memset(start, 0, (binner->n_bins + 1) * sizeof(*start));
+	binner->n_points = 0;
+}
+
+void binner_free(struct binner *binner)
+{
+	free(binner->points);
+	free(binner->sorted);
+	free(binner->start);
+}
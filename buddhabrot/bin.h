@@ -0,0 +1,47 @@
+#ifndef _BIN_H
+#define _BIN_H
+
+#include <stddef.h>
+
+#include "fractal.h"
+
+/*
+ * Points that are drawn a round at a time, sorted by the tile of the image
+ * they land in, so that each tile's increments are made while it's in
+ * cache rather than missing on nearly every one. A tile is 2^shift pixels
+ * that are adjacent in the image, a band of rows or part of one.
+ */
+struct binner {
+	int shift;
+	size_t n_bins;
+
+	/* points gathered, in the order they came, and how many can be */
+	struct binned_point *points;
+	size_t n_points, max_points;
+
+	/* the same points sorted by tile, and where each tile's go */
+	struct binned_point *sorted;
+	size_t *start;
+};
+
+struct binned_point {
+	uint32_t index, colour;
+};
+
+/*
+ * Set up @binner for an image of @pixels pixels, in tiles of 2^@shift,
+ * gathering @max_points points a round. Returns 0 on success.
+ */
+int binner_init(struct binner *binner, size_t pixels, int shift,
+		size_t max_points);
+
+/* Add @batch's points, drawing the round into @image first if it's full */
+void binner_add(struct binner *binner, const struct point_batch *batch,
+		uint *image);
+
+/* Draw the points gathered so far into @image, tile by tile */
+void binner_flush(struct binner *binner, uint *image);
+
+void binner_free(struct binner *binner);
+
+#endif /* _BIN_H */
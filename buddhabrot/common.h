@@ -7,19 +7,78 @@
 #define SPE_ALIGN 0x80
 
 #include <stdint.h>
+#include <sys/types.h>
+
+/* spu-gcc and the PPE (altivec) compiler know the 'vector' keyword. On the
+ * host it comes from the spu_intrinsics.h in ../spe-host */
+#if !defined(__SPU__) && !defined(__ALTIVEC__)
+#include <spu_intrinsics.h>
+#endif
 
 struct pixel {
 	uint8_t a, r, g, b;
 };
 
-struct calculated_point {
-	uint* addr;
-	uint i;
-};
-
-typedef struct calculated_point* cpoint_ptr;
 typedef vector unsigned int* vec_uint4_ptr;
 
+/* points go to the PPE in batches of up to this many... */
+#define BATCH_POINTS 2048
+
+/*
+ * A batch of points, each a 32-bit word: the index of its pixel in the
+ * image, with the colour it adds in the top bits, as an index into the
+ * batch's table of colours. A batch is sent early if its table fills up.
+ */
+#define BATCH_COLOURS		16
+#define POINT_INDEX_BITS	28
+#define POINT_INDEX_MASK	((1u << POINT_INDEX_BITS) - 1)
+
+struct point_batch {
+	uint32_t colour[BATCH_COLOURS];
+	uint32_t n_points;
+
+	/* the SPE sends nothing after this batch */
+	uint32_t last;
+
+	uint32_t pad[2];
+	uint32_t point[BATCH_POINTS];
+} __attribute__((aligned(SPE_ALIGN)));
+
+/* ...through a ring of this many slots, per SPE */
+#define RING_SLOTS 8
+
+/*
+ * A ring of point batches from one SPE (the producer) to the PPE (the
+ * consumer). Batch n goes in pointbuf[n % RING_SLOTS]. Each side writes
+ * only its own half, on a line of its own, and the other side only reads
+ * it.
+ *
+ * A batch is published by putting it, then head with a fenced put, so the
+ * PPE sees the points before the head that covers them. It's handed back
+ * by a store of tail.
+ *
+ * Neither side spins. The SPE sets waiting and blocks on signal
+ * notification 1 while the ring is full; the PPE sets sleeping and blocks
+ * on the interrupt mailbox while it is empty. Each side checks the other's
+ * flag after moving head or tail, and wakes it if it's set.
+ */
+struct ring_producer {
+	uint32_t head;
+	uint32_t waiting;
+	uint32_t pad[2];
+} __attribute__((aligned(SPE_ALIGN)));
+
+struct ring_consumer {
+	uint32_t tail;
+	uint32_t sleeping;
+	uint32_t pad[2];
+} __attribute__((aligned(SPE_ALIGN)));
+
+struct point_ring {
+	struct ring_producer producer;
+	struct ring_consumer consumer;
+};
+
 struct fractal_params {
 	/* the number of rows and columns in the resulting image, in pixels */
 	int cols, rows;
@@ -27,7 +86,7 @@ struct fractal_params {
 	/* the cartesian coordinates of the center of the image */
 	float x, y;
 
-	vec_uint4_ptr sentinel[8];
+	struct point_ring *ring;
 
 	/* per-pixel increment of x and y */
 	double delta;
@@ -37,15 +96,34 @@ struct fractal_params {
 
 	struct pixel* imgbuf;
 
-	cpoint_ptr pointbuf[8];
+	struct point_batch *pointbuf[RING_SLOTS];
 
 	uint thread_idx;
 };
 
+/* The precision of the orbit kernel */
+enum kernel_precision {
+	/* twice the lanes, for views whose orbits a float can follow */
+	PRECISION_F32,
+
+	/* for deeper views, and the same points as the scalar loop */
+	PRECISION_F64,
+};
+
+/* the narrowest float kernel; the scalar loop is double */
+#define F32_MIN_LANES 4
+
 struct spe_args {
 	struct fractal_params fractal;
 	int n_threads;
 	int thread_idx;
+
+	/* widest SIMD kernel to use, in lanes; 0 for the widest available,
+	 * 1 for the scalar loop */
+	int simd_lanes;
+
+	/* an enum kernel_precision */
+	int precision;
 } __attribute__((aligned(SPE_ALIGN)));
 
 #endif /* _COMMON_H */
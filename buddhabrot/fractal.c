@@ -19,7 +19,9 @@
 #include "cp_vt.h"
 #include "cp_fb.h"
 
+#ifdef HAVE_LIBVNCSERVER
 #include <rfb/rfb.h>
+#endif
 
 #include <libspe2.h>
 #include <pthread.h>
@@ -27,9 +29,15 @@
 #include "png.h"
 #include "fractal.h"
 #include "parse-fractal.h"
+#include "offscreen.h"
+#include "ring.h"
+#include "bin.h"
 
 #define DEFAULT_PARAMSFILE "fractal.data"
 
+// Points gathered a round, when binning them by tile (-B)
+#define DEFAULT_BIN_POINTS 65536
+
 extern spe_program_handle_t spe_fractal;
 
 struct spe_thread {
@@ -52,36 +60,243 @@ void *spethread_fn(void *data)
 }
 
 
-// Iterate through the points in the array, performing the actual 'draw'
-void draw_points(cpoint_ptr p, volatile uint* s) {
-	// wait for s to change to ensure transfer of p has completed
-	while(*s != 1);
+// Iterate through the points in a batch, performing the actual 'draw'
+// into image, or a histogram the size of it
+void draw_points(const struct point_batch *b, uint *image) {
+	for(uint i = 0; i < b->n_points; ++i) {
+		uint p = b->point[i];
 
-	for(int i = 0; i < (16384 / 8); ++i) {
 		// TODO Saturating arithmetic, or some form of HDR processing
-		*p[i].addr += p[i].i;
+		image[p & POINT_INDEX_MASK] += b->colour[p >> POINT_INDEX_BITS];
 	}
-	
-	// reset the sentinel
-	*s = 0;
 }
 
-// Iterate through the first n points in the array
-void draw_points_final(cpoint_ptr p, uint n) {
-	for(int i = 0; i < n; ++i) {
-		*p[i].addr += p[i].i;
+// Draw a batch: straight into image, or through binner if there's one
+static void draw_batch(struct binner *binner, const struct point_batch *b,
+		uint *image) {
+	if (binner)
+		binner_add(binner, b, image);
+	else
+		draw_points(b, image);
+}
+
+/*
+ * With -P, each SPE's points are drawn by a PPE thread of its own, into a
+ * histogram of its own, rather than all queueing for the one draw loop. As
+ * the drawers finish, their histograms are summed pairwise in a tree:
+ * drawer i adds in drawer i + 1's, then i + 2's, i + 4's and so on, each
+ * once that drawer has summed its own half, and drawer 0 adds the total
+ * into the image. A pixel is just a sum of packed colours, so the image is
+ * the same as the draw loop's.
+ */
+struct drawers;
+
+struct drawer {
+	struct spe_thread *spethread;
+	struct ring_reader reader;
+	struct drawers *all;
+	int idx;
+	pthread_t pthread;
+
+	uint *hist;
+	struct binner *binner;
+	unsigned long points;
+	double draw_ms;
+
+	/* the histograms of this drawer's subtree are all in its own */
+	int summed;
+};
+
+struct drawers {
+	struct drawer *drawer;
+	int n;
+
+	/* pixels in the image, and so in each histogram */
+	size_t size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void hist_add(uint *restrict to, const uint *restrict from,
+		size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		to[i] += from[i];
+}
+
+static void hist_reduce(struct drawer *drawer)
+{
+	struct drawers *all = drawer->all;
+	struct drawer *other;
+	int step;
+
+	for (step = 1; step < all->n && !(drawer->idx % (2 * step));
+			step *= 2) {
+		if (drawer->idx + step >= all->n)
+			continue;
+		other = &all->drawer[drawer->idx + step];
+
+		pthread_mutex_lock(&all->lock);
+		while (!other->summed)
+			pthread_cond_wait(&all->cond, &all->lock);
+		pthread_mutex_unlock(&all->lock);
+
+		hist_add(drawer->hist, other->hist, all->size);
+	}
+
+	if (!drawer->idx)
+		hist_add((uint *)drawer->spethread->args.fractal.imgbuf,
+				drawer->hist, all->size);
+
+	pthread_mutex_lock(&all->lock);
+	drawer->summed = 1;
+	pthread_cond_broadcast(&all->cond);
+	pthread_mutex_unlock(&all->lock);
+}
+
+/* Draw one SPE's points, as the draw loop does, then sum the histograms */
+static void *drawer_fn(void *data)
+{
+	struct drawer *drawer = data;
+	struct point_batch *b;
+	double start;
+	int last;
+
+	do {
+		while (!(b = ring_next(&drawer->reader)))
+			ring_wait(&drawer->reader);
+
+		start = now_ms();
+		draw_batch(drawer->binner, b, drawer->hist);
+		drawer->draw_ms += now_ms() - start;
+		drawer->points += b->n_points;
+		last = b->last;
+		ring_release(&drawer->reader);
+	} while (!last);
+
+	if (drawer->binner) {
+		start = now_ms();
+		binner_flush(drawer->binner, drawer->hist);
+		drawer->draw_ms += now_ms() - start;
+	}
+
+	hist_reduce(drawer);
+	return NULL;
+}
+
+/* Start a drawer for each SPE; if @bin_shift, each bins its points */
+static struct drawers *start_drawers(struct spe_thread *threads,
+		int n_threads, const struct fractal_params *fractal,
+		int bin_shift, size_t bin_points)
+{
+	struct drawers *all;
+	int n;
+
+	all = calloc(1, sizeof(*all));
+	if (!all)
+		return NULL;
+	all->drawer = calloc(n_threads, sizeof(*all->drawer));
+	if (!all->drawer)
+		goto err;
+	all->n = n_threads;
+	all->size = (size_t)fractal->rows * fractal->cols;
+	pthread_mutex_init(&all->lock, NULL);
+	pthread_cond_init(&all->cond, NULL);
+
+	for (n = 0; n < n_threads; ++n) {
+		all->drawer[n].hist = calloc(all->size, sizeof(uint));
+		if (!all->drawer[n].hist)
+			goto err;
+		if (!bin_shift)
+			continue;
+
+		all->drawer[n].binner = malloc(sizeof(struct binner));
+		if (!all->drawer[n].binner ||
+				binner_init(all->drawer[n].binner, all->size,
+					bin_shift, bin_points)) {
+			free(all->drawer[n].binner);
+			all->drawer[n].binner = NULL;
+			goto err;
+		}
+	}
+
+	for (n = 0; n < n_threads; ++n) {
+		all->drawer[n].spethread = &threads[n];
+		ring_reader_init(&all->drawer[n].reader, threads[n].ctx,
+				&threads[n].args.fractal);
+		all->drawer[n].all = all;
+		all->drawer[n].idx = n;
+		pthread_create(&all->drawer[n].pthread, NULL, drawer_fn,
+				&all->drawer[n]);
 	}
+	return all;
+
+err:
+	perror("calloc");
+	if (all->drawer)
+		for (n = 0; n < n_threads; ++n) {
+			free(all->drawer[n].hist);
+			if (all->drawer[n].binner)
+				binner_free(all->drawer[n].binner);
+			free(all->drawer[n].binner);
+		}
+	free(all->drawer);
+	free(all);
+	return NULL;
 }
 
+/*
+ * Wait for the drawers to draw everything, and free them. Returns how many
+ * points they drew, with the time they spent at it, between them, in
+ * @draw_ms.
+ */
+static unsigned long stop_drawers(struct drawers *all,
+		struct ring_reader *readers, double *draw_ms)
+{
+	unsigned long points = 0;
+	int n;
+
+	for (n = 0; n < all->n; ++n) {
+		pthread_join(all->drawer[n].pthread, NULL);
+		points += all->drawer[n].points;
+		*draw_ms += all->drawer[n].draw_ms;
+		readers[n] = all->drawer[n].reader;
+		free(all->drawer[n].hist);
+		if (all->drawer[n].binner) {
+			binner_free(all->drawer[n].binner);
+			free(all->drawer[n].binner);
+		}
+	}
+	pthread_mutex_destroy(&all->lock);
+	pthread_cond_destroy(&all->cond);
+	free(all->drawer);
+	free(all);
+
+	return points;
+}
 
 int main(int argc, char **argv)
 {
 	struct spe_thread* threads;
 	spe_event_handler_ptr_t event_handler;
+	struct drawers *drawers = NULL;
+	struct ring_reader *readers;
+	struct binner binner, *image_binner = NULL;
+	int bin_shift = 0;
+	size_t bin_points = DEFAULT_BIN_POINTS;
 	struct fractal_params *fractal;
 	const char *outfile, *paramsfile;
-	int opt;
+	struct offscreen offscreen;
+	cp_vt vt;
+	cp_fb fb;
+	int opt, headless = 0, hugepages = 0, private = 0;
+	int simd_lanes = 0, precision = PRECISION_F64;
+	unsigned long points = 0;
+	double start, draw_ms = 0;
+#ifdef HAVE_LIBVNCSERVER
 	int remote = 0;
+#endif
 	int n_threads = spe_cpu_info_get(SPE_COUNT_USABLE_SPES, -1);
 
 	/* set up default arguments */
@@ -90,7 +305,7 @@ int main(int argc, char **argv)
 
 	/* parse arguments into datafile and outfile  */
 	printf("Configuration:\n");
-	while ((opt = getopt(argc, argv, "n:o:p:r")) != -1) {
+	while ((opt = getopt(argc, argv, "n:o:p:rHLPB:w:k:")) != -1) {
 		switch (opt) {
 		case 'n':
 			n_threads = atoi(optarg);
@@ -103,17 +318,68 @@ int main(int argc, char **argv)
 			paramsfile = optarg;
 			printf("\tParams will be read from %s\n", paramsfile);
 			break;
+#ifdef HAVE_LIBVNCSERVER
 		case 'r':
 			remote = 1;
 			printf("\tRemote access via VNC enabled\n");
 			break;
+#endif
+		case 'L':
+			hugepages = 1;
+			/* fall through */
+		case 'H':
+			headless = 1;
+			printf("\tRendering offscreen%s\n",
+					hugepages ? ", in huge pages" : "");
+			break;
+		case 'P':
+			private = 1;
+			printf("\tDrawing into a histogram per SPE\n");
+			break;
+		case 'B':
+			sscanf(optarg, "%d,%zu", &bin_shift, &bin_points);
+			if (bin_shift < 1 || bin_shift > POINT_INDEX_BITS ||
+					bin_points < BATCH_POINTS) {
+				fprintf(stderr, "-B wants a tile size, as a "
+						"power of two from 1 to %d, and "
+						"at least %d points\n",
+						POINT_INDEX_BITS, BATCH_POINTS);
+				return EXIT_FAILURE;
+			}
+			printf("\tBinning %zu points at a time into tiles "
+					"of %d pixels\n", bin_points,
+					1 << bin_shift);
+			break;
+		case 'w':
+			simd_lanes = atoi(optarg);
+			break;
+		case 'k':
+			if (!strcmp(optarg, "float")) {
+				precision = PRECISION_F32;
+				break;
+			} else if (!strcmp(optarg, "double")) {
+				precision = PRECISION_F64;
+				break;
+			}
+			/* fall through */
 		default:
 			fprintf(stderr, "Usage: %s [-p paramsfile] "
 						"[-o outfile]\n"
-						"[-n SPE count] [-r]\n", argv[0]);
+						"[-n SPE count] [-r] [-H|-L] [-P]\n"
+						"[-B tile bits[,points]] "
+						"[-w simd_lanes] "
+						"[-k float|double]\n",
+						argv[0]);
 			return EXIT_FAILURE;
 		}
 	}
+	if (precision == PRECISION_F32 && simd_lanes &&
+			simd_lanes < F32_MIN_LANES) {
+		fprintf(stderr, "-k float needs -w %d or more; -w 1 is the "
+				"scalar loop, which is double\n",
+				F32_MIN_LANES);
+		return EXIT_FAILURE;
+	}
 	printf("\t%d SPEs\n\n", n_threads);
 
 
@@ -123,13 +389,35 @@ int main(int argc, char **argv)
 	if (!fractal)
 		return EXIT_FAILURE;
 
-	// Set up framebuffer
- 	cp_vt vt;
- 	cp_fb fb;
-	cp_vt_open_graphics(&vt);
- 	cp_fb_open(&fb,1);
+	// Without a size, draw the whole screen
+	if (!fractal->cols || !fractal->rows) {
+		if (headless) {
+			fprintf(stderr, "No rows and cols in %s, and no screen "
+					"to size the image to\n", paramsfile);
+			return EXIT_FAILURE;
+		}
+		if (fb_screen_size(fractal))
+			return EXIT_FAILURE;
+	}
+
+	// Points carry their pixel's index in POINT_INDEX_BITS
+	if ((uint64_t)fractal->rows * fractal->cols > POINT_INDEX_MASK + 1ull) {
+		fprintf(stderr, "%dx%d is too many pixels, at most %u\n",
+				fractal->cols, fractal->rows, POINT_INDEX_MASK + 1);
+		return EXIT_FAILURE;
+	}
 
- 	fractal->imgbuf = (void*)fb.draw_addr[0];
+	// Set up framebuffer, or an image in memory
+	if (headless) {
+		if (offscreen_alloc(&offscreen, fractal->rows, fractal->cols,
+					hugepages))
+			return EXIT_FAILURE;
+		fractal->imgbuf = offscreen.pixels;
+	} else {
+		cp_vt_open_graphics(&vt);
+		cp_fb_open(&fb, 1);
+		fractal->imgbuf = (void *)fb.draw_addr[0];
+	}
 
 	// Reset some params that were read for what we want
 	fractal->x = 0;
@@ -137,6 +425,11 @@ int main(int argc, char **argv)
 	fractal->delta = 4. / fractal->rows;
 
 	threads = memalign(SPE_ALIGN, n_threads * sizeof(*threads));
+	readers = calloc(n_threads, sizeof(*readers));
+	if (!threads || !readers) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
 
 	event_handler = spe_event_handler_create();
 	if(!event_handler) {
@@ -144,28 +437,38 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	start = now_ms();
+
 	// Set up each thread
 	for(int n = 0; n < n_threads; ++n) {
 		threads[n].ctx = spe_context_create(
 			SPE_EVENTS_ENABLE|SPE_CFG_SIGNOTIFY1_OR, NULL);
 		threads[n].args.n_threads = n_threads;
 		threads[n].args.thread_idx = n;
+		threads[n].args.simd_lanes = simd_lanes;
+		threads[n].args.precision = precision;
 		
 		spe_program_load(threads[n].ctx, &spe_fractal);
 		
 		memcpy(&threads[n].args.fractal, fractal, sizeof(*fractal));
 		
-		for(int q = 0; q < 8; ++q) {
-			threads[n].args.fractal.pointbuf[q] = memalign(128, 16384);
-			threads[n].args.fractal.sentinel[q] = memalign(16, 16);
+		for(int q = 0; q < RING_SLOTS; ++q) {
+			threads[n].args.fractal.pointbuf[q] = memalign(SPE_ALIGN,
+					sizeof(struct point_batch));
 		}
+		threads[n].args.fractal.ring = memalign(SPE_ALIGN,
+				sizeof(struct point_ring));
+		memset(threads[n].args.fractal.ring, 0, sizeof(struct point_ring));
+		ring_reader_init(&readers[n], threads[n].ctx,
+				&threads[n].args.fractal);
 	
-		// Register for intr mbox events - store fractal_params for thread for easy lookup later
+		// Register for intr mbox events, which ring when there's a batch
+		// (the drawers read their SPE's mbox themselves)
 		spe_event_unit_t event;
 		event.events = SPE_EVENT_OUT_INTR_MBOX;
 		event.spe = threads[n].ctx;
-		event.data.ptr = &threads[n].args.fractal;
-		if( -1 ==  spe_event_handler_register(event_handler, &event) ) {
+		event.data.ptr = &readers[n];
+		if( !private && -1 ==  spe_event_handler_register(event_handler, &event) ) {
 			perror("spe_event_handler_register");
 			return EXIT_FAILURE;
 		}
@@ -173,10 +476,24 @@ int main(int argc, char **argv)
 		pthread_create(&threads[n].pthread, NULL, spethread_fn, &threads[n]);
 	}
 
+	if (private) {
+		drawers = start_drawers(threads, n_threads, fractal,
+				bin_shift, bin_points);
+		if (!drawers)
+			return EXIT_FAILURE;
+	} else if (bin_shift) {
+		if (binner_init(&binner, (size_t)fractal->rows * fractal->cols,
+					bin_shift, bin_points))
+			return EXIT_FAILURE;
+		image_binner = &binner;
+	}
+
+#ifdef HAVE_LIBVNCSERVER
 	// Start up VNC access, if requested
 	rfbScreenInfoPtr rfbScreen = 0;
 	if(remote) {
-		rfbScreen = rfbGetScreen(&argc, argv, fb.w, fb.h, 8, 3, 4);
+		rfbScreen = rfbGetScreen(&argc, argv, fractal->cols,
+				fractal->rows, 8, 3, 4);
 		rfbScreen->desktopName = "PS3 VNC";
 		rfbScreen->frameBuffer = (void*)fractal->imgbuf;
 		rfbScreen->alwaysShared = TRUE;
@@ -185,56 +502,95 @@ int main(int argc, char **argv)
 		rfbScreen->serverFormat.blueShift = 0;
 		rfbInitServer(rfbScreen);
 	}
+#endif
 
 	int complete = 0;
-	// Main draw loop - wait for interrupt from SPE, draw data.
-	while(1) {
-		spe_event_unit_t event;
-		uint f;
-
-		// Block for interrupt
-		spe_event_wait(event_handler, &event, 1, -1);
-
-		// Got interrupt, read mbox
-		spe_out_intr_mbox_read(event.spe, &f, 1, SPE_MBOX_ANY_NONBLOCKING);
-
-		// Retrieve appropriate fractal_params pointer that we stashed here earlier
-		struct fractal_params* fractal = (struct fractal_params*)event.data.ptr;
-
-		// thread finishing - check for high bit set
-		if(f&(1<<31)) {
-			// Mask the high bit back out
-			f&=~(1<<31);
-			
-			// get the remaining number of items to be plotted
-			uint remainder;
-			spe_out_intr_mbox_read(event.spe, &remainder, 1, SPE_MBOX_ALL_BLOCKING);
-			
-			draw_points_final(fractal->pointbuf[f], remainder);
-
-			++complete;
-			if(complete==n_threads) {
-				break;
+	// Main draw loop - draw whatever the SPEs have sent, and when there's
+	// nothing, sleep until one rings.
+	while(!private && complete < n_threads) {
+		int drawn = 0, n, sleeping;
+
+		for(n = 0; n < n_threads; ++n) {
+			struct point_batch *b;
+
+			while(!readers[n].done && (b = ring_next(&readers[n]))) {
+				double draw_start = now_ms();
+
+				draw_batch(image_binner, b, (uint *)fractal->imgbuf);
+				draw_ms += now_ms() - draw_start;
+				points += b->n_points;
+
+				// the slot isn't ours once it's released
+				if(b->last) {
+					readers[n].done = 1;
+					++complete;
+				}
+				ring_release(&readers[n]);
+				drawn = 1;
 			}
 		}
-		else {
-			// Draw the data
-			draw_points(fractal->pointbuf[f],  (uint*)fractal->sentinel[f]);
 
-			// Signal the SPE that the buffer has been written
-			spe_signal_write(event.spe, SPE_SIG_NOTIFY_REG_1, 1<<f);
+		if(!drawn) {
+			// Tell each SPE that we're going to sleep, unless one has
+			// sent something since we looked
+			for(n = 0, sleeping = 1; n < n_threads && sleeping; ++n)
+				if(!readers[n].done)
+					sleeping = ring_sleep(&readers[n]);
+
+			if(sleeping) {
+				spe_event_unit_t event;
+				uint bell;
+
+				spe_event_wait(event_handler, &event, 1, -1);
+				spe_out_intr_mbox_read(event.spe, &bell, 1,
+						SPE_MBOX_ANY_NONBLOCKING);
+			} else {
+				// that one took it back itself
+				--n;
+			}
+
+			while(n--)
+				if(!readers[n].done)
+					ring_wake(&readers[n]);
+			continue;
 		}
 
-		// Mark screen as changed
+#ifdef HAVE_LIBVNCSERVER
+		// Mark screen as changed, once it has
 		if(remote) {
-			rfbMarkRectAsModified(rfbScreen, 0,0,fb.w, fb.h);
+			if(image_binner)
+				binner_flush(image_binner, (uint *)fractal->imgbuf);
+			rfbMarkRectAsModified(rfbScreen, 0, 0, fractal->cols,
+					fractal->rows);
 			rfbProcessEvents(rfbScreen,1);
 		}
+#endif
 	}
 
 	for(int n = 0; n < n_threads; ++n) {
 		pthread_join(threads[n].pthread, NULL);
 	}
+	if (private)
+		points = stop_drawers(drawers, readers, &draw_ms);
+	if (image_binner) {
+		double draw_start = now_ms();
+
+		binner_flush(image_binner, (uint *)fractal->imgbuf);
+		draw_ms += now_ms() - draw_start;
+		binner_free(image_binner);
+	}
+
+	for(int n = 0; n < n_threads; ++n) {
+		printf("SPE %d: %u batches, ring empty %lu times, for %.1f ms\n",
+				n, readers[n].tail, readers[n].stalls,
+				readers[n].stall_ms);
+	}
+
+	double ms = now_ms() - start;
+	printf("%lu points drawn in %.1f ms, %.2f Mpoints/s\n",
+			points, ms, points / ms / 1e3);
+	printf("drawing them took %.1f ms, %.2f Mpoints/s\n",
+			draw_ms, points / draw_ms / 1e3);
 
     if(outfile) {
         int xx;
@@ -245,6 +601,7 @@ int main(int argc, char **argv)
         write_png(outfile, fractal->rows, fractal->cols, fractal->imgbuf);
     }
 
+#ifdef HAVE_LIBVNCSERVER
 	if(remote) {
 		// Don't close straight away
 		for(int c = 0; c < 100; ++c ) {
@@ -254,9 +611,14 @@ int main(int argc, char **argv)
 		}
 		printf("\n");
 	}
+#endif
 
-	cp_vt_close(&vt);
-	cp_fb_close(&fb);
+	if (headless) {
+		offscreen_free(&offscreen);
+	} else {
+		cp_vt_close(&vt);
+		cp_fb_close(&fb);
+	}
 
 	return EXIT_SUCCESS;
 }
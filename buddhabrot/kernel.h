@@ -0,0 +1,288 @@
+/**
+ * The orbit kernels, written against the vector types in ../mandelbrot/simd.h
+ * and the operations simd-orbit.h adds to them.
+ *
+ * spe-fractal.c includes this once for each vector shape, with KERNEL_SHAPE
+ * defined to the shape's suffix (f32x4, f64x4, ...), so render_fractal_f64x4()
+ * is the four-lane double kernel. Each lane has a sample of its own, and
+ * takes the next one as soon as it's done, rather than waiting for the rest
+ * of the vector.
+ *
+ * The double kernels do the scalar render_fractal()'s arithmetic, in the
+ * same order, and draw exactly the same points; the float ones go wrong
+ * much sooner as the view deepens, with twice the lanes.
+ */
+
+#define VEC		simd_cat(v, KERNEL_SHAPE)
+#define V(op)		simd_cat(VEC, _##op)
+#define KERNEL(name)	simd_cat(name##_, KERNEL_SHAPE)
+
+/* z = z^2 + c, as the scalar loop has it */
+#define ITERATE()	tmp = V(add)(V(sub)(V(mul)(zr, zr), V(mul)(zi, zi)),	\
+				cr);						\
+			zi = V(add)(V(mul)(V(mul)(two, zr), zi), ci);		\
+			zr = tmp
+
+/**
+ * Retrace each of @n_orbits escaping orbits, drawing the points of the first
+ * n iterations of each that land on the image. They're known not to escape
+ * before then, so there's no need to look.
+ */
+static void KERNEL(retrace)(struct fractal_params *params,
+		const struct orbit *orbits, int n_orbits)
+{
+	/* per-lane state, spilled to memory while lanes are refilled */
+	V(scalar) l_cr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_ci[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_zr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_zi[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_j[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_n[V(lanes)] __attribute__((aligned(64)));
+	VEC cr, ci, zr, zi, tmp, vj, vn, px, py;
+	const VEC two = V(splat)(2.0f);
+	const VEC one = V(splat)(1.0f);
+	const VEC half = V(splat)(0.5f);
+	const VEC zero = V(splat)(0.0f);
+	const VEC first = V(splat)(MIN_POINT_I - 0.5f);
+	const VEC cols = V(splat)((V(scalar))params->cols);
+	const VEC rows = V(splat)((V(scalar))params->rows);
+	VEC x_min, y_min, delta;
+	unsigned int active, done, inside, emit, c;
+	int l, next;
+
+	/* as the scalar loop has them, then rounded to the kernel's
+	 * precision */
+	delta = V(splat)((V(scalar))params->delta);
+	x_min = V(splat)((V(scalar))(params->x -
+				(params->delta * params->cols / 2)));
+	y_min = V(splat)((V(scalar))(params->y -
+				(params->delta * params->rows / 2)));
+
+	next = 0;
+	active = 0;
+
+	/* Start lane l on the next orbit, or park it if there are none left */
+#define LOAD_LANE(l)								\
+	do {									\
+		if (next < n_orbits) {						\
+			l_cr[l] = orbits[next].cr;				\
+			l_ci[l] = orbits[next].ci;				\
+			l_n[l] = orbits[next].n;				\
+			next++;							\
+			active |= 1u << (l);					\
+		} else {							\
+			l_cr[l] = l_ci[l] = 0.0f;				\
+			l_n[l] = 0.0f;						\
+			active &= ~(1u << (l));					\
+		}								\
+		l_zr[l] = l_zi[l] = 0.0f;					\
+		l_j[l] = 0.0f;							\
+	} while (0)
+
+	for (l = 0; l < V(lanes); l++)
+		LOAD_LANE(l);
+
+	cr = V(load)(l_cr);
+	ci = V(load)(l_ci);
+	zr = zi = zero;
+	vj = zero;
+	vn = V(load)(l_n);
+
+	while (active) {
+		ITERATE();
+
+		px = V(div)(V(sub)(zi, x_min), delta);
+		py = V(div)(V(sub)(zr, y_min), delta);
+
+		/* an offscreen image can be any shape, so the orbit may
+		 * leave it */
+		inside = active &
+			~V(mask_bits)(V(cmpgt)(zero, px)) &
+			V(mask_bits)(V(cmpgt)(cols, px)) &
+			~V(mask_bits)(V(cmpgt)(zero, py)) &
+			V(mask_bits)(V(cmpgt)(rows, py));
+		cmap_calls += __builtin_popcount(inside);
+
+		/* past the first few steps, which are mostly noise */
+		emit = inside & V(mask_bits)(V(cmpgt)(vj, first));
+		if (emit) {
+			if (fill + V(lanes) > BATCH_POINTS)
+				ring_publish(params, 0);
+			c = colour_index(params, POINT_COLOUR);
+			fill += V(compress_index)(&batch.point[fill], px, py,
+					params->cols, c << POINT_INDEX_BITS,
+					emit);
+		}
+
+		/* a lane is done once it has drawn n points */
+		vj = V(add)(vj, one);
+		done = active & V(mask_bits)(V(cmpgt)(V(add)(vj, half), vn));
+		if (!done)
+			continue;
+
+		V(store)(l_zr, zr);
+		V(store)(l_zi, zi);
+		V(store)(l_j, vj);
+
+		for (l = 0; l < V(lanes); l++)
+			if (done & (1u << l))
+				LOAD_LANE(l);
+
+		cr = V(load)(l_cr);
+		ci = V(load)(l_ci);
+		zr = V(load)(l_zr);
+		zi = V(load)(l_zi);
+		vj = V(load)(l_j);
+		vn = V(load)(l_n);
+	}
+
+#undef LOAD_LANE
+}
+
+/**
+ * Render a fractal, as the scalar render_fractal() does, given the
+ * parameters specified in @params.
+ *
+ * Each lane iterates a sample until it escapes, is found to be periodic or
+ * runs out of iterations. The escaping ones are queued, with how many
+ * iterations they took, and retraced a queue at a time.
+ */
+static void KERNEL(render_fractal)(struct fractal_params *params,
+		int start_row, int row_skip, double compute_delta)
+{
+	V(scalar) l_cr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_ci[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_zr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_zi[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_i[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_sr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_si[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_save_i[V(lanes)] __attribute__((aligned(64)));
+	/* each lane's c, as the orbit queue wants it */
+	double sample_cr[V(lanes)], sample_ci[V(lanes)];
+	struct orbit orbits[ORBIT_QUEUE];
+	struct sample_walk walk;
+	VEC cr, ci, zr, zi, tmp, mag, vi, sr, si, save_i, dr, di;
+	V(mask) save;
+	const VEC two = V(splat)(2.0f);
+	const VEC one = V(splat)(1.0f);
+	const VEC limit = V(splat)(4.0f);
+	const VEC last = V(splat)((V(scalar))(params->i_max - 1.5));
+	VEC tolerance;
+	double tol;
+	unsigned int active, done, escaped, periodic;
+	int l, n, n_orbits;
+
+	if (params->i_max < 1)
+		return;
+
+	sample_walk_init(&walk, params, start_row, row_skip, compute_delta);
+
+	tol = params->delta / 65536;
+	tol *= tol;
+	tolerance = V(splat)((V(scalar))tol);
+
+	n_orbits = 0;
+	active = 0;
+
+	/* Start lane l on the next sample, or park it (on c = 0, which never
+	 * escapes) if there are none left */
+#define LOAD_LANE(l)								\
+	do {									\
+		if (next_sample(&walk, &sample_cr[l], &sample_ci[l])) {	\
+			active |= 1u << (l);					\
+		} else {							\
+			sample_cr[l] = sample_ci[l] = 0.0;			\
+			active &= ~(1u << (l));					\
+		}								\
+		l_cr[l] = sample_cr[l];						\
+		l_ci[l] = sample_ci[l];						\
+		l_zr[l] = l_zi[l] = 0.0f;					\
+		l_sr[l] = l_si[l] = 0.0f;					\
+		l_i[l] = 0.0f;							\
+		l_save_i[l] = 1.0f;						\
+	} while (0)
+
+	for (l = 0; l < V(lanes); l++)
+		LOAD_LANE(l);
+
+	cr = V(load)(l_cr);
+	ci = V(load)(l_ci);
+	zr = zi = V(splat)(0.0f);
+	sr = si = V(splat)(0.0f);
+	vi = V(splat)(0.0f);
+	save_i = one;
+
+	while (active) {
+		ITERATE();
+		mag = V(add)(V(mul)(zr, zr), V(mul)(zi, zi));
+		escaped = V(mask_bits)(V(cmpgt)(mag, limit));
+
+		/* lanes whose orbit has come back to the saved z */
+		dr = V(sub)(zr, sr);
+		di = V(sub)(zi, si);
+		periodic = ~escaped & V(mask_bits)(V(cmpgt)(tolerance,
+				V(add)(V(mul)(dr, dr), V(mul)(di, di))));
+
+		/* lanes on their last iteration */
+		done = active & (escaped | periodic |
+				V(mask_bits)(V(cmpgt)(vi, last)));
+
+		/* move the saved z on where i is a power of two */
+		save = V(cmpgt)(V(add)(vi, one), save_i);
+		sr = V(sel)(sr, zr, save);
+		si = V(sel)(si, zi, save);
+		save_i = V(sel)(save_i, V(add)(save_i, save_i), save);
+
+		vi = V(add)(vi, one);
+		if (!done)
+			continue;
+
+		V(store)(l_zr, zr);
+		V(store)(l_zi, zi);
+		V(store)(l_i, vi);
+		V(store)(l_sr, sr);
+		V(store)(l_si, si);
+		V(store)(l_save_i, save_i);
+
+		for (l = 0; l < V(lanes); l++) {
+			if (!(done & (1u << l)))
+				continue;
+
+			/* the iteration it escaped in is how many points
+			 * its trail has; a short one has none to draw */
+			n = (int)l_i[l] - 1;
+			if ((escaped & (1u << l)) && n > MIN_POINT_I) {
+				orbits[n_orbits].cr = sample_cr[l];
+				orbits[n_orbits].ci = sample_ci[l];
+				orbits[n_orbits].n = n;
+				if (++n_orbits == ORBIT_QUEUE) {
+					KERNEL(retrace)(params, orbits,
+							n_orbits);
+					n_orbits = 0;
+				}
+			} else if (periodic & (1u << l)) {
+				++periodic_points;
+			}
+			LOAD_LANE(l);
+		}
+
+		cr = V(load)(l_cr);
+		ci = V(load)(l_ci);
+		zr = V(load)(l_zr);
+		zi = V(load)(l_zi);
+		vi = V(load)(l_i);
+		sr = V(load)(l_sr);
+		si = V(load)(l_si);
+		save_i = V(load)(l_save_i);
+	}
+
+	KERNEL(retrace)(params, orbits, n_orbits);
+
+#undef LOAD_LANE
+}
+
+#undef ITERATE
+#undef KERNEL
+#undef V
+#undef VEC
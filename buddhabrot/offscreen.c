@@ -0,0 +1,92 @@
+/**
+ * Offscreen image buffers, for rendering without a framebuffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "offscreen.h"
+
+/* The system's huge page size, in bytes, or 0 if it doesn't have them */
+static size_t hugepage_size(void)
+{
+	char line[128];
+	unsigned long kb = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+			break;
+
+	fclose(fp);
+	return kb * 1024;
+}
+
+/* Back @buf with huge pages. Returns 0 on success. */
+static int alloc_hugepages(struct offscreen *buf)
+{
+#ifdef MAP_HUGETLB
+	size_t page, size;
+	void *p;
+
+	page = hugepage_size();
+	if (!page)
+		return -1;
+
+	size = (buf->size + page - 1) & ~(page - 1);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	/* mmap()ed memory is already zeroed */
+	buf->pixels = p;
+	buf->size = size;
+	buf->hugepages = 1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int offscreen_alloc(struct offscreen *buf, int rows, int cols, int hugepages)
+{
+	memset(buf, 0, sizeof(*buf));
+
+	/* whole DMA lines, with at least a byte to spare after the last
+	 * pixel */
+	buf->size = ((size_t)rows * cols * sizeof(struct pixel) + SPE_ALIGN) &
+		~(size_t)(SPE_ALIGN - 1);
+
+	if (hugepages) {
+		if (!alloc_hugepages(buf))
+			return 0;
+		fprintf(stderr, "No huge pages free; using normal pages "
+				"for the image\n");
+	}
+
+	buf->pixels = memalign(SPE_ALIGN, buf->size);
+	if (!buf->pixels) {
+		perror("memalign");
+		return -1;
+	}
+	memset(buf->pixels, 0, buf->size);
+
+	return 0;
+}
+
+void offscreen_free(struct offscreen *buf)
+{
+	if (buf->hugepages)
+		munmap(buf->pixels, buf->size);
+	else
+		free(buf->pixels);
+	buf->pixels = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef _OFFSCREEN_H
+#define _OFFSCREEN_H
+
+#include <stddef.h>
+
+#include "fractal.h"
+
+/*
+ * An image in ordinary memory, for rendering without a console or
+ * framebuffer, at any size
+ */
+struct offscreen {
+	struct pixel *pixels;
+	size_t size;
+
+	/* the pixels were mmap()ed from huge pages, not memalign()ed */
+	int hugepages;
+};
+
+/*
+ * Allocate a zeroed @rows x @cols image, aligned for DMA. If @hugepages, back
+ * it with huge pages if there are any free, which spares the TLB when the
+ * SPEs' DMAs are spread over a large image. Returns 0 on success.
+ */
+int offscreen_alloc(struct offscreen *buf, int rows, int cols, int hugepages);
+
+void offscreen_free(struct offscreen *buf);
+
+#endif /* _OFFSCREEN_H */
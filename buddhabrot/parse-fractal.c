@@ -69,47 +69,6 @@ struct fractal_params *parse_fractal(const char *filename)
 		}
 	}
 
-	if( fractal->rows == 0 || fractal->cols == 0 ) {
-		// code lifted from fb_info.c found at cellperformance.com
-		const int fb_file = open( "/dev/fb0", O_RDWR );
-		const int open_fb_error = (fb_file >> ((sizeof(int)*8)-1));
-		if(open_fb_error < 0) {
-			fprintf(stderr, "Could not open /dev/fb0.  Check permissions.\n");
-			perror("open");
-			goto err_free;
-		}
-
-		struct ps3fb_ioctl_res res;
-		int ps3_screeninfo_error = ioctl(fb_file, PS3FB_IOCTL_SCREENINFO, (unsigned long)&res);
-		if (ps3_screeninfo_error == -1) {
-			fprintf(stderr, "Error: PS3FB_IOCTL_SCREENINFO Failed and image dimensions not specified\n");
-			perror("ioctl");
-			goto err_free;
-		}
-		if (fractal->cols == 0) {
-			fractal->cols = res.xres;
-			printf("xres detected as %d.\n", res.xres);
-		}
-		if (fractal->rows == 0) {
-			fractal->rows = res.yres;
-			printf("yres detected as %d.\n", res.yres);
-		}
-
-		int close_fb_error = close(fb_file);
-		if(close_fb_error == -1) {
-			fprintf(stderr, "Warning: Could not close file handle used for /dev/fb0\n");
-		}
-	}
-
-
-	if (!fractal->cols) {
-		fprintf(stderr, "No columns specified\n");
-	}
-
-	if (!fractal->rows) {
-		fprintf(stderr, "No rows specified\n");
-	}
-
 	if (!fractal->x) {
 		fprintf(stderr, "No x value specified in %s\n", filename);
 		goto err_free;
@@ -142,3 +101,37 @@ err_close:
 
 }
 
+int fb_screen_size(struct fractal_params *fractal)
+{
+	// code lifted from fb_info.c found at cellperformance.com
+	const int fb_file = open( "/dev/fb0", O_RDWR );
+	const int open_fb_error = (fb_file >> ((sizeof(int)*8)-1));
+	if(open_fb_error < 0) {
+		fprintf(stderr, "Could not open /dev/fb0.  Check permissions.\n");
+		perror("open");
+		return -1;
+	}
+
+	struct ps3fb_ioctl_res res;
+	int ps3_screeninfo_error = ioctl(fb_file, PS3FB_IOCTL_SCREENINFO, (unsigned long)&res);
+	if (ps3_screeninfo_error == -1) {
+		fprintf(stderr, "Error: PS3FB_IOCTL_SCREENINFO Failed and image dimensions not specified\n");
+		perror("ioctl");
+		return -1;
+	}
+	if (fractal->cols == 0) {
+		fractal->cols = res.xres;
+		printf("xres detected as %d.\n", res.xres);
+	}
+	if (fractal->rows == 0) {
+		fractal->rows = res.yres;
+		printf("yres detected as %d.\n", res.yres);
+	}
+
+	int close_fb_error = close(fb_file);
+	if(close_fb_error == -1) {
+		fprintf(stderr, "Warning: Could not close file handle used for /dev/fb0\n");
+	}
+
+	return 0;
+}
@@ -5,4 +5,10 @@
 
 struct fractal_params *parse_fractal(const char *filename);
 
+/*
+ * Fill in whichever of @fractal's rows and cols are missing with the size of
+ * the screen. Returns 0 on success.
+ */
+int fb_screen_size(struct fractal_params *fractal);
+
 #endif /* _PARSE_FRACTAL_H */
@@ -0,0 +1,76 @@
+/**
+ * The PPE's end of the point rings: see struct point_ring
+ */
+
+#include "ring.h"
+
+void ring_reader_init(struct ring_reader *reader, spe_context_ptr_t ctx,
+		struct fractal_params *fractal)
+{
+	reader->ring = fractal->ring;
+	reader->ctx = ctx;
+	reader->slots = fractal->pointbuf;
+	reader->tail = 0;
+	reader->done = 0;
+	reader->stalls = 0;
+	reader->stall_ms = 0;
+}
+
+struct point_batch *ring_next(struct ring_reader *reader)
+{
+	/* pairs with the SPE's fenced put of head */
+	uint32_t head = __atomic_load_n(&reader->ring->producer.head,
+			__ATOMIC_ACQUIRE);
+
+	if (head == reader->tail)
+		return NULL;
+	return reader->slots[reader->tail % RING_SLOTS];
+}
+
+void ring_release(struct ring_reader *reader)
+{
+	struct point_ring *ring = reader->ring;
+
+	/* the store of tail must come before the load of waiting, as the
+	 * SPE's store of waiting comes before its load of tail: one of us
+	 * sees the other's */
+	__atomic_store_n(&ring->consumer.tail, ++reader->tail,
+			__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->producer.waiting, __ATOMIC_SEQ_CST))
+		spe_signal_write(reader->ctx, SPE_SIG_NOTIFY_REG_1, 1);
+}
+
+int ring_sleep(struct ring_reader *reader)
+{
+	struct point_ring *ring = reader->ring;
+
+	/* as in ring_release(), against the SPE's head and sleeping */
+	__atomic_store_n(&ring->consumer.sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->producer.head, __ATOMIC_SEQ_CST) !=
+			reader->tail) {
+		__atomic_store_n(&ring->consumer.sleeping, 0,
+				__ATOMIC_RELAXED);
+		return 0;
+	}
+
+	reader->stalls++;
+	reader->slept = now_ms();
+	return 1;
+}
+
+void ring_wake(struct ring_reader *reader)
+{
+	__atomic_store_n(&reader->ring->consumer.sleeping, 0,
+			__ATOMIC_RELAXED);
+	reader->stall_ms += now_ms() - reader->slept;
+}
+
+void ring_wait(struct ring_reader *reader)
+{
+	unsigned int bell;
+
+	if (!ring_sleep(reader))
+		return;
+	spe_out_intr_mbox_read(reader->ctx, &bell, 1, SPE_MBOX_ALL_BLOCKING);
+	ring_wake(reader);
+}
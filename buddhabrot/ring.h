@@ -0,0 +1,46 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <libspe2.h>
+
+#include "fractal.h"
+
+/* The PPE's end of an SPE's point_ring */
+struct ring_reader {
+	struct point_ring *ring;
+	spe_context_ptr_t ctx;
+	struct point_batch **slots;
+
+	/* batches taken, and whether the last has been */
+	uint32_t tail;
+	int done;
+
+	/* how often the ring was found empty and slept on, and for how long */
+	unsigned long stalls;
+	double stall_ms, slept;
+};
+
+/* Set up @reader for @fractal's ring, which @ctx produces into */
+void ring_reader_init(struct ring_reader *reader, spe_context_ptr_t ctx,
+		struct fractal_params *fractal);
+
+/* The next batch, or NULL if the SPE hasn't published one yet */
+struct point_batch *ring_next(struct ring_reader *reader);
+
+/* Hand back the batch from ring_next(), once it's drawn */
+void ring_release(struct ring_reader *reader);
+
+/*
+ * About to sleep on @reader's interrupt mailbox: says so to the SPE, so
+ * that it rings. Returns 0, having said nothing after all, if a batch
+ * came in meanwhile.
+ */
+int ring_sleep(struct ring_reader *reader);
+
+/* Woken, or not sleeping after all, having said so with ring_sleep() */
+void ring_wake(struct ring_reader *reader);
+
+/* Sleep until @reader has a batch */
+void ring_wait(struct ring_reader *reader);
+
+#endif /* _RING_H */
@@ -0,0 +1,89 @@
+/**
+ * The orbit kernels' operations on top of the mandelbrot renderer's vector
+ * shapes, from ../mandelbrot/simd.h:
+ *
+ * shape_div(): a / b, lane by lane.
+ *
+ * shape_compress_index(): for each lane set in @bits, in order, store the
+ * index py * cols + px of the pixel at (px, py), ORed with @tag, one after
+ * another at @dst. px and py must be non-negative. Returns how many were
+ * stored. Only AVX-512 has a compress-store; the other shapes go through
+ * memory, a lane at a time.
+ */
+#ifndef _SIMD_ORBIT_H
+#define _SIMD_ORBIT_H
+
+#include "simd.h"
+
+#define SIMD_DIV(shape)							\
+static inline shape shape##_div(shape a, shape b)			\
+{									\
+	return a / b;							\
+}
+
+#define SIMD_COMPRESS_INDEX(shape)					\
+static inline int shape##_compress_index(uint32_t *dst, shape px,	\
+		shape py, int cols, uint32_t tag, unsigned int bits)	\
+{									\
+	shape##_scalar l_px[shape##_lanes] __attribute__((aligned(64)));	\
+	shape##_scalar l_py[shape##_lanes] __attribute__((aligned(64)));	\
+	int l, n = 0;							\
+									\
+	shape##_store(l_px, px);					\
+	shape##_store(l_py, py);					\
+	for (; bits; bits &= bits - 1) {				\
+		l = __builtin_ctz(bits);				\
+		dst[n++] = ((int)l_py[l] * cols + (int)l_px[l]) | tag;	\
+	}								\
+	return n;							\
+}
+
+SIMD_DIV(vf32x4)
+SIMD_COMPRESS_INDEX(vf32x4)
+SIMD_DIV(vf64x2)
+SIMD_COMPRESS_INDEX(vf64x2)
+
+#ifdef SIMD_HAVE_F32X8
+#pragma GCC push_options
+#pragma GCC target("avx2")
+SIMD_DIV(vf32x8)
+SIMD_COMPRESS_INDEX(vf32x8)
+SIMD_DIV(vf64x4)
+SIMD_COMPRESS_INDEX(vf64x4)
+#pragma GCC pop_options
+#endif
+
+#ifdef SIMD_HAVE_F32X16
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+SIMD_DIV(vf32x16)
+SIMD_DIV(vf64x8)
+
+static inline int vf32x16_compress_index(uint32_t *dst, vf32x16 px,
+		vf32x16 py, int cols, uint32_t tag, unsigned int bits)
+{
+	__m512i index = _mm512_add_epi32(_mm512_mullo_epi32(
+				_mm512_cvttps_epi32(py), _mm512_set1_epi32(cols)),
+			_mm512_cvttps_epi32(px));
+
+	_mm512_mask_compressstoreu_epi32(dst, bits,
+			_mm512_or_epi32(index, _mm512_set1_epi32(tag)));
+	return __builtin_popcount(bits);
+}
+
+static inline int vf64x8_compress_index(uint32_t *dst, vf64x8 px,
+		vf64x8 py, int cols, uint32_t tag, unsigned int bits)
+{
+	__m256i index = _mm256_add_epi32(_mm256_mullo_epi32(
+				_mm512_cvttpd_epi32(py), _mm256_set1_epi32(cols)),
+			_mm512_cvttpd_epi32(px));
+
+	/* the top eight lanes aren't in bits */
+	_mm512_mask_compressstoreu_epi32(dst, bits, _mm512_castsi256_si512(
+			_mm256_or_si256(index, _mm256_set1_epi32(tag))));
+	return __builtin_popcount(bits);
+}
+#pragma GCC pop_options
+#endif
+
+#endif /* _SIMD_ORBIT_H */
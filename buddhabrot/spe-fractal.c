@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <spu_mfcio.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 
 #include "common.h"
@@ -16,37 +17,149 @@
 #include <stdio.h>
 
 #include "fractal.h"
+#include "simd-orbit.h"
 
 // For counting the number of calls to colour_map
 int cmap_calls;
 // For counting the number of DMA put ops of pixel data
 int dma_puts;
+// For counting the number of points found to be periodic
+int periodic_points;
+// For counting the samples taken, in the interior or not
+uint samples;
+// For counting the times the ring was full, and the ticks spent waiting
+int ring_stalls;
+uint ring_stall_ticks;
+
+// Local buffer for the batch being filled. Each is put as soon as it's
+// full, and the put waited for, so one is enough.
+static struct point_batch batch;
+
+// Index into batch.point, and the colours in batch.colour
+static uint fill = 0;
+static uint n_colours = 0;
 
-// Local buffers for pixel data.  8 is more than necessary.
-static struct calculated_point points[16384] __attribute__((aligned(128)));
+// Our half of the ring, and the last we saw of the PPE's
+static struct ring_producer producer;
+static struct ring_consumer consumer;
 
-// Index into points array
-static uint fill = 0;
+#define RING_TAG 1
+
+// The colour each point adds, and the first iteration of an orbit to draw
+#define POINT_COLOUR 0x00010100
+#define MIN_POINT_I 20
+
+// The PS3 timebase, which the decrementer counts down at
+#define TIMEBASE 79800000
+
+static void ring_get_consumer(struct fractal_params *params)
+{
+	mfc_get(&consumer, (uintptr_t)&params->ring->consumer,
+			sizeof(consumer), RING_TAG, 0, 0);
+	mfc_write_tag_mask(1 << RING_TAG);
+	mfc_read_tag_status_all();
+}
+
+// Put our half of the ring, after the batch put before it, and wait for
+// both; any read of the PPE's half after this sees what came after them
+static void ring_put_producer(struct fractal_params *params)
+{
+	mfc_putf(&producer, (uintptr_t)&params->ring->producer,
+			sizeof(producer), RING_TAG, 0, 0);
+	mfc_write_tag_mask(1 << RING_TAG);
+	mfc_read_tag_status_all();
+}
+
+// Wait, if need be, for the PPE to hand back a slot
+static void ring_wait_slot(struct fractal_params *params)
+{
+	uint start;
+
+	if (producer.head - consumer.tail < RING_SLOTS)
+		return;
+	ring_get_consumer(params);
+	if (producer.head - consumer.tail < RING_SLOTS)
+		return;
+
+	++ring_stalls;
+	start = spu_read_decrementer();
+
+	// the PPE signals once it sees this, or has moved tail anyway
+	producer.waiting = 1;
+	ring_put_producer(params);
+	for (;;) {
+		ring_get_consumer(params);
+		if (producer.head - consumer.tail < RING_SLOTS)
+			break;
+		spu_read_signal1();
+	}
+	// cleared with the next head
+	producer.waiting = 0;
+
+	ring_stall_ticks += start - spu_read_decrementer();
+}
+
+// Publish the batch, and wake the PPE if it sleeps
+static void ring_publish(struct fractal_params *params, int last)
+{
+	ring_wait_slot(params);
+
+	batch.n_points = fill;
+	batch.last = last;
+
+	// only as much of the batch as is filled, rounded up to a whole
+	// number of quadwords for the DMA
+	mfc_put(&batch, (uintptr_t)params->pointbuf[producer.head % RING_SLOTS],
+			(offsetof(struct point_batch, point[fill]) + 15) & ~15,
+			RING_TAG, 0, 0);
+	++producer.head;
+	fill = 0;
+	n_colours = 0;
+	ring_put_producer(params);
+	++dma_puts;
+
+	// a bell already in the mailbox will do
+	ring_get_consumer(params);
+	if (consumer.sleeping && spu_stat_out_intr_mbox())
+		spu_write_out_intr_mbox(0);
+}
 
 /*
- * Colour the given framebuffer address pix. 
+ * Find colour in the batch's table, adding it if it's new - and sending the
+ * batch first if the table is full
+ */
+static uint colour_index(struct fractal_params *params, uint colour)
+{
+	uint c;
+
+	for(c = 0; c < n_colours && batch.colour[c] != colour; ++c)
+		;
+	if(c == n_colours) {
+		if(c == BATCH_COLOURS) {
+			ring_publish(params, 0);
+			c = 0;
+		}
+		batch.colour[c] = colour;
+		n_colours = c + 1;
+	}
+	return c;
+}
+
+/*
+ * Colour the pixel at the given index into the image. 
  * i and params may be used to select the colour.
  */
-static void write_colour(struct pixel *pix, float i, 
+static void write_colour(uint pix, float i, 
 						 struct fractal_params *params)
 {
-	// Mask for keeping track of ppe finishing with buffers
-	static int valid = 0xff;
-	static vector unsigned int sentinel = {1,0,0,0};
-
 	++cmap_calls;
 
-	uint colour;
+	uint colour, c;
 
 	// Various colouring alternatives are possible here
 
 	// ignore the first few steps - reduces backgroud noise
-	if(i<20) return;
+	if(i<MIN_POINT_I) return;
 
 /*	if(i==0) return;
 	if(params->i_max < 10000) {
@@ -59,55 +172,117 @@ static void write_colour(struct pixel *pix, float i,
 		colour = 0x00000004;
 	}*/
 
-	colour = 0x00010100;
-
-	// If starting to fill a new buffer, check that any earlier use
-	// is finished with - ppe signals completion
-	if(fill%2048 == 0) {
-		while(!(valid&(1<<(fill/2048)))) {
-			valid |= spu_read_signal1();
-		}
-	}
+	colour = POINT_COLOUR;
+	c = colour_index(params, colour);
 
 	// set values
-	points[fill].addr = (uint*)pix;
-	points[fill].i = colour;
+	batch.point[fill] = pix | c << POINT_INDEX_BITS;
 	++fill;
 
 	// if we just filled a buffer, send it to ppe
-	if(fill%2048==0) {
-		// select the specific buffer that is full
-		int f = (fill / 2048) - 1;
-		mfc_put(&points[f*2048], (uint)params->pointbuf[f], 16384, 0, 0, 0);
-		// fence a sentinel - the ppe will spin on this completing...
-		// What's a better way to achieve sync?
-		mfc_putf(&sentinel, (uint)params->sentinel[f], 16, 0, 0, 0);
-		// interrupt the ppe
-		spu_write_out_intr_mbox(f);
-		// unmask the relevant bit
-		valid&=~(1<<f);
-
-		if(fill==16384) {
-			fill = 0;
-		}
-		++dma_puts;
+	if(fill == BATCH_POINTS) {
+		ring_publish(params, 0);
 	} 
 }
 
 
+/*
+ * Is c inside the main cardioid or the period-2 bulb? Those points never
+ * escape, so leave no trail, and needn't be iterated.
+ */
+static inline int in_interior(double cr, double ci)
+{
+	double xq = cr - 0.25;
+	double ci2 = ci * ci;
+	double q = xq * xq + ci2;
+
+	return q * (q + xq) < 0.25 * ci2 ||
+		(cr + 1.0) * (cr + 1.0) + ci2 < 1.0 / 16;
+}
+
+/*
+ * The samples of one pass of render_fractal(), in the same order, for the
+ * SIMD kernels to take one at a time
+ */
+struct sample_walk {
+	struct fractal_params *params;
+	int r, row_skip, x;
+	double x_min, y_min, ci, compute_delta;
+};
+
+static void sample_walk_init(struct sample_walk *walk,
+		struct fractal_params *params, int start_row, int row_skip,
+		double compute_delta)
+{
+	/* as if at the end of the row before start_row */
+	walk->params = params;
+	walk->r = start_row - row_skip;
+	walk->row_skip = row_skip;
+	walk->x = params->cols;
+	walk->compute_delta = compute_delta;
+	walk->x_min = params->x - (params->delta * params->cols / 2);
+	walk->y_min = params->y - (params->delta * params->rows / 2);
+	walk->ci = 0;
+}
+
+/*
+ * The next sample outside the cardioid and bulb, in @cr and @ci. Returns 0
+ * when there are none left. Inline, so that it's built for each kernel's
+ * instruction set: SSE code called from an AVX loop stalls on every switch.
+ */
+static inline int next_sample(struct sample_walk *walk, double *cr,
+		double *ci)
+{
+	struct fractal_params *params = walk->params;
+
+	for (;;) {
+		if (walk->x == params->cols) {
+			walk->r += walk->row_skip;
+			if (walk->r >= params->rows)
+				return 0;
+			walk->ci = walk->y_min + walk->r * params->delta +
+				walk->compute_delta;
+			walk->x = 0;
+		}
+
+		++samples;
+		*cr = walk->x_min + walk->x * params->delta;
+		*ci = walk->ci;
+		walk->x++;
+		if (!in_interior(*cr, *ci))
+			return 1;
+	}
+}
+
+/* An escaping orbit for the SIMD kernels to retrace: c, and its escape count */
+struct orbit {
+	double cr, ci;
+	int n;
+};
+
+// how many orbits are retraced at a time
+#define ORBIT_QUEUE 256
+
 /**
  * Render a fractal, given the parameters specified in @params
- * Not optimised. Vectorise+unroll will be a big win.
- * And mix in write_colour() for more benefits.
+ * A sample at a time: the kernels in kernel.h do the same a vector at a time.
  */
 static void render_fractal(struct fractal_params *params,
 		int start_row, int row_skip, double compute_delta)
 {
-	int i, j, r, x, y;
+	int i, j, r, x, y, save_i;
 	double px, py;
 	/* complex numbers: c and z */
 	double cr, ci, zr, zi;
 	double x_min, y_min, tmp;
+	/* the z that later iterations are compared against to spot a
+	 * cycle, and how close they need to come to it. A point wrongly
+	 * taken for a cycle loses its whole trail, so this is much tighter
+	 * than a pixel; double precision leaves plenty of room for that */
+	double sr, si, tolerance;
+
+	tolerance = params->delta / 65536;
+	tolerance *= tolerance;
 
 	x_min = params->x - (params->delta * params->cols / 2);
 	y_min = params->y - (params->delta * params->rows / 2);
@@ -118,9 +293,16 @@ static void render_fractal(struct fractal_params *params,
 
 		for (x = 0; x < params->cols; x++) {
 			cr = x_min + x * params->delta;// + compute_delta;
+			++samples;
+
+			if (in_interior(cr, ci))
+				continue;
 
 			zr = 0;
 			zi = 0;
+			sr = 0;
+			si = 0;
+			save_i = 1;
 
 			for (i = 0; i < params->i_max; i++)  {
 				/* z = z^2 + c */
@@ -131,9 +313,27 @@ static void render_fractal(struct fractal_params *params,
 				/* if abs(z) > 2.0 */
 				if (unlikely(zr*zr + zi*zi > 4.0))
 					break;
+
+				/* If z has come back round to the saved
+				 * value the orbit is a cycle, and will never
+				 * escape. The saved value is moved on each
+				 * time i reaches a power of two (Brent) */
+				if (unlikely((zr - sr) * (zr - sr) +
+						(zi - si) * (zi - si) < tolerance)) {
+					i = params->i_max;
+					++periodic_points;
+					break;
+				}
+				if (i == save_i) {
+					sr = zr;
+					si = zi;
+					save_i *= 2;
+				}
 			}
 
-			if(i < params->i_max) {
+			/* retrace the orbits that escaped, if they're long
+			 * enough to draw any of */
+			if(i > MIN_POINT_I && i < params->i_max) {
 				zi = 0;
 				zr = 0;
 				for(j = 0; j < i; ++j) {
@@ -147,7 +347,14 @@ static void render_fractal(struct fractal_params *params,
 
 					px = (zi - x_min)/params->delta;
 					py = (zr - y_min)/params->delta;
-					write_colour(&params->imgbuf[(int)py*params->cols + (int)px],
+
+					/* an offscreen image can be any shape,
+					 * so the orbit may leave it */
+					if (px < 0 || px >= params->cols ||
+						py < 0 || py >= params->rows)
+						continue;
+
+					write_colour((int)py*params->cols + (int)px,
 								j, params);
 				}
 			}
@@ -155,6 +362,100 @@ static void render_fractal(struct fractal_params *params,
 	}
 }
 
+#define KERNEL_SHAPE f32x4
+#include "kernel.h"
+#undef KERNEL_SHAPE
+#define KERNEL_SHAPE f64x2
+#include "kernel.h"
+#undef KERNEL_SHAPE
+
+#ifdef SIMD_HAVE_F32X8
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define KERNEL_SHAPE f32x8
+#include "kernel.h"
+#undef KERNEL_SHAPE
+#define KERNEL_SHAPE f64x4
+#include "kernel.h"
+#undef KERNEL_SHAPE
+#pragma GCC pop_options
+#endif
+
+#ifdef SIMD_HAVE_F32X16
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define KERNEL_SHAPE f32x16
+#include "kernel.h"
+#undef KERNEL_SHAPE
+#define KERNEL_SHAPE f64x8
+#include "kernel.h"
+#undef KERNEL_SHAPE
+#pragma GCC pop_options
+#endif
+
+struct kernel {
+	const char *name, *shape;
+	int lanes;
+
+	/* an enum kernel_precision */
+	int precision;
+
+	void (*render_fractal)(struct fractal_params *params,
+			int start_row, int row_skip, double compute_delta);
+};
+
+#define KERNEL_ENTRY(vshape, prec) {					\
+	.name = simd_cat(v, simd_cat(vshape, _name)),			\
+	.shape = #vshape,						\
+	.lanes = simd_cat(v, simd_cat(vshape, _lanes)),			\
+	.precision = prec,						\
+	.render_fractal = simd_cat(render_fractal_, vshape),		\
+}
+
+/* narrowest first; -w 1 is the scalar loop */
+static const struct kernel kernels[] = {
+	{ "scalar", "f64", 1, PRECISION_F64, render_fractal },
+	KERNEL_ENTRY(f32x4, PRECISION_F32),
+	KERNEL_ENTRY(f64x2, PRECISION_F64),
+#ifdef SIMD_HAVE_F32X8
+	KERNEL_ENTRY(f32x8, PRECISION_F32),
+	KERNEL_ENTRY(f64x4, PRECISION_F64),
+#endif
+#ifdef SIMD_HAVE_F32X16
+	KERNEL_ENTRY(f32x16, PRECISION_F32),
+	KERNEL_ENTRY(f64x8, PRECISION_F64),
+#endif
+};
+
+/*
+ * Pick the widest kernel of @precision that the CPU supports, and that has
+ * no more than @lanes lanes (if non-zero). A double vector is as wide as a
+ * float one with twice the lanes. Returns NULL if every kernel of @precision
+ * is wider than @lanes.
+ */
+static const struct kernel *select_kernel(int lanes, int precision)
+{
+	const struct kernel *kernel = NULL;
+	int max_lanes = simd_max_lanes();
+	unsigned int i;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (kernels[i].precision != precision)
+			continue;
+
+		if (lanes && kernels[i].lanes > lanes)
+			break;
+
+		if (kernel && kernels[i].lanes *
+				(precision == PRECISION_F64 ? 2 : 1) > max_lanes)
+			break;
+
+		kernel = &kernels[i];
+	}
+
+	return kernel;
+}
+
 /*
  * The argv argument will be populated with the address that the PPE provided,
  * from the 4th argument to spe_context_run()
@@ -162,6 +463,7 @@ static void render_fractal(struct fractal_params *params,
 int main(uint64_t speid, uint64_t argv, uint64_t envp)
 {
 	struct spe_args args __attribute__((aligned(SPE_ALIGN)));
+	const struct kernel *kernel;
 
 	mfc_get(&args, argv, sizeof(args), 0, 0, 0);
 
@@ -170,45 +472,53 @@ int main(uint64_t speid, uint64_t argv, uint64_t envp)
 
 	cmap_calls = 0;
 	dma_puts = 0;
+	periodic_points = 0;
+	ring_stalls = 0;
+	ring_stall_ticks = 0;
+	samples = 0;
+
+	kernel = select_kernel(args.simd_lanes, args.precision);
+	if (!kernel) {
+		printf("No kernel of that precision is %d lanes or fewer\n",
+				args.simd_lanes);
+		ring_publish(&args.fractal, 1);
+		return 1;
+	}
+	if (args.thread_idx == 0)
+		printf("Using %s %s kernel\n", kernel->name, kernel->shape);
+
 	spu_write_decrementer(-1);
 
 	// Run multiple renders with offsets.  Should be factored into render_fractal()
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 0.);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 0.);
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta * 7 / 8);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta * 3 / 4);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta * 5 / 8);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta / 2);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta * 3 / 8);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta / 4);
-	render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
+	kernel->render_fractal(&args.fractal, args.thread_idx, args.n_threads, 
 					args.fractal.delta / 8);
 
-	// Send remaining points
-	if(fill%2048) {
-		// select the last buffer used
-		int f = fill / 2048;
-		mfc_put(&points[f*2048], (uint)args.fractal.pointbuf[f], 16384, 0, 0, 0);
-		// Block for completion
-		mfc_write_tag_mask(1<<0);
-		mfc_read_tag_status_all();
-		// Send a message with top bit set to indicate final item
-		spu_write_out_intr_mbox((1<<31)|f);
-		// Send another message indicating count
-		spu_write_out_intr_mbox(fill%2048);
-		++dma_puts;
-	} 
+	// Send the remaining points, and say they're the last
+	ring_publish(&args.fractal, 1);
 
 	// Report some stats
 	uint ticks = -1 - spu_read_decrementer();
 	printf("cmap calls %d ticks %u calls/tick %f\n", 
 			cmap_calls, ticks, (double)cmap_calls/ticks );
 	printf("dma puts %d\n", dma_puts);
+	printf("periodic points %d\n", periodic_points);
+	printf("ring full %d times, for %u ticks\n", ring_stalls,
+			ring_stall_ticks);
+	printf("samples %u, %.2f Msamples/s\n", samples,
+			(double)samples * TIMEBASE / ticks / 1e6);
 
 	return 0;
 }
@@ -0,0 +1,76 @@
+/**
+ * The colour pass, written against the float vector types in simd.h: a
+ * vector of escape counts at a time is turned into pixels by looking each
+ * count up in a palette, or, for continuous counts, by finding each one's
+ * hue and looking that up.
+ *
+ * spe-fractal.c includes this once for each float vector shape, as for
+ * kernel.h.
+ */
+
+#define VEC		simd_cat(v, KERNEL_SHAPE)
+#define V(op)		simd_cat(VEC, _##op)
+#define KERNEL(name)	simd_cat(name##_, KERNEL_SHAPE)
+
+/**
+ * Colour the @w x @h pixel tile whose escape counts are in @counts, into
+ * @pixels; both hold rows of TILE_W. Counts above @last_i are coloured as
+ * @last_i is, and @palette has an entry for every count up to that.
+ */
+static void KERNEL(colour_tile)(const uint32_t *palette, float last_i,
+		const float *counts, struct pixel *pixels, int w, int h)
+{
+	const VEC last = V(splat)(last_i);
+	VEC count;
+	int r, x;
+
+	for (r = 0; r < h; r++) {
+		/* a row of the tile is a whole number of vectors, so the
+		 * last one can't overrun it */
+		for (x = 0; x < w; x += V(lanes)) {
+			count = V(load)(&counts[r * TILE_W + x]);
+			count = V(sel)(count, last, V(cmpgt)(count, last));
+			V(lookup)((uint32_t *)&pixels[r * TILE_W + x],
+					palette, count);
+		}
+	}
+}
+
+/**
+ * As colour_tile(), for continuous counts. A count between n and n + 1 gets
+ * a hue between @hues[n] and @hues[n + 1], which is looked up in @palette,
+ * of PALETTE_STEPS colours for hues from 0 to 1. @hues has entries up to
+ * @last_i + 1.
+ */
+static void KERNEL(colour_tile_smooth)(const uint32_t *palette,
+		const float *hues, float last_i, const float *counts,
+		struct pixel *pixels, int w, int h)
+{
+	const VEC last = V(splat)(last_i);
+	const VEC zero = V(splat)(0.0f);
+	const VEC steps = V(splat)(PALETTE_STEPS - 1);
+	VEC count, n, lo, hi, hue;
+	int r, x;
+
+	for (r = 0; r < h; r++) {
+		for (x = 0; x < w; x += V(lanes)) {
+			count = V(load)(&counts[r * TILE_W + x]);
+			count = V(sel)(count, last, V(cmpgt)(count, last));
+			count = V(sel)(count, zero, V(cmpgt)(zero, count));
+
+			/* hue = lo + (count - n) * (hi - lo) */
+			n = V(trunc)(count);
+			lo = V(gather)(hues, n);
+			hi = V(gather)(hues + 1, n);
+			hue = V(add)(lo, V(mul)(V(sub)(count, n),
+						V(sub)(hi, lo)));
+
+			V(lookup)((uint32_t *)&pixels[r * TILE_W + x],
+					palette, V(mul)(hue, steps));
+		}
+	}
+}
+
+#undef KERNEL
+#undef V
+#undef VEC
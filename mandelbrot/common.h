@@ -17,10 +17,10 @@ struct fractal_params {
 	int cols, rows;
 
 	/* the cartesian coordinates of the center of the image */
-	float x, y;
+	double x, y;
 
 	/* per-pixel increment of x and y */
-	float delta;
+	double delta;
 
 	/* maximum number of iterations */
 	int i_max;
@@ -28,9 +28,184 @@ struct fractal_params {
 	struct pixel *imgbuf;
 };
 
+/*
+ * The image is rendered in tiles of TILE_W x TILE_H pixels, numbered in
+ * row-major order. A tile fills one 16kB DMA buffer.
+ */
+#define TILE_W 64
+#define TILE_H 64
+
+static inline int tiles_across(const struct fractal_params *fractal)
+{
+	return (fractal->cols + TILE_W - 1) / TILE_W;
+}
+
+static inline int n_tiles(const struct fractal_params *fractal)
+{
+	return tiles_across(fractal) *
+		((fractal->rows + TILE_H - 1) / TILE_H);
+}
+
+/*
+ * The highest escape count that is coloured: the start of the last block of
+ * 16 iterations. Higher counts, of points in the set or that ran out of
+ * iterations, are coloured as this one is.
+ */
+static inline int last_count(const struct fractal_params *fractal)
+{
+	return (fractal->i_max - 1) & ~15;
+}
+
+/*
+ * For histogram equalisation, each thread bins the escape counts of its
+ * tiles into a private row of last_count() + 1 bins. The rows are then
+ * summed by all the threads at once, each taking a run of hist_chunk() bins,
+ * which is a whole number of DMA lines. A row is n_threads runs long.
+ */
+static inline int hist_chunk(const struct fractal_params *fractal,
+		int n_threads)
+{
+	int bins = last_count(fractal) + 1;
+
+	return ((bins + n_threads - 1) / n_threads + 31) & ~31;
+}
+
+/*
+ * Each thread has a queue of tiles to render: the range [begin, end). The
+ * thread takes tiles from the beginning of its own queue, and when that is
+ * empty steals the second half of another thread's.
+ *
+ * Queues are only updated with atomic (lock line) DMA, so each gets a
+ * line of its own.
+ */
+struct tile_queue {
+	uint32_t begin, end;
+} __attribute__((aligned(128)));
+
+/* Per-thread statistics, DMAed back to the PPE when the thread finishes */
+struct spe_stats {
+	uint32_t tiles, steals;
+
+	/* pixels found to be in the set by orbit periodicity, rather than
+	 * run to i_max */
+	uint32_t periodic;
+
+	/* pixels filled in by subdivision, without being iterated */
+	uint32_t filled;
+
+	/* deep zooms: times a pixel's orbit was moved back onto the start of
+	 * the reference orbit */
+	uint32_t rebases;
+
+	/* lane-iterations run by the kernel, and how many of those were
+	 * spent on pixels that hadn't yet escaped */
+	uint64_t lane_iterations, useful_iterations;
+} __attribute__((aligned(16)));
+
+/* How each tile is rendered */
+enum render_mode {
+	/* a vector of pixels at a time, each lane waiting for the slowest */
+	RENDER_BLOCK,
+
+	/* as each lane finishes it moves on to the next pixel */
+	RENDER_REFILL,
+
+	/* Mariani-Silver: rectangles whose border is all the same escape
+	 * count are filled without iterating their insides; others are
+	 * split in two */
+	RENDER_SUBDIVIDE,
+};
+
+/* What a run of the SPE program does */
+enum spe_pass {
+	/* find escape counts, and colour them, or put them in counts */
+	PASS_RENDER,
+
+	/* bin the escape counts at counts into hist */
+	PASS_HISTOGRAM,
+
+	/* sum the rows of hist, into running totals in the first row */
+	PASS_SCAN,
+
+	/* colour the escape counts at counts into imgbuf */
+	PASS_COLOUR,
+};
+
+/* The precision of the escape-time kernel */
+enum kernel_precision {
+	/* twice the lanes, for views whose pixels a float can tell apart */
+	PRECISION_F32,
+
+	/* for deeper views */
+	PRECISION_F64,
+};
+
+/* A view in a batch of them, and the precision to render it in */
+struct spe_job {
+	struct fractal_params fractal;
+	int precision;
+} __attribute__((aligned(16)));
+
 struct spe_args {
 	struct fractal_params fractal;
 	int n_threads, thread_idx;
+
+	/* n_threads tile queues, one per thread */
+	struct tile_queue *queues;
+
+	/* where to put this thread's statistics */
+	struct spe_stats *stats;
+
+	/* widest SIMD kernel to use, in lanes; 0 for the widest available */
+	int simd_lanes;
+
+	/* an enum render_mode */
+	int mode;
+
+	/* an enum kernel_precision. Deep zooms are always rendered in
+	 * double precision */
+	int precision;
+
+	/* Raw output: unless counts is NULL, each pixel's escape count goes
+	 * there, as a count_bytes-byte integer in rows of cols, rather than
+	 * being coloured into imgbuf. Unless mags is NULL, |z|^2 as each
+	 * point escaped goes there too, and the counts are exact */
+	void *counts;
+	int count_bytes;
+	float *mags;
+
+	/* an enum spe_pass */
+	int pass;
+
+	/* as each tile's pixels land in imgbuf, send its number to the PPE
+	 * through the interrupt mailbox */
+	int notify_tiles;
+
+	/* don't say which kernel renders, when it's one of many renders */
+	int quiet;
+
+	/* colour by the continuous count, n + 1 - log2(log2 |z|), which
+	 * needs exact counts and mags */
+	int smooth;
+
+	/* Histogram equalisation, unless hist is NULL: n_threads rows of
+	 * n_threads * hist_chunk() bins, one for each thread */
+	uint32_t *hist;
+
+	/* For deep zooms, unless ref_len is zero: the orbit of the centre of
+	 * the image, Z_0 .. Z_{ref_len - 1}, which pixels are iterated as
+	 * offsets from */
+	double *ref_re, *ref_im;
+	int ref_len;
+
+	/* A batch of images, unless jobs is NULL: n_jobs views, rendered and
+	 * coloured in one pass. Their tiles are numbered in turn, tile t of
+	 * job j being t * n_jobs + j, so that every run of tiles has some of
+	 * each job's, cheap and dear. The PPE sets up a queue of n_jobs
+	 * times the most tiles a job has, and fractal and precision are
+	 * taken from the job of each tile as it is rendered */
+	struct spe_job *jobs;
+	int n_jobs;
 } __attribute__((aligned(SPE_ALIGN)));
 
 #endif /* _COMMON_H */
@@ -0,0 +1,173 @@
+/**
+ * Raw escape count files.
+ *
+ * A file is a header, then the counts in rows of cols, then |z|^2 as a
+ * float per pixel if the header's flags say so. Everything is in the byte
+ * order of the machine that wrote it; the header's byte order mark lets a
+ * machine of the other order refuse it rather than misread it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "count-buffer.h"
+
+#define COUNT_FILE_MAGIC	"FRCOUNTS"
+#define COUNT_FILE_VERSION	1
+#define COUNT_FILE_BOM		0x01020304
+
+/* the file has |z|^2 after the counts */
+#define COUNT_FILE_MAGS		0x1
+
+struct count_file_header {
+	char magic[8];
+	uint32_t bom, version;
+	uint32_t cols, rows, i_max;
+	uint32_t count_bytes, flags, reserved;
+	double x, y, delta;
+};
+
+static size_t n_pixels(const struct count_buffer *buf)
+{
+	return (size_t)buf->fractal.cols * buf->fractal.rows;
+}
+
+int count_buffer_init(struct count_buffer *buf,
+		const struct fractal_params *fractal, int mags)
+{
+	memset(buf, 0, sizeof(*buf));
+	buf->fractal = *fractal;
+	buf->fractal.imgbuf = NULL;
+
+	/* points that don't escape have a count of i_max */
+	buf->count_bytes = fractal->i_max < 65536 ? 2 : 4;
+
+	buf->counts = memalign(SPE_ALIGN, n_pixels(buf) * buf->count_bytes);
+	if (mags)
+		buf->mags = memalign(SPE_ALIGN, n_pixels(buf) * sizeof(float));
+
+	if (!buf->counts || (mags && !buf->mags)) {
+		perror("memalign");
+		count_buffer_free(buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+int count_buffer_save(const struct count_buffer *buf, const char *filename)
+{
+	struct count_file_header header;
+	FILE *fp;
+	int rc;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, COUNT_FILE_MAGIC, sizeof(header.magic));
+	header.bom = COUNT_FILE_BOM;
+	header.version = COUNT_FILE_VERSION;
+	header.cols = buf->fractal.cols;
+	header.rows = buf->fractal.rows;
+	header.i_max = buf->fractal.i_max;
+	header.count_bytes = buf->count_bytes;
+	header.flags = buf->mags ? COUNT_FILE_MAGS : 0;
+	header.x = buf->fractal.x;
+	header.y = buf->fractal.y;
+	header.delta = buf->fractal.delta;
+
+	fp = fopen(filename, "wb");
+	if (!fp) {
+		fprintf(stderr, "Can't open file %s: %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	rc = fwrite(&header, sizeof(header), 1, fp) != 1 ||
+		fwrite(buf->counts, buf->count_bytes, n_pixels(buf), fp)
+			!= n_pixels(buf) ||
+		(buf->mags && fwrite(buf->mags, sizeof(float), n_pixels(buf),
+			fp) != n_pixels(buf));
+
+	if (fclose(fp))
+		rc = 1;
+
+	if (rc) {
+		fprintf(stderr, "Can't write %s: %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int count_buffer_load(struct count_buffer *buf, const char *filename)
+{
+	struct count_file_header header;
+	struct fractal_params fractal;
+	FILE *fp;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		fprintf(stderr, "Can't open file %s: %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+			memcmp(header.magic, COUNT_FILE_MAGIC,
+				sizeof(header.magic))) {
+		fprintf(stderr, "%s isn't a count file\n", filename);
+		goto err_close;
+	}
+
+	if (header.bom != COUNT_FILE_BOM ||
+			header.version != COUNT_FILE_VERSION) {
+		fprintf(stderr, "%s was written by another version, or on a "
+				"machine of another byte order\n", filename);
+		goto err_close;
+	}
+
+	memset(&fractal, 0, sizeof(fractal));
+	fractal.cols = header.cols;
+	fractal.rows = header.rows;
+	fractal.i_max = header.i_max;
+	fractal.x = header.x;
+	fractal.y = header.y;
+	fractal.delta = header.delta;
+
+	if (count_buffer_init(buf, &fractal, header.flags & COUNT_FILE_MAGS))
+		goto err_close;
+
+	if (header.count_bytes != buf->count_bytes) {
+		fprintf(stderr, "%s has %d-byte counts for i_max %d\n",
+				filename, header.count_bytes, header.i_max);
+		goto err_free;
+	}
+
+	if (fread(buf->counts, buf->count_bytes, n_pixels(buf), fp)
+				!= n_pixels(buf) ||
+			(buf->mags && fread(buf->mags, sizeof(float),
+				n_pixels(buf), fp) != n_pixels(buf))) {
+		fprintf(stderr, "%s is truncated\n", filename);
+		goto err_free;
+	}
+
+	fclose(fp);
+	return 0;
+
+err_free:
+	count_buffer_free(buf);
+err_close:
+	fclose(fp);
+	return -1;
+}
+
+void count_buffer_free(struct count_buffer *buf)
+{
+	free(buf->counts);
+	free(buf->mags);
+	buf->counts = NULL;
+	buf->mags = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef _COUNT_BUFFER_H
+#define _COUNT_BUFFER_H
+
+#include <stdint.h>
+
+#include "fractal.h"
+
+/*
+ * A rendered image's raw escape counts, before colouring, so that it can be
+ * recoloured without being rendered again.
+ */
+struct count_buffer {
+	/* the view it was rendered from; imgbuf is unused */
+	struct fractal_params fractal;
+
+	/* cols * rows counts, of count_bytes (2 or 4) each */
+	void *counts;
+	int count_bytes;
+
+	/* |z|^2 as each point escaped, or NULL */
+	float *mags;
+};
+
+/*
+ * Allocate a count buffer for @fractal, with room for |z|^2 too if @mags.
+ * Returns 0 on success.
+ */
+int count_buffer_init(struct count_buffer *buf,
+		const struct fractal_params *fractal, int mags);
+
+int count_buffer_save(const struct count_buffer *buf, const char *filename);
+
+/* Read a count buffer written by count_buffer_save(). Returns 0 on success. */
+int count_buffer_load(struct count_buffer *buf, const char *filename);
+
+void count_buffer_free(struct count_buffer *buf);
+
+#endif /* _COUNT_BUFFER_H */
@@ -0,0 +1,358 @@
+/**
+ * The render daemon's job queue: a thread accepts jobs on a Unix socket and
+ * queues them, for the SPEs, which stay loaded between jobs, to take.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "daemon.h"
+#include "parse-fractal.h"
+
+/* the most a job can send */
+#define MAX_REQUEST	16384
+
+/* how long a client has to send its job, in seconds, before it's dropped;
+ * jobs are read one at a time, so a stalled one holds up the rest */
+#define REQUEST_TIMEOUT	5
+
+/* the biggest image a job can ask for, in pixels: a gigabyte of them */
+#define MAX_PIXELS	(1 << 28)
+
+struct job_queue {
+	int listen_fd;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	pthread_t thread;
+
+	/* jobs waiting, oldest first; stopping is set by a "quit" */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct render_job *head, **tail;
+	int depth, stopping;
+};
+
+static void answer(int fd, const char *line)
+{
+	ssize_t n, len = strlen(line);
+
+	while (len > 0) {
+		n = write(fd, line, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		line += n;
+		len -= n;
+	}
+}
+
+/*
+ * Read what the client sends, up to EOF, into @buf. Returns its length, or
+ * -1 if the read failed (or timed out) first, with errno set.
+ */
+static int read_request(int fd, char *buf, int size)
+{
+	int len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		n = read(fd, buf + len, size - 1 - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			buf[len] = '\0';
+			return -1;
+		}
+		if (!n)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Make a job of @request, from @fd, taking out the lines that are the
+ * daemon's and parsing the rest as a parameters file. Returns NULL, having
+ * answered the client, if it isn't a job; sets @quit if it's a "quit".
+ */
+static struct render_job *parse_job(int fd, char *request, int *quit)
+{
+	struct fractal_params *fractal;
+	struct render_job *job;
+	char *line, *next, *params;
+	FILE *fp;
+	int len = 0;
+
+	job = calloc(1, sizeof(*job));
+	params = malloc(strlen(request) + 2);
+	if (!job || !params) {
+		answer(fd, "error out of memory\n");
+		goto err;
+	}
+
+	for (line = request; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (!strncmp(line, "output", 6)) {
+			sscanf(line, "output = %4095s", job->output);
+		} else if (!strcmp(line, "quit")) {
+			*quit = 1;
+		} else {
+			len += sprintf(params + len, "%s\n", line);
+		}
+	}
+
+	if (*quit) {
+		answer(fd, "ok stopping\n");
+		goto err;
+	}
+	if (!job->output[0]) {
+		answer(fd, "error no output file\n");
+		goto err;
+	}
+
+	fp = fmemopen(params, len ? len : 1, "r");
+	fractal = fp ? parse_fractal_file(fp, "the job", NULL) : NULL;
+	if (fp)
+		fclose(fp);
+	if (!fractal) {
+		answer(fd, "error bad parameters\n");
+		goto err;
+	}
+
+	job->fractal = *fractal;
+	free(fractal);
+	free(params);
+
+	if (job->fractal.cols <= 0 || job->fractal.rows <= 0 ||
+			(uint64_t)job->fractal.cols * job->fractal.rows >
+			MAX_PIXELS) {
+		answer(fd, "error rows and cols aren't a sensible size\n");
+		free(job);
+		return NULL;
+	}
+
+	job->fd = fd;
+	return job;
+
+err:
+	free(params);
+	free(job);
+	return NULL;
+}
+
+/* Accept jobs and queue them, until one says to stop */
+static void *accept_fn(void *data)
+{
+	struct job_queue *queue = data;
+	struct render_job *job;
+	char request[MAX_REQUEST];
+	struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+	int fd, quit = 0;
+
+	while (!quit) {
+		fd = accept(queue->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+					sizeof(timeout)))
+			perror("setsockopt");
+
+		if (read_request(fd, request, sizeof(request)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				answer(fd, "error timed out\n");
+			close(fd);
+			continue;
+		}
+		job = parse_job(fd, request, &quit);
+		if (!job) {
+			close(fd);
+			continue;
+		}
+		job->arrived = now_ms();
+
+		pthread_mutex_lock(&queue->lock);
+		*queue->tail = job;
+		queue->tail = &job->next;
+		queue->depth++;
+		pthread_cond_signal(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	pthread_mutex_lock(&queue->lock);
+	queue->stopping = 1;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+struct job_queue *job_queue_listen(const char *path)
+{
+	struct job_queue *queue;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return NULL;
+	}
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue) {
+		perror("calloc");
+		return NULL;
+	}
+	queue->tail = &queue->head;
+	strcpy(queue->path, path);
+
+	queue->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (queue->listen_fd < 0) {
+		perror("socket");
+		goto err_free;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* a daemon that didn't stop cleanly leaves its socket behind */
+	unlink(path);
+	if (bind(queue->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(queue->listen_fd, 64)) {
+		perror(path);
+		goto err_close;
+	}
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+
+	if (pthread_create(&queue->thread, NULL, accept_fn, queue)) {
+		fprintf(stderr, "Couldn't start the job queue\n");
+		goto err_unlink;
+	}
+
+	return queue;
+
+err_unlink:
+	unlink(path);
+err_close:
+	close(queue->listen_fd);
+err_free:
+	free(queue);
+	return NULL;
+}
+
+int job_queue_take(struct job_queue *queue, struct render_job **jobs,
+		int max_jobs, int max_tiles, int *depth)
+{
+	int n = 0, tiles = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->head && !queue->stopping)
+		pthread_cond_wait(&queue->cond, &queue->lock);
+
+	while (queue->head && n < max_jobs) {
+		tiles += n_tiles(&queue->head->fractal);
+		if (n && tiles > max_tiles)
+			break;
+
+		jobs[n++] = queue->head;
+		queue->head = queue->head->next;
+		queue->depth--;
+	}
+	if (!queue->head)
+		queue->tail = &queue->head;
+
+	*depth = queue->depth;
+	pthread_mutex_unlock(&queue->lock);
+
+	return n;
+}
+
+void job_done(struct render_job *job, const char *line)
+{
+	answer(job->fd, line);
+	close(job->fd);
+	free(job);
+}
+
+void job_queue_close(struct job_queue *queue)
+{
+	/* the accept thread has stopped, once there are no jobs left and
+	 * job_queue_take() has said so */
+	pthread_join(queue->thread, NULL);
+	close(queue->listen_fd);
+	unlink(queue->path);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->cond);
+	free(queue);
+}
+
+int job_submit(const char *path, const char *paramsfile, const char *output)
+{
+	struct sockaddr_un addr;
+	char buf[MAX_REQUEST], cwd[PATH_MAX];
+	FILE *fp;
+	int fd, len = 0;
+
+	if (output) {
+		fp = fopen(paramsfile, "r");
+		if (!fp) {
+			fprintf(stderr, "Can't open file %s: %s\n",
+					paramsfile, strerror(errno));
+			return -1;
+		}
+		len = fread(buf, 1, sizeof(buf) - PATH_MAX - 32, fp);
+		fclose(fp);
+
+		/* the daemon may be somewhere else */
+		if (output[0] != '/' && getcwd(cwd, sizeof(cwd)))
+			len += snprintf(buf + len, sizeof(buf) - len,
+					"\noutput = %s/%s\n", cwd, output);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len,
+					"\noutput = %s\n", output);
+	} else {
+		len = sprintf(buf, "quit\n");
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	answer(fd, buf);
+	shutdown(fd, SHUT_WR);
+
+	len = read_request(fd, buf, sizeof(buf));
+	close(fd);
+	fputs(len > 0 ? buf : "error no answer\n", stdout);
+
+	return strncmp(buf, "ok", 2) ? -1 : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <limits.h>
+
+#include "fractal.h"
+
+/*
+ * A render daemon's jobs. A client connects to the daemon's Unix socket and
+ * sends a parameters file, as for -p, with an "output = <file>" line saying
+ * where the PNG goes, then shuts down its side of the connection. The
+ * daemon answers with a line: "ok ..." once the PNG is written, or
+ * "error ...". A connection that sends just "quit" stops the daemon once
+ * the jobs it has are done.
+ */
+struct render_job {
+	struct fractal_params fractal;
+	char output[PATH_MAX];
+
+	/* the client, waiting for its answer */
+	int fd;
+
+	/* when the job came in, in ms */
+	double arrived;
+
+	/* the precision it's rendered in, an enum kernel_precision, and why */
+	int precision;
+	char reason[128];
+
+	struct render_job *next;
+};
+
+struct job_queue;
+
+/* Listen for jobs on the Unix socket at @path. Returns NULL on failure. */
+struct job_queue *job_queue_listen(const char *path);
+
+/*
+ * Take the next jobs, in the order they came, waiting for one if there are
+ * none: as many as fit in @max_tiles tiles in all, up to @max_jobs, and
+ * always at least one. Returns how many were taken, with how many are left
+ * waiting in @depth; or 0 when the daemon has been told to stop and there
+ * are no jobs left.
+ */
+int job_queue_take(struct job_queue *queue, struct render_job **jobs,
+		int max_jobs, int max_tiles, int *depth);
+
+/* Answer @job's client with @answer, a line, and free @job */
+void job_done(struct render_job *job, const char *answer);
+
+/* Stop listening, and remove the socket */
+void job_queue_close(struct job_queue *queue);
+
+/*
+ * Send the parameters file @paramsfile to the daemon at @path as a job
+ * writing @output, or with @output NULL, tell it to stop; and print its
+ * answer. Returns 0 if it's "ok".
+ */
+int job_submit(const char *path, const char *paramsfile, const char *output);
+
+#endif /* _DAEMON_H */
@@ -5,6 +5,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "cp_vt.h"
 #include "cp_fb.h"
 
@@ -14,46 +19,927 @@
 #include "png.h"
 #include "fractal.h"
 #include "parse-fractal.h"
+#include "ref-orbit.h"
+#include "count-buffer.h"
+#include "offscreen.h"
+#include "pyramid.h"
+#include "daemon.h"
+#include "y4m.h"
 
 #define DEFAULT_PARAMSFILE "fractal.data"
 #define DEFAULT_OUTFILE "fractal.png"
+#define DEFAULT_PYRAMID_DIR "tiles"
+#define DEFAULT_VIDEO "fractal.y4m"
+#define DEFAULT_FPS 30
 #define DEFAULT_N_THREADS 1
+#define DEFAULT_PNG_LEVEL Z_DEFAULT_COMPRESSION
+
+/* a daemon takes jobs together while they come to at most this many tiles
+ * for each SPE */
+#define DAEMON_BATCH_TILES 8
+
+/* a parameters file's views are rendered at most this many at a time */
+#define BATCH_VIEWS 16
+
+/* the float kernel is used while neighbouring pixels are at least this many
+ * floats apart everywhere in the image, which places each c to within 1/128
+ * of a pixel */
+#define F32_MIN_STEPS 64
 
 extern spe_program_handle_t spe_fractal;
 
 struct spe_thread {
 	spe_context_ptr_t ctx;
 	pthread_t pthread;
+
+	/* set to run the context again; cleared, under pool_lock, when it
+	 * has. finished is set as soon as the context stops, for
+	 * stream_tiles() to see without the lock */
+	int pending;
+	int finished;
+
 	struct spe_args args __attribute__((aligned(SPE_ALIGN)));
 };
 
+/*
+ * The SPE contexts are created and loaded once, and each has a thread that
+ * runs it whenever it's asked to, so a pass, or a job in a daemon, doesn't
+ * pay to set them up again
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static int pool_stopping;
+
+/* every context, for their interrupt mailboxes */
+static spe_event_handler_ptr_t pool_handler;
+
 void *spethread_fn(void *data)
 {
 	struct spe_thread *spethread = data;
-	uint32_t entry = SPE_DEFAULT_ENTRY;
+	uint32_t entry;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (!spethread->pending && !pool_stopping)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		if (!spethread->pending)
+			break;
+		pthread_mutex_unlock(&pool_lock);
 
-	/* run the context, passing the address of our args structure to
-	 * the 'argv' argument to main() */
-	spe_context_run(spethread->ctx, &entry, 0,
-			&spethread->args, NULL, NULL);
+		/* run the context, passing the address of our args
+		 * structure to the 'argv' argument to main() */
+		entry = SPE_DEFAULT_ENTRY;
+		spe_context_run(spethread->ctx, &entry, 0,
+				&spethread->args, NULL, NULL);
+		__atomic_store_n(&spethread->finished, 1, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&pool_lock);
+		spethread->pending = 0;
+		pthread_cond_broadcast(&pool_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
 
 	return NULL;
 }
 
+/* Create and load a context for each of @threads, ready to run */
+static void start_pool(struct spe_thread *threads, int n_threads)
+{
+	spe_event_unit_t event;
+	int i;
+
+	pool_handler = spe_event_handler_create();
+
+	for (i = 0; i < n_threads; i++) {
+		threads[i].ctx = spe_context_create(SPE_EVENTS_ENABLE, NULL);
+		spe_program_load(threads[i].ctx, &spe_fractal);
+		threads[i].pending = 0;
+
+		event.events = SPE_EVENT_OUT_INTR_MBOX;
+		event.spe = threads[i].ctx;
+		event.data.u32 = i;
+		spe_event_handler_register(pool_handler, &event);
+
+		pthread_create(&threads[i].pthread, NULL,
+				spethread_fn, &threads[i]);
+	}
+}
+
+static void stop_pool(struct spe_thread *threads, int n_threads)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stopping = 1;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(threads[i].pthread, NULL);
+		spe_context_destroy(threads[i].ctx);
+	}
+	spe_event_handler_destroy(pool_handler);
+}
+
+/* Run the contexts of @threads, whose args are set up, without waiting */
+static void start_threads(struct spe_thread *threads, int n_threads)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < n_threads; i++) {
+		threads[i].finished = 0;
+		threads[i].pending = 1;
+	}
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Wait for the contexts of @threads to stop */
+static void wait_threads(struct spe_thread *threads, int n_threads)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < n_threads; i++)
+		while (threads[i].pending)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Somewhere for the bands of the image to go, as they are finished */
+struct band_sink {
+	void (*band_done)(void *data, int band);
+	void *data;
+};
+
+/*
+ * Collect the numbers of the tiles of @fractal that the SPEs of @threads say
+ * are in the image, through their interrupt mailboxes, and pass each band of
+ * tiles to @sink when the whole band is there. Returns when every tile is
+ * in, or every SPE has stopped.
+ */
+static void stream_tiles(struct spe_thread *threads, int n_threads,
+		spe_event_handler_ptr_t handler,
+		const struct fractal_params *fractal, struct band_sink *sink)
+{
+	spe_event_unit_t event;
+	int *band_tiles, tiles_left, i;
+	unsigned int tile;
+
+	band_tiles = calloc(n_tiles(fractal) / tiles_across(fractal),
+			sizeof(*band_tiles));
+	tiles_left = n_tiles(fractal);
+
+	while (tiles_left) {
+		if (!spe_event_wait(handler, &event, 1, 100)) {
+			/* an SPE that gave up won't send its tiles */
+			for (i = 0; i < n_threads; i++)
+				if (!__atomic_load_n(&threads[i].finished,
+							__ATOMIC_ACQUIRE))
+					break;
+			if (i == n_threads)
+				break;
+			continue;
+		}
+
+		if (spe_out_intr_mbox_read(event.spe, &tile, 1,
+					SPE_MBOX_ANY_NONBLOCKING) != 1)
+			continue;
+
+		tiles_left--;
+		if (++band_tiles[tile / tiles_across(fractal)] ==
+				tiles_across(fractal))
+			sink->band_done(sink->data,
+					tile / tiles_across(fractal));
+	}
+
+	free(band_tiles);
+}
+
+/*
+ * Deal @n tiles out evenly between the @n_threads @queues; the threads
+ * balance the load from there by stealing from each other
+ */
+static void deal_tiles(struct tile_queue *queues, int n_threads, int n)
+{
+	int i;
+
+	for (i = 0; i < n_threads; i++) {
+		queues[i].begin = (uint64_t)n * i / n_threads;
+		queues[i].end = (uint64_t)n * (i + 1) / n_threads;
+	}
+}
+
+/*
+ * Run the SPE context of each of @threads, whose args are set up, to do
+ * @pass, dealing out the tiles of @fractal between them, and wait for them
+ * all to finish. If @sink isn't NULL, the pass colours the image, and its
+ * bands are passed to @sink as they are finished.
+ */
+static void run_threads(struct spe_thread *threads, int n_threads,
+		struct tile_queue *queues, const struct fractal_params *fractal,
+		enum spe_pass pass, struct band_sink *sink)
+{
+	int i;
+
+	for (i = 0; i < n_threads; i++) {
+		threads[i].args.pass = pass;
+		threads[i].args.notify_tiles = sink != NULL;
+	}
+
+	deal_tiles(queues, n_threads, n_tiles(fractal));
+	start_threads(threads, n_threads);
+
+	if (sink)
+		stream_tiles(threads, n_threads, pool_handler, fractal, sink);
+
+	wait_threads(threads, n_threads);
+}
+
+/* A band of the image is written out, so its memory can go */
+static void release_band(void *data, struct pixel *pixels, size_t size)
+{
+	offscreen_release(data, (char *)pixels + size);
+}
+
+/* A band of the image is finished, so it can be written out */
+static void png_band_done(void *data, int band)
+{
+	png_stream_band_done(data, band);
+}
+
+/*
+ * The bands of an image mapped from a file that are finished. The image is
+ * given back, a page at a time, as far down as they all are.
+ */
+struct map_bands {
+	struct offscreen *buf;
+	const struct fractal_params *fractal;
+	uint8_t *done;
+	int next;
+};
+
+static void map_band_done(void *data, int band)
+{
+	struct map_bands *bands = data;
+	const struct fractal_params *fractal = bands->fractal;
+	int n_bands = (fractal->rows + TILE_H - 1) / TILE_H;
+
+	bands->done[band] = 1;
+	while (bands->next < n_bands && bands->done[bands->next])
+		bands->next++;
+
+	offscreen_release(bands->buf, fractal->imgbuf +
+			(size_t)(bands->next < n_bands ?
+				 bands->next * TILE_H : fractal->rows) *
+			fractal->cols);
+}
+
+/* Time writing @fractal's image to @outfile in one band, with write_png() */
+static double time_write_png(const char *outfile,
+		const struct fractal_params *fractal)
+{
+	double start = now_ms();
+
+	if (write_png(outfile, fractal->rows, fractal->cols, fractal->imgbuf))
+		return -1;
+	return now_ms() - start;
+}
+
+/*
+ * Time writing @fractal's image to @outfile with the parallel writer, at
+ * zlib @level with @n_threads threads
+ */
+static double time_png_stream(const char *outfile,
+		const struct fractal_params *fractal, int n_threads, int level)
+{
+	struct png_stream *stream;
+	double start = now_ms();
+	int b;
+
+	stream = png_stream_open(outfile, fractal->rows, fractal->cols,
+			fractal->imgbuf, TILE_H, n_threads, level, NULL, NULL);
+	if (!stream)
+		return -1;
+	for (b = 0; b < (fractal->rows + TILE_H - 1) / TILE_H; b++)
+		png_stream_band_done(stream, b);
+	if (png_stream_close(stream))
+		return -1;
+	return now_ms() - start;
+}
+
+/* The size of @filename, in bytes */
+static long file_size(const char *filename)
+{
+	struct stat st;
+
+	return stat(filename, &st) ? -1 : (long)st.st_size;
+}
+
+/*
+ * Compare write_png() with the parallel writer, at a few compression
+ * levels and from one thread up to @n_threads, writing @fractal's finished
+ * image to @outfile each time; the last is the parallel writer at @level.
+ * Returns 0 on success.
+ */
+static int bench_png(const char *outfile, const struct fractal_params *fractal,
+		int n_threads, int level)
+{
+	static const int levels[] = { 1, 6, 9 };
+	double ms, mb = fractal->rows * (double)fractal->cols *
+		sizeof(struct pixel) / 1e6;
+	unsigned int l;
+	int t;
+
+	ms = time_write_png(outfile, fractal);
+	if (ms < 0)
+		return -1;
+	printf("write_png: %.1f ms, %.1f MB/s, %ld bytes\n", ms,
+			mb * 1e3 / ms, file_size(outfile));
+
+	for (l = 0; l < sizeof(levels) / sizeof(*levels); l++) {
+		for (t = 1; t <= n_threads; t = t < n_threads && t * 2 >
+				n_threads ? n_threads : t * 2) {
+			ms = time_png_stream(outfile, fractal, t, levels[l]);
+			if (ms < 0)
+				return -1;
+			printf("level %d, %d threads: %.1f ms, %.1f MB/s, "
+					"%ld bytes\n", levels[l], t, ms,
+					mb * 1e3 / ms, file_size(outfile));
+		}
+	}
+
+	ms = time_png_stream(outfile, fractal, n_threads, level);
+	return ms < 0 ? -1 : 0;
+}
+
+/*
+ * How many floats apart neighbouring pixels of @fractal are, at @extent, the
+ * edge of the image furthest from zero, where floats are coarsest
+ */
+static double float_steps(const struct fractal_params *fractal,
+		double *extent)
+{
+	*extent = fmax(fabs(fractal->x) + fractal->delta * fractal->cols / 2,
+			fabs(fractal->y) + fractal->delta * fractal->rows / 2);
+
+	/* the spacing of floats near extent is at most extent * FLT_EPSILON */
+	return fractal->delta / (*extent * FLT_EPSILON);
+}
+
+static const char *const precision_names[] = {
+	[PRECISION_F32] = "float",
+	[PRECISION_F64] = "double",
+};
+
+/*
+ * The precision of the escape-time kernel for @fractal: @asked, if it's not
+ * -1; otherwise float, which has twice the lanes, unless its pixels are too
+ * close together for a float to place them. Says why in @reason, of @len
+ * bytes, and, if @steps isn't NULL, gives float_steps() there.
+ */
+static int pick_precision(const struct fractal_params *fractal, int asked,
+		char *reason, size_t len, double *steps)
+{
+	double extent, n;
+
+	n = float_steps(fractal, &extent);
+	if (steps)
+		*steps = n;
+
+	if (asked >= 0) {
+		snprintf(reason, len, "as asked");
+		return asked;
+	}
+
+	if (n >= F32_MIN_STEPS) {
+		snprintf(reason, len, "pixels are %.0f floats apart "
+				"at |c| = %g", n, extent);
+		return PRECISION_F32;
+	}
+
+	snprintf(reason, len, "pixels are only %.1f floats apart "
+			"at |c| = %g", n, extent);
+	return PRECISION_F64;
+}
+
+/* Choose the precision for @fractal, and say which, and why */
+static int choose_precision(const struct fractal_params *fractal)
+{
+	char reason[128];
+	double steps;
+	int precision;
+
+	precision = pick_precision(fractal, -1, reason, sizeof(reason),
+			&steps);
+	printf("Using %s kernel: %s\n", precision_names[precision], reason);
+	if (precision == PRECISION_F32)
+		return precision;
+
+	if (steps * FLT_EPSILON / DBL_EPSILON < F32_MIN_STEPS)
+		printf("Pixels are only %.1f doubles apart; "
+				"use -d for a zoom this deep\n",
+				steps * FLT_EPSILON / DBL_EPSILON);
+
+	return PRECISION_F64;
+}
+
+/* The SPEs, as they render the tiles of a pyramid */
+struct pyramid_renderer {
+	struct spe_thread *threads;
+	struct tile_queue *queues;
+	int n_threads;
+
+	/* as asked, or -1 to choose for each level */
+	int precision;
+
+	/* the counts are coloured in a pass of their own */
+	int colour_pass;
+};
+
+static int pyramid_begin_level(void *data, const struct fractal_params *level)
+{
+	struct pyramid_renderer *renderer = data;
+	int precision, i;
+
+	precision = renderer->precision >= 0 ? renderer->precision :
+		choose_precision(level);
+	for (i = 0; i < renderer->n_threads; i++) {
+		renderer->threads[i].args.precision = precision;
+		renderer->threads[i].args.quiet = 0;
+	}
+	return 0;
+}
+
+static int pyramid_render(void *data, const struct fractal_params *tile)
+{
+	struct pyramid_renderer *renderer = data;
+	int i;
+
+	for (i = 0; i < renderer->n_threads; i++)
+		memcpy(&renderer->threads[i].args.fractal, tile,
+				sizeof(*tile));
+
+	run_threads(renderer->threads, renderer->n_threads, renderer->queues,
+			tile, PASS_RENDER, NULL);
+	if (renderer->colour_pass)
+		run_threads(renderer->threads, renderer->n_threads,
+				renderer->queues, tile, PASS_COLOUR, NULL);
+
+	/* the first tile of the level said which kernel it used */
+	for (i = 0; i < renderer->n_threads; i++)
+		renderer->threads[i].args.quiet = 1;
+	return 0;
+}
+
+/*
+ * Build @pyramid with the SPEs of @threads, which are set up for its tiles,
+ * and say how quickly the tiles came. Returns 0 on success.
+ */
+static int build_pyramid(const struct pyramid *pyramid,
+		struct spe_thread *threads, int n_threads,
+		struct tile_queue *queues, int precision, int colour_pass)
+{
+	static const struct pyramid_ops ops = {
+		.begin_level = pyramid_begin_level,
+		.render = pyramid_render,
+	};
+	struct pyramid_renderer renderer;
+	struct pyramid_stats stats;
+	unsigned long made;
+	double ms, start;
+
+	renderer.threads = threads;
+	renderer.queues = queues;
+	renderer.n_threads = n_threads;
+	renderer.precision = precision;
+	renderer.colour_pass = colour_pass;
+
+	start = now_ms();
+	if (pyramid_build(pyramid, &ops, &renderer, &stats))
+		return -1;
+	ms = now_ms() - start;
+
+	made = stats.rendered + stats.downsampled + stats.cached;
+	printf("%lu tiles in %.1f ms: %.1f tiles/s\n", made, ms,
+			made * 1e3 / ms);
+	printf("%lu rendered, %.1f tiles/s\n", stats.rendered,
+			stats.render_ms ?
+				stats.rendered * 1e3 / stats.render_ms : 0.0);
+	printf("%lu downsampled, %.1f tiles/s\n", stats.downsampled,
+			stats.downsample_ms ? stats.downsampled * 1e3 /
+				stats.downsample_ms : 0.0);
+	printf("%lu from the cache\n", stats.cached);
+	return 0;
+}
+
+/* Somewhere for finished views to go */
+struct view_sink {
+	/* view @v, which is @fractal, is finished. Returns 0 on success. */
+	int (*write)(void *data, int v, const struct fractal_params *fractal);
+	void *data;
+};
+
+/* Each view to a PNG of its own, named for the -o file given as @data */
+static int png_view_write(void *data, int v,
+		const struct fractal_params *fractal)
+{
+	const char *outfile = data;
+	const char *ext = strrchr(outfile, '.');
+	char filename[PATH_MAX];
+
+	/* the view's number goes before the extension */
+	if (!ext || strchr(ext, '/'))
+		ext = outfile + strlen(outfile);
+	snprintf(filename, PATH_MAX, "%.*s-%04d%s", (int)(ext - outfile),
+			outfile, v, ext);
+
+	return write_png(filename, fractal->rows, fractal->cols,
+			fractal->imgbuf);
+}
+
+/* Each view as the next frame of a video, in order */
+static int y4m_view_write(void *data, int v,
+		const struct fractal_params *fractal)
+{
+	return y4m_write_frame(data, fractal->imgbuf);
+}
+
+/* A batch of views, and their images */
+struct view_batch {
+	struct spe_job jobs[BATCH_VIEWS] __attribute__((aligned(SPE_ALIGN)));
+	struct offscreen bufs[BATCH_VIEWS];
+	int views[BATCH_VIEWS];
+	int n_jobs, floats;
+};
+
+/*
+ * Set up batch @b of the @n_batches of @n_views @views in @batch, in the
+ * precision @asked, or choosing it for each view if -1. If @interleave, the
+ * batch has every n_batches'th view from view b; otherwise it has the views
+ * from b * BATCH_VIEWS on. Returns 0 on success.
+ */
+static int setup_batch(struct view_batch *batch,
+		const struct fractal_params *views, int n_views, int n_batches,
+		int b, int interleave, int asked)
+{
+	const struct fractal_params *view;
+	char reason[128];
+	int v, precision;
+
+	batch->n_jobs = batch->floats = 0;
+
+	for (v = interleave ? b : b * BATCH_VIEWS;
+			v < n_views && batch->n_jobs < BATCH_VIEWS;
+			v += interleave ? n_batches : 1) {
+		view = &views[v];
+		if (offscreen_alloc(&batch->bufs[batch->n_jobs], view->rows,
+					view->cols, 0))
+			return -1;
+
+		batch->jobs[batch->n_jobs].fractal = *view;
+		batch->jobs[batch->n_jobs].fractal.imgbuf =
+			batch->bufs[batch->n_jobs].pixels;
+		precision = pick_precision(view, asked, reason,
+				sizeof(reason), NULL);
+		printf("View %d: %s kernel, %s\n", v,
+				precision_names[precision], reason);
+		batch->jobs[batch->n_jobs].precision = precision;
+		batch->floats += precision == PRECISION_F32;
+		batch->views[batch->n_jobs++] = v;
+	}
+	return 0;
+}
+
+/* Pass each view of @batch to @sink, and free their images */
+static int finish_batch(struct view_batch *batch, struct view_sink *sink)
+{
+	int i, rc = 0;
+
+	for (i = 0; i < batch->n_jobs; i++) {
+		if (!rc)
+			rc = sink->write(sink->data, batch->views[i],
+					&batch->jobs[i].fractal);
+		offscreen_free(&batch->bufs[i]);
+	}
+	batch->n_jobs = 0;
+	return rc;
+}
+
+/*
+ * Render each of the @n_views @views, passing them to @sink, on the SPEs of
+ * @threads, whose args are set up but for the views. The views go in
+ * batches of up to BATCH_VIEWS, and the tiles of a batch's views are
+ * interleaved in one set of queues, for the SPEs to share as they do the
+ * tiles of one image. With @interleave, each batch has every n_batches'th
+ * view, so a zoom path's shallow views, which are quick, are rendered
+ * alongside its deep ones; otherwise the views go in order. While the SPEs
+ * render a batch, the one before is passed to @sink. Returns 0 on success.
+ */
+static int render_views(const struct fractal_params *views, int n_views,
+		struct view_sink *sink, int interleave,
+		struct spe_thread *threads, int n_threads,
+		struct tile_queue *queues, struct spe_stats *stats,
+		int precision)
+{
+	struct view_batch *batches, *batch, *last;
+	int n_batches, b, max_tiles, i;
+	unsigned long tiles = 0, steals;
+	double start, batch_start, write_start, write_ms = 0;
+	int rc = -1;
+
+	/* two batches: one rendering while the other is written */
+	batches = memalign(SPE_ALIGN, 2 * sizeof(*batches));
+	if (!batches) {
+		perror("memalign");
+		return -1;
+	}
+	batches[0].n_jobs = batches[1].n_jobs = 0;
+
+	n_batches = (n_views + BATCH_VIEWS - 1) / BATCH_VIEWS;
+	start = now_ms();
+
+	for (b = 0; b < n_batches; b++) {
+		batch = &batches[b & 1];
+		last = &batches[!(b & 1)];
+		batch_start = now_ms();
+
+		if (setup_batch(batch, views, n_views, n_batches, b,
+					interleave, precision))
+			goto out;
+
+		for (i = max_tiles = 0; i < batch->n_jobs; i++)
+			if (n_tiles(&batch->jobs[i].fractal) > max_tiles)
+				max_tiles = n_tiles(&batch->jobs[i].fractal);
+
+		for (i = 0; i < n_threads; i++) {
+			threads[i].args.jobs = batch->jobs;
+			threads[i].args.n_jobs = batch->n_jobs;
+			threads[i].args.pass = PASS_RENDER;
+			threads[i].args.notify_tiles = 0;
+			threads[i].args.quiet = 1;
+		}
+
+		deal_tiles(queues, n_threads, batch->n_jobs * max_tiles);
+		start_threads(threads, n_threads);
+
+		write_start = now_ms();
+		i = finish_batch(last, sink);
+		write_ms += now_ms() - write_start;
+
+		wait_threads(threads, n_threads);
+		if (i)
+			goto out;
+
+		for (i = 0, steals = 0; i < n_threads; i++) {
+			tiles += stats[i].tiles;
+			steals += stats[i].steals;
+		}
+
+		printf("Batch %d: %d views, %d in float, in %.1f ms, "
+				"%lu steals\n", b, batch->n_jobs,
+				batch->floats, now_ms() - batch_start, steals);
+	}
+
+	write_start = now_ms();
+	if (finish_batch(&batches[!(b & 1)], sink))
+		goto out;
+	write_ms += now_ms() - write_start;
+
+	printf("%d views, %lu tiles, in %.1f ms: %.1f views/s; "
+			"%.1f ms writing them out\n", n_views, tiles,
+			now_ms() - start, n_views * 1e3 / (now_ms() - start),
+			write_ms);
+	rc = 0;
+
+out:
+	for (i = 0; i < 2; i++)
+		while (batches[i].n_jobs--)
+			offscreen_free(&batches[i].bufs[batches[i].n_jobs]);
+	free(batches);
+	return rc;
+}
+
+/*
+ * Render each job of a daemon on the SPEs of @threads, whose args are set up
+ * but for the view and the tiles, with @precision, or choosing it for each
+ * job if -1. Jobs small enough to share the SPEs are taken together, each on
+ * some of them, in proportion to its tiles. Returns 0 once told to stop.
+ */
+static int serve_jobs(struct job_queue *queue, struct spe_thread *threads,
+		int n_threads, struct tile_queue *queues,
+		struct spe_stats *stats, int precision)
+{
+	struct render_job **jobs;
+	struct offscreen *bufs;
+	struct fractal_params *fractal;
+	char answer[PATH_MAX + 256];
+	double start, done;
+	int *workers, n, depth, tiles, spare, off, i, j;
+
+	jobs = malloc(n_threads * sizeof(*jobs));
+	bufs = malloc(n_threads * sizeof(*bufs));
+	workers = malloc(n_threads * sizeof(*workers));
+	if (!jobs || !bufs || !workers) {
+		perror("malloc");
+		free(jobs);
+		free(bufs);
+		free(workers);
+		return -1;
+	}
+
+	while ((n = job_queue_take(queue, jobs, n_threads,
+					n_threads * DAEMON_BATCH_TILES, &depth))) {
+		start = now_ms();
+
+		/* a job without an image to render into is answered now */
+		for (i = j = 0; i < n; i++) {
+			fractal = &jobs[i]->fractal;
+			if (offscreen_alloc(&bufs[j], fractal->rows,
+						fractal->cols, 0)) {
+				job_done(jobs[i], "error out of memory\n");
+				continue;
+			}
+			fractal->imgbuf = bufs[j].pixels;
+			jobs[j++] = jobs[i];
+		}
+		n = j;
+		if (!n)
+			continue;
+
+		/* each job gets an SPE, and the rest go by the tiles */
+		for (i = tiles = 0; i < n; i++)
+			tiles += n_tiles(&jobs[i]->fractal);
+		for (i = 0, spare = n_threads - n; i < n; i++) {
+			workers[i] = 1 + (uint64_t)(n_threads - n) *
+				n_tiles(&jobs[i]->fractal) / tiles;
+			spare -= workers[i] - 1;
+		}
+		for (i = 0; spare; i = (i + 1) % n, spare--)
+			workers[i]++;
+
+		for (i = off = 0; i < n; off += workers[i++]) {
+			fractal = &jobs[i]->fractal;
+			jobs[i]->precision = pick_precision(fractal, precision,
+					jobs[i]->reason,
+					sizeof(jobs[i]->reason), NULL);
+			for (j = 0; j < workers[i]; j++) {
+				struct spe_args *args = &threads[off + j].args;
+
+				memcpy(&args->fractal, fractal,
+						sizeof(*fractal));
+				args->n_threads = workers[i];
+				args->thread_idx = j;
+				args->queues = queues + off;
+				args->stats = stats + off;
+				args->precision = jobs[i]->precision;
+				args->pass = PASS_RENDER;
+			}
+			deal_tiles(queues + off, workers[i], n_tiles(fractal));
+			start_threads(threads + off, workers[i]);
+		}
+		wait_threads(threads, off);
+
+		for (i = 0; i < n; i++) {
+			fractal = &jobs[i]->fractal;
+			if (write_png(jobs[i]->output, fractal->rows,
+						fractal->cols, fractal->imgbuf)) {
+				snprintf(answer, sizeof(answer),
+						"error can't write %s\n",
+						jobs[i]->output);
+			} else {
+				done = now_ms();
+				snprintf(answer, sizeof(answer),
+						"ok %s %.1f ms (%.1f ms queued, "
+						"%d waiting; %s kernel, %s)\n",
+						jobs[i]->output,
+						done - jobs[i]->arrived,
+						start - jobs[i]->arrived, depth,
+						precision_names[jobs[i]->precision],
+						jobs[i]->reason);
+				printf("%dx%d on %d SPEs, %d jobs in the batch: "
+						"%.1f ms, %.1f ms queued, "
+						"%d waiting; %s kernel, %s\n",
+						fractal->cols, fractal->rows,
+						workers[i], n,
+						done - jobs[i]->arrived,
+						start - jobs[i]->arrived, depth,
+						precision_names[jobs[i]->precision],
+						jobs[i]->reason);
+			}
+			job_done(jobs[i], answer);
+			offscreen_free(&bufs[i]);
+		}
+		fflush(stdout);
+	}
+
+	free(jobs);
+	free(bufs);
+	free(workers);
+	return 0;
+}
+
+/*
+ * Stay up, with the SPEs loaded, rendering the jobs sent to the socket at
+ * @path, until one says to stop. Returns 0 on success.
+ */
+static int run_daemon(const char *path, int n_threads, int simd_lanes,
+		int mode, int precision)
+{
+	struct spe_thread *threads;
+	struct tile_queue *queues;
+	struct spe_stats *stats;
+	struct job_queue *queue;
+	int i, rc;
+
+	threads = memalign(SPE_ALIGN, n_threads * sizeof(*threads));
+	queues = memalign(SPE_ALIGN, n_threads * sizeof(*queues));
+	stats = memalign(SPE_ALIGN, n_threads * sizeof(*stats));
+
+	for (i = 0; i < n_threads; i++) {
+		memset(&threads[i].args, 0, sizeof(threads[i].args));
+		threads[i].args.simd_lanes = simd_lanes;
+		threads[i].args.mode = mode;
+		threads[i].args.quiet = 1;
+	}
+
+	start_pool(threads, n_threads);
+
+	queue = job_queue_listen(path);
+	if (!queue) {
+		stop_pool(threads, n_threads);
+		return -1;
+	}
+	printf("Rendering jobs from %s on %d SPEs\n", path, n_threads);
+	fflush(stdout);
+
+	rc = serve_jobs(queue, threads, n_threads, queues, stats,
+			precision);
+
+	job_queue_close(queue);
+	stop_pool(threads, n_threads);
+	free(threads);
+	free(queues);
+	free(stats);
+	return rc;
+}
+
 int main(int argc, char **argv)
 {
 	struct spe_thread *threads;
+	struct tile_queue *queues;
+	struct spe_stats *stats;
 	struct fractal_params *fractal;
-	const char *outfile, *paramsfile;
-	int opt, n_threads, i;
+	struct fractal_view view;
+	struct ref_orbit orbit;
+	struct count_buffer counts;
+	struct offscreen offscreen;
+	struct png_stream *stream;
+	struct band_sink sink, *bands_out;
+	struct map_bands map_bands;
+	struct pyramid pyramid;
+	struct y4m_stream *video;
+	struct view_sink views_out;
+	cp_vt vt;
+	cp_fb fb;
+	const char *outfile, *paramsfile, *countsfile, *recolourfile, *cachedir;
+	const char *serve, *submit, *stop;
+	char cachepath[PATH_MAX];
+	int opt, n_threads, simd_lanes, mode, deep, precision, mags, n_views, i;
+	int y4m, fps;
+	int smooth, equalise, headless, hugepages, mapped;
+	int png_threads, png_level, png_bench, pyramid_levels;
+	uint32_t *hist;
+	uint64_t lane_iterations, useful_iterations, periodic, filled, rebases;
+	double start, coloured;
 
 	/* set up default arguments */
 	paramsfile = DEFAULT_PARAMSFILE;
 	outfile = DEFAULT_OUTFILE;
+	countsfile = recolourfile = cachedir = NULL;
+	n_views = 1;
+	y4m = 0;
+	fps = DEFAULT_FPS;
+	serve = submit = stop = NULL;
 	n_threads = DEFAULT_N_THREADS;
+	simd_lanes = 0;
+	mode = RENDER_BLOCK;
+	deep = 0;
+	precision = -1;
+	mags = 0;
+	smooth = equalise = 0;
+	headless = hugepages = mapped = 0;
+	png_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	png_level = DEFAULT_PNG_LEVEL;
+	png_bench = 0;
+	pyramid_levels = -1;
+	hist = NULL;
+	stream = NULL;
+	bands_out = NULL;
 
 	/* parse arguments into datafile and outfile  */
-	while ((opt = getopt(argc, argv, "p:o:n:")) != -1) {
+	while ((opt = getopt(argc, argv, "p:o:n:w:rmdk:c:C:zseHLMj:l:bT:D:S:J:Q:yf:")) != -1) {
 		switch (opt) {
 		case 'p':
 			paramsfile = optarg;
@@ -64,48 +950,498 @@ int main(int argc, char **argv)
 		case 'n':
 			n_threads = atoi(optarg);
 			break;
+		case 'w':
+			simd_lanes = atoi(optarg);
+			break;
+		case 'r':
+			mode = RENDER_REFILL;
+			break;
+		case 'm':
+			mode = RENDER_SUBDIVIDE;
+			break;
+		case 'd':
+			deep = 1;
+			break;
+		case 'c':
+			countsfile = optarg;
+			break;
+		case 'C':
+			recolourfile = optarg;
+			break;
+		case 'z':
+			mags = 1;
+			break;
+		case 's':
+			smooth = 1;
+			break;
+		case 'e':
+			equalise = 1;
+			break;
+		case 'T':
+			pyramid_levels = atoi(optarg);
+			headless = 1;
+			break;
+		case 'D':
+			cachedir = optarg;
+			break;
+		case 'S':
+			serve = optarg;
+			break;
+		case 'J':
+			submit = optarg;
+			break;
+		case 'Q':
+			stop = optarg;
+			break;
+		case 'y':
+			y4m = 1;
+			break;
+		case 'f':
+			fps = atoi(optarg);
+			break;
+		case 'M':
+			mapped = 1;
+			headless = 1;
+			break;
+		case 'L':
+			hugepages = 1;
+			/* fall through */
+		case 'H':
+			headless = 1;
+			break;
+		case 'j':
+			png_threads = atoi(optarg);
+			break;
+		case 'l':
+			png_level = atoi(optarg);
+			break;
+		case 'b':
+			png_bench = 1;
+			break;
+		case 'k':
+			if (!strcmp(optarg, "float")) {
+				precision = PRECISION_F32;
+				break;
+			} else if (!strcmp(optarg, "double")) {
+				precision = PRECISION_F64;
+				break;
+			}
+			/* fall through */
 		default:
 			fprintf(stderr, "Usage: %s [-p paramsfile] "
-						"[-o outfile] [-n n_threads]\n",
+						"[-o outfile] [-n n_threads] "
+						"[-w simd_lanes] [-r|-m] [-d] "
+						"[-k float|double] "
+						"[-c countsfile [-z]] "
+						"[-C countsfile] [-s] [-e] "
+						"[-H|-L [-j png_threads] "
+						"[-l png_level] [-b]] "
+						"[-M] "
+						"[-T levels [-D cachedir]] "
+						"[-S socket|-J socket|-Q socket] "
+						"[-y [-f fps]]\n",
 						argv[0]);
 			return EXIT_FAILURE;
 		}
 	}
 
-	/* parse the input datafile */
-	fractal = parse_fractal(paramsfile);
-	if (!fractal)
+	if (png_threads < 1)
+		png_threads = 1;
+	if (png_level < Z_DEFAULT_COMPRESSION || png_level > 9) {
+		fprintf(stderr, "-l takes a zlib compression level, 0 to 9\n");
 		return EXIT_FAILURE;
+	}
+
+	if (pyramid_levels >= 0 && (recolourfile || countsfile ||
+				equalise || deep || mapped || png_bench)) {
+		fprintf(stderr, "-T can't be used with -C, -c, -e, -d, -M "
+				"or -b\n");
+		return EXIT_FAILURE;
+	}
+	if (pyramid_levels > PYRAMID_MAX_LEVEL) {
+		fprintf(stderr, "A pyramid can be at most %d levels deep\n",
+				PYRAMID_MAX_LEVEL);
+		return EXIT_FAILURE;
+	}
+
+	if (mapped && png_bench) {
+		fprintf(stderr, "-b is for PNGs, not -M\n");
+		return EXIT_FAILURE;
+	}
+
+	if (fps < 1) {
+		fprintf(stderr, "-f takes a number of frames a second\n");
+		return EXIT_FAILURE;
+	}
+
+	if (mags && !countsfile) {
+		fprintf(stderr, "-z is only useful with -c\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the video has stdout to itself; anything else said goes to
+	 * stderr */
+	if (y4m && !strcmp(outfile, "-") && y4m_take_stdout())
+		return EXIT_FAILURE;
+
+	/* a daemon's client only sends it the parameters file */
+	if (submit || stop)
+		return job_submit(submit ? submit : stop, paramsfile,
+				submit ? outfile : NULL) ?
+			EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (serve) {
+		if (deep || countsfile || recolourfile || smooth || equalise ||
+				headless) {
+			fprintf(stderr, "-S renders PNGs of plain colour; it "
+					"can't be used with -d, -c, -C, -s, -e "
+					"or -H\n");
+			return EXIT_FAILURE;
+		}
+		return run_daemon(serve, n_threads, simd_lanes, mode,
+				precision) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	memset(&orbit, 0, sizeof(orbit));
+	memset(&counts, 0, sizeof(counts));
+
+	if (recolourfile) {
+		/* just colour a previous render's escape counts */
+		if (count_buffer_load(&counts, recolourfile))
+			return EXIT_FAILURE;
+		fractal = &counts.fractal;
+		printf("Recolouring %dx%d escape counts from %s\n",
+				fractal->cols, fractal->rows, recolourfile);
+
+		if (smooth && !counts.mags) {
+			fprintf(stderr, "%s has no |z|^2 to colour smoothly "
+					"with; render it with -z\n",
+					recolourfile);
+			return EXIT_FAILURE;
+		}
+
+	} else {
+		/* parse the input datafile */
+		fractal = parse_fractal_views(paramsfile, &view, &n_views);
+		if (!fractal)
+			return EXIT_FAILURE;
+
+		/* many views are each rendered to a PNG, or a frame of a
+		 * video, in plain colour; everything from here on is the
+		 * first view */
+		if (n_views > 1 || y4m) {
+			if (deep || countsfile || smooth || equalise ||
+					pyramid_levels >= 0 || mapped ||
+					png_bench) {
+				fprintf(stderr, "Many views, or a video, "
+						"can't be rendered with -d, "
+						"-c, -s, -e, -T, -M or -b\n");
+				return EXIT_FAILURE;
+			}
+			for (i = 0; i < n_views; i++) {
+				if (fractal[i].cols <= 0 ||
+						fractal[i].rows <= 0 ||
+						(uint64_t)n_tiles(&fractal[i]) *
+						BATCH_VIEWS > INT_MAX) {
+					fprintf(stderr, "View %d of %s needs "
+							"a sensible size\n",
+							i, paramsfile);
+					return EXIT_FAILURE;
+				}
+				if (y4m && (fractal[i].cols != fractal->cols ||
+						fractal[i].rows !=
+						fractal->rows)) {
+					fprintf(stderr, "View %d of %s isn't "
+							"the size of the "
+							"video\n",
+							i, paramsfile);
+					return EXIT_FAILURE;
+				}
+			}
+			headless = 1;
+		}
+
+		/* a pyramid is of the view in the file, squared up into a
+		 * single tile at level 0; everything from here on is the
+		 * size of a tile */
+		if (pyramid_levels >= 0) {
+			if (!fractal->cols || !fractal->rows)
+				fractal->cols = fractal->rows = PYRAMID_TILE;
+			memset(&pyramid, 0, sizeof(pyramid));
+			pyramid.region = *fractal;
+			pyramid.region.delta *= (fractal->cols > fractal->rows ?
+					fractal->cols : fractal->rows) /
+				(double)PYRAMID_TILE;
+			fractal->cols = fractal->rows = PYRAMID_TILE;
+		}
+
+		/* without a size, draw the whole screen */
+		if (!fractal->cols || !fractal->rows) {
+			if (headless) {
+				fprintf(stderr, "No rows and cols in %s, "
+						"and no screen to size the "
+						"image to\n", paramsfile);
+				return EXIT_FAILURE;
+			}
+			if (fb_screen_size(fractal))
+				return EXIT_FAILURE;
+		}
+
+		/* for a deep zoom, the orbit of the centre, which the SPEs
+		 * iterate each pixel relative to */
+		if (deep) {
+			if (ref_orbit_init(&orbit, view.x, view.y,
+						fractal->delta, fractal->i_max))
+				return EXIT_FAILURE;
+			printf("Reference orbit: %d iterations at %d bits\n",
+					orbit.len - 1, orbit.bits);
+		} else if ((pyramid_levels >= 0 || n_views > 1 || y4m) &&
+				precision < 0) {
+			/* chosen for each level, or batch of views */
+		} else if (precision < 0) {
+			precision = choose_precision(fractal);
+		} else {
+			printf("Using %s kernel, as asked\n",
+					precision_names[precision]);
+		}
+
+		/* smooth colouring and equalisation need all the counts
+		 * before colouring any, so render in two passes whether or
+		 * not they're saved */
+		if ((countsfile || smooth || equalise) &&
+				count_buffer_init(&counts, fractal,
+					mags || smooth))
+			return EXIT_FAILURE;
+	}
+
+	/* the tiles are numbered in an int, and the histogram bins count
+	 * pixels in 32 bits; pixels themselves are indexed in 64 */
+	if ((uint64_t)tiles_across(fractal) *
+			((fractal->rows + TILE_H - 1) / TILE_H) > INT_MAX) {
+		fprintf(stderr, "%dx%d is too many tiles\n",
+				fractal->cols, fractal->rows);
+		return EXIT_FAILURE;
+	}
+	if (equalise && (uint64_t)fractal->cols * fractal->rows >
+			UINT32_MAX) {
+		fprintf(stderr, "Too many pixels to equalise\n");
+		return EXIT_FAILURE;
+	}
+
+	if (pyramid_levels >= 0 || n_views > 1 || y4m) {
+		/* each tile or view gets an image of its own */
+	} else if (mapped) {
+		/* render straight into the file, giving back each band of it
+		 * once it's finished */
+		if (offscreen_map(&offscreen, outfile, fractal->rows,
+					fractal->cols))
+			return EXIT_FAILURE;
+		fractal->imgbuf = offscreen.pixels;
+
+		map_bands.buf = &offscreen;
+		map_bands.fractal = fractal;
+		map_bands.done = calloc((fractal->rows + TILE_H - 1) / TILE_H,
+				sizeof(*map_bands.done));
+		map_bands.next = 0;
+		sink.band_done = map_band_done;
+		sink.data = &map_bands;
+		bands_out = &sink;
+
+	} else if (headless) {
+		if (offscreen_alloc(&offscreen, fractal->rows, fractal->cols,
+					hugepages))
+			return EXIT_FAILURE;
+		fractal->imgbuf = offscreen.pixels;
+
+		/* the PNG is written out a band of tiles at a time while
+		 * the image is coloured, each band given back once it's
+		 * written; unless the whole image is kept to try the PNG
+		 * writers on */
+		if (!png_bench) {
+			stream = png_stream_open(outfile, fractal->rows,
+					fractal->cols, fractal->imgbuf, TILE_H,
+					png_threads, png_level, release_band,
+					&offscreen);
+			if (!stream)
+				return EXIT_FAILURE;
+			sink.band_done = png_band_done;
+			sink.data = stream;
+			bands_out = &sink;
+		}
+	} else {
+		cp_vt_open_graphics(&vt);
+		cp_fb_open(&fb, 1);
+		fractal->imgbuf = (void *)fb.draw_addr[0];
+	}
 
- 	cp_vt vt;
- 	cp_fb fb;
-	cp_vt_open_graphics(&vt);
- 	cp_fb_open(&fb,1);
- 	fractal->imgbuf = (void*)fb.draw_addr[0];
-	
 	/* allocate an array for the SPE threads */
 	threads = memalign(SPE_ALIGN, n_threads * sizeof(*threads));
+	queues = memalign(SPE_ALIGN, n_threads * sizeof(*queues));
+	stats = memalign(SPE_ALIGN, n_threads * sizeof(*stats));
+
+	/* a row of histogram bins for each thread */
+	if (equalise)
+		hist = memalign(SPE_ALIGN, (size_t)n_threads * n_threads *
+				hist_chunk(fractal, n_threads) * sizeof(*hist));
 
 	for (i = 0; i < n_threads; i++) {
 		/* copy the fractal data into this thread's args */
+		memset(&threads[i].args, 0, sizeof(threads[i].args));
 		memcpy(&threads[i].args.fractal, fractal, sizeof(*fractal));
 
 		/* set thread-specific arguments */
 		threads[i].args.n_threads = n_threads;
 		threads[i].args.thread_idx = i;
+		threads[i].args.queues = queues;
+		threads[i].args.stats = stats;
+		threads[i].args.simd_lanes = simd_lanes;
+		threads[i].args.mode = mode;
+		threads[i].args.precision = precision;
+		threads[i].args.ref_re = orbit.re;
+		threads[i].args.ref_im = orbit.im;
+		threads[i].args.ref_len = orbit.len;
+		threads[i].args.counts = counts.counts;
+		threads[i].args.count_bytes = counts.count_bytes;
+		threads[i].args.mags = counts.mags;
+		threads[i].args.smooth = smooth;
+		threads[i].args.hist = hist;
+	}
 
-		threads[i].ctx = spe_context_create(0, NULL);
-		spe_program_load(threads[i].ctx, &spe_fractal);
-		pthread_create(&threads[i].pthread, NULL,
-				spethread_fn, &threads[i]);
+	start_pool(threads, n_threads);
+
+	if (pyramid_levels >= 0) {
+		if (!strcmp(outfile, DEFAULT_OUTFILE))
+			outfile = DEFAULT_PYRAMID_DIR;
+		if (!cachedir) {
+			snprintf(cachepath, sizeof(cachepath), "%s/cache",
+					outfile);
+			cachedir = cachepath;
+		}
+
+		pyramid.levels = pyramid_levels;
+		pyramid.dir = outfile;
+		pyramid.cache = cachedir;
+		pyramid.smooth = smooth;
+		pyramid.precision = precision;
+
+		i = build_pyramid(&pyramid, threads, n_threads, queues,
+				precision, counts.counts != NULL);
+		stop_pool(threads, n_threads);
+		return i ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
-	/* wait for the threads to finish */
-	for (i = 0; i < n_threads; i++)
-		pthread_join(threads[i].pthread, NULL);
+	if (y4m) {
+		if (!strcmp(outfile, DEFAULT_OUTFILE))
+			outfile = DEFAULT_VIDEO;
+		video = y4m_open(outfile, fractal->cols, fractal->rows, fps);
+		if (!video) {
+			stop_pool(threads, n_threads);
+			return EXIT_FAILURE;
+		}
+
+		/* the frames go in order, so the views are rendered in
+		 * order */
+		views_out.write = y4m_view_write;
+		views_out.data = video;
+		i = render_views(fractal, n_views, &views_out, 0, threads,
+				n_threads, queues, stats, precision);
+		if (y4m_close(video))
+			i = -1;
+		stop_pool(threads, n_threads);
+		return i ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (n_views > 1) {
+		views_out.write = png_view_write;
+		views_out.data = (void *)outfile;
+		i = render_views(fractal, n_views, &views_out, 1, threads,
+				n_threads, queues, stats, precision);
+		stop_pool(threads, n_threads);
+		return i ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!recolourfile) {
+		start = now_ms();
+		run_threads(threads, n_threads, queues, fractal, PASS_RENDER,
+				counts.counts ? NULL : bands_out);
+		printf("Rendered in %.1f ms\n", now_ms() - start);
+
+		/* the fraction of the kernel's lane-iterations that went on
+		 * pixels that were still being iterated, rather than on idle
+		 * lanes */
+		lane_iterations = useful_iterations = periodic = filled =
+			rebases = 0;
+		for (i = 0; i < n_threads; i++) {
+			printf("SPE %d: %u tiles, %u steals, %.1f%% lane "
+					"utilisation, %u periodic pixels\n",
+					i, stats[i].tiles, stats[i].steals,
+					stats[i].lane_iterations ?
+						100.0 * stats[i].useful_iterations /
+						stats[i].lane_iterations : 0.0,
+					stats[i].periodic);
+			lane_iterations += stats[i].lane_iterations;
+			useful_iterations += stats[i].useful_iterations;
+			periodic += stats[i].periodic;
+			filled += stats[i].filled;
+			rebases += stats[i].rebases;
+		}
+		printf("%llu pixels retired by periodicity checking\n",
+				(unsigned long long)periodic);
+		if (deep)
+			printf("%llu rebases onto the reference orbit\n",
+					(unsigned long long)rebases);
+		if (mode == RENDER_SUBDIVIDE)
+			printf("%llu pixels filled by subdivision\n",
+					(unsigned long long)filled);
+		printf("lane utilisation %.1f%%\n", lane_iterations ?
+				100.0 * useful_iterations / lane_iterations : 0.0);
+
+		if (countsfile && count_buffer_save(&counts, countsfile))
+			return EXIT_FAILURE;
+	}
+
+	/* Equalisation: the render pass has binned the counts, unless there
+	 * wasn't one, then the threads add up the bins between them */
+	if (equalise) {
+		start = now_ms();
+		if (recolourfile)
+			run_threads(threads, n_threads, queues, fractal,
+					PASS_HISTOGRAM, NULL);
+		run_threads(threads, n_threads, queues, fractal, PASS_SCAN,
+				NULL);
+		printf("Equalised in %.1f ms\n", now_ms() - start);
+	}
+
+	/* the counts are coloured in a pass of their own */
+	if (counts.counts) {
+		start = now_ms();
+		run_threads(threads, n_threads, queues, fractal, PASS_COLOUR,
+				bands_out);
+		printf("Coloured in %.1f ms\n", now_ms() - start);
+	}
 
-	cp_vt_close(&vt);
-	cp_fb_close(&fb);
+	if (headless) {
+		/* the image has nowhere else to go; most of it should have
+		 * gone already */
+		coloured = now_ms();
+		if (mapped) {
+			free(map_bands.done);
+			printf("Wrote %s\n", outfile);
+		} else if (png_bench) {
+			if (bench_png(outfile, fractal, png_threads, png_level))
+				return EXIT_FAILURE;
+		} else {
+			if (png_stream_close(stream))
+				return EXIT_FAILURE;
+			printf("Wrote %s %.1f ms after the last tile\n",
+					outfile, now_ms() - coloured);
+		}
+		offscreen_free(&offscreen);
+	} else {
+		cp_vt_close(&vt);
+		cp_fb_close(&fb);
+	}
 
+	stop_pool(threads, n_threads);
 	return EXIT_SUCCESS;
 }
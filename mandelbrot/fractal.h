@@ -3,4 +3,17 @@
 
 #include "common.h"
 
+#ifndef __SPU__
+#include <time.h>
+
+/* Milliseconds since some fixed point */
+static inline double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+#endif
+
 #endif /* _FRACTAL_H */
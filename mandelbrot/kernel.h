@@ -0,0 +1,443 @@
+/**
+ * The escape-time kernel, written against the vector types in simd.h.
+ *
+ * spe-fractal.c includes this once for each vector shape, with KERNEL_SHAPE
+ * defined to the shape's suffix (f32x4, f64x4, ...). The functions defined
+ * here get that suffix too, so render_fractal_f32x8() is the eight-lane
+ * float kernel. The arithmetic is all in the shape's scalar type, so the
+ * f64 kernels can go about 2^29 times deeper than the f32 ones, with half
+ * the lanes.
+ *
+ * With KERNEL_ESCAPE_Z defined as well, the functions are named
+ * render_fractal_z_f32x8() and so on. Those count iterations exactly, rather
+ * than in blocks of 16, and also record |z|^2 as each point escapes, into
+ * their mags argument. That costs a couple of instructions an iteration,
+ * so the other kernels ignore mags.
+ */
+
+#define VEC		simd_cat(v, KERNEL_SHAPE)
+#define V(op)		simd_cat(VEC, _##op)
+#ifdef KERNEL_ESCAPE_Z
+#define KERNEL(name)	simd_cat(name##_z_, KERNEL_SHAPE)
+
+/* count each iteration in vn, so that a lane still going after iteration i
+ * has a count of i + 1, and keep |z|^2 from the iteration in which each lane
+ * escaped */
+#define COUNT		vn
+#define BLOCK_START()	vn = vi
+#define NEXT_COUNT()	vn = V(add)(vn, one)
+#define RECORD_MAG()	escaped_mag = V(sel)(mag, escaped_mag, escaped)
+#else
+#define KERNEL(name)	simd_cat(name##_, KERNEL_SHAPE)
+
+#define COUNT		vi
+#define BLOCK_START()
+#define NEXT_COUNT()
+#define RECORD_MAG()
+#endif
+
+/*
+ * One iteration of every lane, recording in escaped_i the iteration count
+ * of the lanes that are still going
+ */
+#define ITERATE()	/* z = z^2 + c */					\
+			tmp = V(add)(V(sub)(V(mul)(zr, zr),			\
+					V(mul)(zi, zi)), cr);			\
+			zi = V(add)(V(mul)(V(mul)(two, zr), zi), ci);		\
+			zr = tmp;						\
+			mag = V(add)(V(mul)(zr, zr), V(mul)(zi, zi));		\
+										\
+			/* escaped |= abs(z) > 2.0 */				\
+			RECORD_MAG();						\
+			escaped = V(mask_or)(escaped, V(cmpgt)(mag, limit));	\
+										\
+			/* escaped_i = escaped ? escaped_i : i */		\
+			NEXT_COUNT();						\
+			escaped_i = V(sel)(COUNT, escaped_i, escaped)
+
+/*
+ * An orbit that has settled into a cycle will never escape. Every 16
+ * iterations each lane's z is compared with a saved z, which is moved on
+ * (Brent's method) when the iteration count reaches a power of two, so a
+ * cycle of any length is caught within a few times that length. z is
+ * considered to have come back round when it is within a small fraction of
+ * a pixel of the saved value.
+ */
+#define PERIOD_TOLERANCE(delta)	((delta) / 64)
+
+#define ITERATE_16()	BLOCK_START();						\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE();		\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE();		\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE();		\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE()
+
+/*
+ * The corner of the image, and the spacing of its pixels, in the kernel's
+ * precision
+ */
+static inline void KERNEL(view)(const struct fractal_params *params,
+		V(scalar) *x_min, V(scalar) *y_min, V(scalar) *delta)
+{
+	*delta = params->delta;
+	*x_min = (V(scalar))params->x - (*delta * params->cols / 2);
+	*y_min = (V(scalar))params->y - (*delta * params->rows / 2);
+}
+
+/*
+ * Lanes whose c lies inside the main cardioid or the period-2 bulb. Those
+ * points never escape, so needn't be iterated.
+ *
+ * With q = (x - 1/4)^2 + y^2, c is in the cardioid if q(q + x - 1/4) < y^2/4,
+ * and in the bulb if (x + 1)^2 + y^2 < 1/16.
+ */
+static inline V(mask) KERNEL(interior)(VEC cr, VEC ci)
+{
+	VEC xq, ci2, q, xb;
+
+	ci2 = V(mul)(ci, ci);
+	xq = V(sub)(cr, V(splat)(0.25f));
+	q = V(add)(V(mul)(xq, xq), ci2);
+	xb = V(add)(cr, V(splat)(1.0f));
+
+	return V(mask_or)(
+		V(cmpgt)(V(mul)(V(splat)(0.25f), ci2),
+			V(mul)(q, V(add)(q, xq))),
+		V(cmpgt)(V(splat)(1.0f / 16),
+			V(add)(V(mul)(xb, xb), ci2)));
+}
+
+/**
+ * Find the escape counts of the @w x @h pixel tile at (@x0, @y0) of a
+ * fractal, into @counts, which holds rows of TILE_W.
+ *
+ * A count is the start of the block of 16 iterations in which the point
+ * escaped. Points that are known to be in the set, by the interior test or
+ * by periodicity, get i_max; those that just ran out of iterations get the
+ * start of the last block.
+ *
+ * With KERNEL_ESCAPE_Z, a count is the number of iterations before the one
+ * in which the point escaped, and @mags gets |z|^2 from that iteration.
+ * Points that ran out of iterations get i_max - 1; they and the points known
+ * to be in the set get a |z|^2 of 0.
+ */
+static void KERNEL(render_fractal)(struct fractal_params *params,
+		int x0, int y0, int w, int h, float *counts, float *mags,
+		struct spe_stats *stats)
+{
+	V(scalar) l_escaped_i[V(lanes)] __attribute__((aligned(64)));
+#ifdef KERNEL_ESCAPE_Z
+	V(scalar) l_mag[V(lanes)] __attribute__((aligned(64)));
+	VEC vn, escaped_mag;
+	const VEC one = V(splat)(1.0f);
+#endif
+	int r, x, y, l, n, p;
+	unsigned int i, valid;
+	/* complex numbers: c and z */
+	VEC cr, ci, zr, zi;
+	VEC vx_min, vy_min, vdelta, tmp, mag;
+	VEC increments, escaped_i, sr, si, dr, di;
+	V(scalar) x_min, y_min, delta;
+	float in_set;
+	V(mask) escaped, interior;
+	unsigned int periodic, retired;
+	const VEC limit = V(splat)(4.0f);
+	const VEC two = V(splat)(2.0f);
+	VEC tolerance;
+
+	KERNEL(view)(params, &x_min, &y_min, &delta);
+	tolerance = V(splat)(PERIOD_TOLERANCE(delta) * PERIOD_TOLERANCE(delta));
+
+	/* c is computed from the pixel's column, x + lane, rather than by
+	 * stepping along the row, so that every vector width rounds it the
+	 * same way and draws the same image */
+	increments = V(iota)();
+	vdelta = V(splat)(delta);
+
+	/* the count for points known to be in the set */
+	in_set = (float)params->i_max;
+
+	vx_min = V(splat)(x_min);
+	vy_min = V(splat)(y_min);
+
+	for (r = 0; r < h; r++) {
+		y = r + y0;
+		ci = V(add)(vy_min, V(splat)((V(scalar))(y * delta)));
+
+		for (x = 0; x < w; x += V(lanes)) {
+			escaped_i = V(splat)(0.0f);
+			escaped = V(mask_none)();
+#ifdef KERNEL_ESCAPE_Z
+			escaped_mag = V(splat)(0.0f);
+#endif
+			cr = V(add)(vx_min, V(mul)(vdelta,
+					V(add)(V(splat)((V(scalar))(x0 + x)),
+						increments)));
+
+			zr = sr = V(splat)(0.0f);
+			zi = si = V(splat)(0.0f);
+			periodic = 0;
+
+			/* the last vector of a row may hang over the edge */
+			n = w - x;
+			if (n > V(lanes))
+				n = V(lanes);
+			valid = ~0u >> (32 - n);
+
+			interior = KERNEL(interior)(cr, ci);
+
+			for (i = 0; i < params->i_max; i+=16)  {
+				const VEC vi = V(splat)((V(scalar))i);
+
+				if (i) {
+					/* lanes whose orbit has come back to
+					 * the saved z */
+					dr = V(sub)(zr, sr);
+					di = V(sub)(zi, si);
+					periodic |= V(mask_bits)(V(cmpgt)(tolerance,
+						V(add)(V(mul)(dr, dr), V(mul)(di, di))))
+						& ~V(mask_bits)(escaped);
+
+					if (!((i / 16) & (i / 16 - 1))) {
+						sr = zr;
+						si = zi;
+					}
+				}
+
+				/* if every lane has escaped or is known not
+				 * to, we're done */
+				retired = V(mask_bits)(V(mask_or)(escaped, interior))
+					| periodic;
+				if (!(valid & ~retired))
+					break;
+
+				stats->lane_iterations += 16 * V(lanes);
+				stats->useful_iterations += 16 *
+					__builtin_popcount(valid & ~retired);
+
+				ITERATE_16();
+			}
+
+			/* lanes known to be in the set */
+			retired = (V(mask_bits)(interior) | periodic) & valid;
+			stats->periodic += __builtin_popcount(periodic & valid &
+					~V(mask_bits)(interior));
+			V(store)(l_escaped_i, escaped_i);
+
+#ifdef KERNEL_ESCAPE_Z
+			V(store)(l_mag, escaped_mag);
+#endif
+
+			for (l = 0; l < n; l++) {
+				p = r * TILE_W + x + l;
+				if (retired & (1u << l)) {
+					counts[p] = in_set;
+#ifdef KERNEL_ESCAPE_Z
+					mags[p] = 0.0f;
+				} else {
+					record_escape(params, &counts[p],
+						&mags[p], l_escaped_i[l],
+						l_mag[l]);
+#else
+				} else {
+					counts[p] = l_escaped_i[l];
+#endif
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Find the escape counts of @n_points pixels of the tile at (@x0, @y0).
+ * Each of @points is a pixel's index into @counts, as y * TILE_W + x.
+ *
+ * Rather than every lane waiting for the slowest pixel of the vector, as
+ * in render_fractal(), a lane moves on to the next point as soon as its own
+ * is done. Escape counts are identical.
+ */
+static void KERNEL(render_points)(struct fractal_params *params,
+		int x0, int y0, const uint16_t *points, int n_points,
+		float *counts, float *mags, struct spe_stats *stats)
+{
+	/* per-lane state, spilled to memory while lanes are refilled */
+	V(scalar) l_cr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_ci[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_zr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_zi[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_i[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_escaped_i[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_sr[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_si[V(lanes)] __attribute__((aligned(64)));
+	V(scalar) l_save_i[V(lanes)] __attribute__((aligned(64)));
+#ifdef KERNEL_ESCAPE_Z
+	V(scalar) l_mag[V(lanes)] __attribute__((aligned(64)));
+	VEC vn, escaped_mag;
+#endif
+	int pixel[V(lanes)] = { 0 };
+	VEC cr, ci, zr, zi, tmp, mag, vi, escaped_i;
+	VEC sr, si, save_i, dr, di;
+	V(mask) escaped, save;
+	const VEC limit = V(splat)(4.0f);
+	const VEC two = V(splat)(2.0f);
+	const VEC one = V(splat)(1.0f);
+	const VEC sixteen = V(splat)(16.0f);
+	const VEC last = V(splat)((V(scalar))(params->i_max - 1));
+	const float in_set = (float)params->i_max;
+	V(scalar) x_min, y_min, delta;
+	VEC tolerance;
+	unsigned int active, done, fresh, interior, periodic;
+	int l, p, next;
+
+	KERNEL(view)(params, &x_min, &y_min, &delta);
+	tolerance = V(splat)(PERIOD_TOLERANCE(delta) * PERIOD_TOLERANCE(delta));
+
+	next = 0;
+	active = 0;
+	fresh = ~0u;
+
+	/* Start lane l on the next point, or park it (on c = 0, which never
+	 * escapes) if there are none left */
+#define LOAD_LANE(l)								\
+	do {									\
+		if (next < n_points) {						\
+			pixel[l] = points[next++];				\
+			l_cr[l] = x_min + delta *				\
+				(V(scalar))(x0 + pixel[l] % TILE_W);		\
+			l_ci[l] = y_min + (V(scalar))(			\
+				(y0 + pixel[l] / TILE_W) * delta);		\
+			active |= 1u << (l);					\
+		} else {							\
+			l_cr[l] = l_ci[l] = 0.0f;				\
+			active &= ~(1u << (l));					\
+		}								\
+		l_zr[l] = l_zi[l] = 0.0f;					\
+		l_i[l] = l_escaped_i[l] = 0.0f;					\
+		l_sr[l] = l_si[l] = 0.0f;					\
+		l_save_i[l] = 16.0f;						\
+		LOAD_LANE_Z(l);							\
+	} while (0)
+#ifdef KERNEL_ESCAPE_Z
+#define LOAD_LANE_Z(l)	(l_mag[l] = 0.0f)
+#else
+#define LOAD_LANE_Z(l)
+#endif
+
+	for (l = 0; l < V(lanes); l++)
+		LOAD_LANE(l);
+
+	cr = V(load)(l_cr);
+	ci = V(load)(l_ci);
+	zr = zi = V(splat)(0.0f);
+	vi = escaped_i = V(splat)(0.0f);
+	sr = si = V(splat)(0.0f);
+	save_i = sixteen;
+#ifdef KERNEL_ESCAPE_Z
+	escaped_mag = V(splat)(0.0f);
+#endif
+
+	while (active) {
+		/* lanes just given a point in the cardioid or bulb are done
+		 * without iterating */
+		interior = fresh & active & V(mask_bits)(KERNEL(interior)(cr, ci));
+		fresh = 0;
+		periodic = 0;
+
+		if (interior) {
+			done = interior;
+		} else {
+			/* lanes that escaped in the last block have been
+			 * refilled */
+			escaped = V(mask_none)();
+
+			stats->lane_iterations += 16 * V(lanes);
+			stats->useful_iterations += 16 * __builtin_popcount(active);
+
+			ITERATE_16();
+
+			/* a lane is done if it escaped, or has run i_max
+			 * iterations */
+			done = active & V(mask_bits)(V(mask_or)(escaped,
+					V(cmpgt)(V(add)(vi, sixteen), last)));
+			vi = V(add)(vi, sixteen);
+
+			/* lanes whose orbit has come back to the saved z */
+			dr = V(sub)(zr, sr);
+			di = V(sub)(zi, si);
+			periodic = active & ~done & V(mask_bits)(
+					V(cmpgt)(tolerance, V(add)(
+						V(mul)(dr, dr), V(mul)(di, di))));
+			stats->periodic += __builtin_popcount(periodic);
+			done |= periodic;
+
+			/* move the saved z on where vi is a power of two
+			 * blocks */
+			save = V(cmpgt)(V(add)(vi, one), save_i);
+			sr = V(sel)(sr, zr, save);
+			si = V(sel)(si, zi, save);
+			save_i = V(sel)(save_i, V(add)(save_i, save_i), save);
+
+			if (!done)
+				continue;
+		}
+
+		V(store)(l_cr, cr);
+		V(store)(l_ci, ci);
+		V(store)(l_zr, zr);
+		V(store)(l_zi, zi);
+		V(store)(l_i, vi);
+		V(store)(l_escaped_i, escaped_i);
+		V(store)(l_sr, sr);
+		V(store)(l_si, si);
+		V(store)(l_save_i, save_i);
+#ifdef KERNEL_ESCAPE_Z
+		V(store)(l_mag, escaped_mag);
+#endif
+
+		for (l = 0; l < V(lanes); l++) {
+			if (!(done & (1u << l)))
+				continue;
+
+			p = pixel[l];
+			if ((interior | periodic) & (1u << l)) {
+				counts[p] = in_set;
+#ifdef KERNEL_ESCAPE_Z
+				mags[p] = 0.0f;
+			} else {
+				record_escape(params, &counts[p], &mags[p],
+						l_escaped_i[l], l_mag[l]);
+#else
+			} else {
+				counts[p] = l_escaped_i[l];
+#endif
+			}
+			LOAD_LANE(l);
+			fresh |= 1u << l;
+		}
+
+		cr = V(load)(l_cr);
+		ci = V(load)(l_ci);
+		zr = V(load)(l_zr);
+		zi = V(load)(l_zi);
+		vi = V(load)(l_i);
+		escaped_i = V(load)(l_escaped_i);
+		sr = V(load)(l_sr);
+		si = V(load)(l_si);
+		save_i = V(load)(l_save_i);
+#ifdef KERNEL_ESCAPE_Z
+		escaped_mag = V(load)(l_mag);
+#endif
+	}
+
+#undef LOAD_LANE_Z
+#undef LOAD_LANE
+}
+
+#undef ITERATE_16
+#undef ITERATE
+#undef RECORD_MAG
+#undef NEXT_COUNT
+#undef BLOCK_START
+#undef COUNT
+#undef KERNEL
+#undef V
+#undef VEC
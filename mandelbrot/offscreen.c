@@ -0,0 +1,172 @@
+/**
+ * Offscreen image buffers, for rendering without a framebuffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "offscreen.h"
+
+/* The system's huge page size, in bytes, or 0 if it doesn't have them */
+static size_t hugepage_size(void)
+{
+	char line[128];
+	unsigned long kb = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+			break;
+
+	fclose(fp);
+	return kb * 1024;
+}
+
+/* Back @buf with huge pages. Returns 0 on success. */
+static int alloc_hugepages(struct offscreen *buf)
+{
+#ifdef MAP_HUGETLB
+	size_t page, size;
+	void *p;
+
+	page = hugepage_size();
+	if (!page)
+		return -1;
+
+	size = (buf->size + page - 1) & ~(page - 1);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	/* mmap()ed memory is already zeroed */
+	buf->pixels = p;
+	buf->size = size;
+	buf->page = page;
+	buf->hugepages = 1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int offscreen_alloc(struct offscreen *buf, int rows, int cols, int hugepages)
+{
+	memset(buf, 0, sizeof(*buf));
+
+	/* whole DMA lines, with at least a byte to spare after the last
+	 * pixel */
+	buf->size = ((size_t)rows * cols * sizeof(struct pixel) + SPE_ALIGN) &
+		~(size_t)(SPE_ALIGN - 1);
+
+	if (hugepages) {
+		if (!alloc_hugepages(buf))
+			return 0;
+		fprintf(stderr, "No huge pages free; using normal pages "
+				"for the image\n");
+	}
+
+	buf->pixels = memalign(SPE_ALIGN, buf->size);
+	if (!buf->pixels) {
+		perror("memalign");
+		return -1;
+	}
+	memset(buf->pixels, 0, buf->size);
+	buf->page = sysconf(_SC_PAGESIZE);
+
+	return 0;
+}
+
+int offscreen_map(struct offscreen *buf, const char *filename, int rows,
+		int cols)
+{
+	char *header;
+	int n;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->size = (size_t)rows * cols * sizeof(struct pixel);
+	buf->page = sysconf(_SC_PAGESIZE);
+	buf->mapped = 1;
+
+	buf->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (buf->fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* the file is sparse until the pixels land in it */
+	if (ftruncate(buf->fd, SPE_ALIGN + buf->size)) {
+		perror("ftruncate");
+		goto err_close;
+	}
+
+	buf->map = mmap(NULL, SPE_ALIGN + buf->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, buf->fd, 0);
+	if (buf->map == MAP_FAILED) {
+		perror("mmap");
+		goto err_close;
+	}
+
+	/* a header of exactly SPE_ALIGN bytes, padded with a comment */
+	header = buf->map;
+	n = snprintf(header, SPE_ALIGN, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\n"
+			"MAXVAL 255\nTUPLTYPE RGB_ALPHA\n#", cols, rows);
+	memset(header + n, ' ', SPE_ALIGN - n);
+	memcpy(header + SPE_ALIGN - 8, "\nENDHDR\n", 8);
+
+	buf->pixels = (struct pixel *)(header + SPE_ALIGN);
+	return 0;
+
+err_close:
+	close(buf->fd);
+	return -1;
+}
+
+void offscreen_release(struct offscreen *buf, const void *end)
+{
+	uintptr_t start, stop;
+
+	start = ((uintptr_t)buf->pixels + buf->released + buf->page - 1) &
+		~(uintptr_t)(buf->page - 1);
+	stop = (uintptr_t)end & ~(uintptr_t)(buf->page - 1);
+
+	if (stop <= start)
+		return;
+
+	/* start writing the pages back before they're dropped; dirty pages
+	 * of a shared mapping stay in the page cache until they're written */
+	if (buf->mapped)
+		msync((void *)start, stop - start, MS_ASYNC);
+
+	if (madvise((void *)start, stop - start, MADV_DONTNEED))
+		return;
+
+	if (buf->mapped)
+		posix_fadvise(buf->fd, start - (uintptr_t)buf->map,
+				stop - start, POSIX_FADV_DONTNEED);
+
+	buf->released = stop - (uintptr_t)buf->pixels;
+}
+
+void offscreen_free(struct offscreen *buf)
+{
+	if (buf->mapped) {
+		if (msync(buf->map, SPE_ALIGN + buf->size, MS_SYNC))
+			perror("msync");
+		munmap(buf->map, SPE_ALIGN + buf->size);
+		close(buf->fd);
+	} else if (buf->hugepages)
+		munmap(buf->pixels, buf->size);
+	else
+		free(buf->pixels);
+	buf->pixels = NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef _OFFSCREEN_H
+#define _OFFSCREEN_H
+
+#include <stddef.h>
+
+#include "fractal.h"
+
+/*
+ * An image in ordinary memory, for rendering without a console or
+ * framebuffer, at any size
+ */
+struct offscreen {
+	struct pixel *pixels;
+	size_t size;
+
+	/* the pixels were mmap()ed from huge pages, not memalign()ed */
+	int hugepages;
+
+	/* the size of the pages, and how much of the image has been given
+	 * back by offscreen_release() */
+	size_t page, released;
+
+	/* the pixels are in a file, mapped with its header at map */
+	int mapped, fd;
+	void *map;
+};
+
+/*
+ * Allocate a zeroed @rows x @cols image, aligned for DMA. If @hugepages, back
+ * it with huge pages if there are any free, which spares the TLB when the
+ * SPEs' DMAs are spread over a large image. Returns 0 on success.
+ */
+int offscreen_alloc(struct offscreen *buf, int rows, int cols, int hugepages);
+
+/*
+ * Map a @rows x @cols image straight into @filename, as a PAM (netpbm) file
+ * of RGB_ALPHA tuples, so that an image bigger than memory can be rendered
+ * out of core. The header is padded so the pixels are aligned for DMA.
+ * Returns 0 on success.
+ */
+int offscreen_map(struct offscreen *buf, const char *filename, int rows,
+		int cols);
+
+/*
+ * Give back the memory of the image up to @end, which won't be looked at
+ * again; @end only ever moves on. Only whole pages are given back. The
+ * pages of a mapped image are written back to the file first, and dropped
+ * from the page cache too.
+ */
+void offscreen_release(struct offscreen *buf, const void *end);
+
+void offscreen_free(struct offscreen *buf);
+
+#endif /* _OFFSCREEN_H */
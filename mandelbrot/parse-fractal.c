@@ -4,6 +4,7 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <limits.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -15,12 +16,45 @@
 
 #define streq(a, b) (!strcasecmp(a, b))
 
-struct fractal_params *parse_fractal(const char *filename)
+struct fractal_params *parse_fractal(const char *filename,
+		struct fractal_view *view)
 {
-	FILE *fp;
 	struct fractal_params *fractal;
-	char name[7];
-	float value;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open file %s: %s\n",
+				filename, strerror(errno));
+		return NULL;
+	}
+
+	fractal = parse_fractal_file(fp, filename, view);
+	fclose(fp);
+	return fractal;
+}
+
+struct fractal_params *parse_fractal_file(FILE *fp, const char *filename,
+		struct fractal_view *view)
+{
+	struct fractal_params *views;
+	int n_views;
+
+	views = parse_fractal_views_file(fp, filename, view, &n_views);
+	if (views && n_views != 1) {
+		fprintf(stderr, "%s has %d views; only one can be rendered "
+				"here\n", filename, n_views);
+		free(views);
+		return NULL;
+	}
+	return views;
+}
+
+struct fractal_params *parse_fractal_views(const char *filename,
+		struct fractal_view *view, int *n_views)
+{
+	struct fractal_params *views;
+	FILE *fp;
 
 	fp = fopen(filename, "r");
 	if (!fp) {
@@ -29,38 +63,188 @@ struct fractal_params *parse_fractal(const char *filename)
 		return NULL;
 	}
 
-	fractal = malloc(sizeof(*fractal));
-	if (!fractal) {
-		perror("malloc");
-		goto err_close;
+	views = parse_fractal_views_file(fp, filename, view, n_views);
+	fclose(fp);
+	return views;
+}
+
+/* A view as the file gives it, before it's made into frames */
+struct keyframe {
+	struct fractal_params fractal;
+
+	/* how many views it makes, and for a zoom path how much deeper the
+	 * last is than the first; or 0 if it isn't one */
+	int frames;
+	double zoom;
+};
+
+static int check_view(const struct fractal_params *fractal,
+		const char *filename)
+{
+	if (!fractal->x) {
+		fprintf(stderr, "No x value specified in %s\n", filename);
+		return -1;
+	}
+
+	if (!fractal->y) {
+		fprintf(stderr, "No y value specified in %s\n", filename);
+		return -1;
+	}
+
+	if (!fractal->delta) {
+		fprintf(stderr, "No delta value specified in %s\n", filename);
+		return -1;
+	}
+
+	if (!fractal->i_max) {
+		fprintf(stderr, "No i_max value specified in %s\n", filename);
+		return -1;
 	}
 
-	memset(fractal, 0, sizeof(*fractal));
+	return 0;
+}
 
-	while (!feof(fp)) {
+/* Check @key, and add it to the @n_keys of @keys. Returns 0 on success. */
+static int add_key(struct keyframe **keys, int *n_keys,
+		const struct keyframe *key, const char *filename)
+{
+	struct keyframe *more;
 
-		int rc = fscanf(fp, "%6s = %f", name, &value);
+	if (check_view(&key->fractal, filename))
+		return -1;
+
+	more = realloc(*keys, (*n_keys + 1) * sizeof(**keys));
+	if (!more) {
+		perror("realloc");
+		return -1;
+	}
+	*keys = more;
+	more[(*n_keys)++] = *key;
+	return 0;
+}
 
-		if (rc != 2)
+/*
+ * The view @t of the way from @from to @to, for 0 <= @t < 1. delta changes
+ * by the same factor each step, so the zoom is steady, and the centre moves
+ * in step with delta, so that the view homes in on @to's centre as a zoom
+ * into it would. i_max goes up or down steadily.
+ */
+static void interpolate(struct fractal_params *fractal,
+		const struct fractal_params *from,
+		const struct fractal_params *to, double t)
+{
+	double s;
+
+	*fractal = *from;
+	fractal->delta = from->delta * pow(to->delta / from->delta, t);
+
+	s = from->delta != to->delta ? (from->delta - fractal->delta) /
+		(from->delta - to->delta) : t;
+	fractal->x = from->x + (to->x - from->x) * s;
+	fractal->y = from->y + (to->y - from->y) * s;
+	fractal->i_max = from->i_max + lround((to->i_max - from->i_max) * t);
+}
+
+/*
+ * Add the frames of @key to the @n_views of @views: a zoom path, the frames
+ * leading up to @next if there is one, or else @key as it is. Returns 0 on
+ * success.
+ */
+static int add_views(struct fractal_params **views, int *n_views,
+		const struct keyframe *key, const struct keyframe *next,
+		const char *filename)
+{
+	struct fractal_params *more, *fractal;
+	int i;
+
+	if (key->frames < 1 || key->frames > INT_MAX - *n_views ||
+			key->zoom < 0) {
+		fprintf(stderr, "Bad zoom path in %s\n", filename);
+		return -1;
+	}
+
+	more = realloc(*views, (*n_views + key->frames) * sizeof(**views));
+	if (!more) {
+		perror("realloc");
+		return -1;
+	}
+	*views = more;
+
+	for (i = 0; i < key->frames; i++) {
+		fractal = &more[(*n_views)++];
+		*fractal = key->fractal;
+
+		/* a steady zoom: delta shrinks by the same factor every
+		 * frame, and the last frame is zoom times as deep */
+		if (key->zoom && key->frames > 1)
+			fractal->delta = key->fractal.delta /
+				pow(key->zoom, (double)i / (key->frames - 1));
+		else if (!key->zoom && next)
+			interpolate(fractal, &key->fractal, &next->fractal,
+					(double)i / key->frames);
+	}
+	return 0;
+}
+
+struct fractal_params *parse_fractal_views_file(FILE *fp,
+		const char *filename, struct fractal_view *view, int *n_views)
+{
+	struct fractal_params *views = NULL;
+	struct keyframe key, *keys = NULL;
+	char line[256], name[16], str[128];
+	double value;
+	int n_keys = 0, pending = 0, i;
+
+	memset(&key, 0, sizeof(key));
+	key.frames = 1;
+	*n_views = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		int rc = sscanf(line, "%15s = %127s", name, str);
+
+		/* "view" ends a view; the next starts as a copy of it */
+		if (rc == 1 && streq(name, "view")) {
+			if (pending && add_key(&keys, &n_keys, &key, filename))
+				goto err_free;
+			key.frames = 1;
+			key.zoom = 0;
+			pending = 0;
+			continue;
+		}
+
+		if (rc != 2 || name[0] == '#')
 			continue;
 
+		value = strtod(str, NULL);
+		pending = 1;
+
 		if (streq(name, "cols")) {
-			fractal->cols = (int)(floor(value));
+			key.fractal.cols = (int)(floor(value));
 
 		} else if (streq(name, "rows")) {
-			fractal->rows = (int)(floor(value));
+			key.fractal.rows = (int)(floor(value));
 
 		} else if (streq(name, "x")) {
-			fractal->x = value;
+			key.fractal.x = value;
+			if (view && !n_keys)
+				strcpy(view->x, str);
 
 		} else if (streq(name, "y")) {
-			fractal->y = value;
+			key.fractal.y = value;
+			if (view && !n_keys)
+				strcpy(view->y, str);
 
 		} else if (streq(name, "delta")) {
-			fractal->delta = value;
+			key.fractal.delta = value;
 
 		} else if (streq(name, "i_max")) {
-			fractal->i_max = value;
+			key.fractal.i_max = value;
+
+		} else if (streq(name, "frames")) {
+			key.frames = (int)(floor(value));
+
+		} else if (streq(name, "zoom")) {
+			key.zoom = value;
 
 		} else {
 			fprintf(stderr, "Unknown configutation directive %s\n",
@@ -69,76 +253,55 @@ struct fractal_params *parse_fractal(const char *filename)
 		}
 	}
 
-	if( fractal->rows == 0 || fractal->cols == 0 ) {
-		// code lifted from fb_info.c found at cellperformance.com
-		const int fb_file = open( "/dev/fb0", O_RDWR );
-		const int open_fb_error = (fb_file >> ((sizeof(int)*8)-1));
-		if(open_fb_error < 0) {
-			fprintf(stderr, "Could not open /dev/fb0.  Check permissions.\n");
-			perror("open");
-			goto err_free;
-		}
+	if ((pending || !n_keys) && add_key(&keys, &n_keys, &key, filename))
+		goto err_free;
 
-		struct ps3fb_ioctl_res res;
-		int ps3_screeninfo_error = ioctl(fb_file, PS3FB_IOCTL_SCREENINFO, (unsigned long)&res);
-		if (ps3_screeninfo_error == -1) {
-			fprintf(stderr, "Error: PS3FB_IOCTL_SCREENINFO Failed and image dimensions not specified\n");
-			perror("ioctl");
+	for (i = 0; i < n_keys; i++)
+		if (add_views(&views, n_views, &keys[i],
+					i + 1 < n_keys ? &keys[i + 1] : NULL,
+					filename))
 			goto err_free;
-		}
-		if (fractal->cols == 0) {
-			fractal->cols = res.xres;
-			printf("xres detected as %d.\n", res.xres);
-		}
-		if (fractal->rows == 0) {
-			fractal->rows = res.yres;
-			printf("yres detected as %d.\n", res.yres);
-		}
-
-		int close_fb_error = close(fb_file);
-		if(close_fb_error == -1) {
-			fprintf(stderr, "Warning: Could not close file handle used for /dev/fb0\n");
-		}
-	}
 
+	free(keys);
+	return views;
 
-	if (!fractal->cols) {
-		fprintf(stderr, "No columns specified\n");
-	}
+err_free:
+	free(keys);
+	free(views);
+	return NULL;
+}
 
-	if (!fractal->rows) {
-		fprintf(stderr, "No rows specified\n");
+int fb_screen_size(struct fractal_params *fractal)
+{
+	// code lifted from fb_info.c found at cellperformance.com
+	const int fb_file = open( "/dev/fb0", O_RDWR );
+	const int open_fb_error = (fb_file >> ((sizeof(int)*8)-1));
+	if(open_fb_error < 0) {
+		fprintf(stderr, "Could not open /dev/fb0.  Check permissions.\n");
+		perror("open");
+		return -1;
 	}
 
-	if (!fractal->x) {
-		fprintf(stderr, "No x value specified in %s\n", filename);
-		goto err_free;
+	struct ps3fb_ioctl_res res;
+	int ps3_screeninfo_error = ioctl(fb_file, PS3FB_IOCTL_SCREENINFO, (unsigned long)&res);
+	if (ps3_screeninfo_error == -1) {
+		fprintf(stderr, "Error: PS3FB_IOCTL_SCREENINFO Failed and image dimensions not specified\n");
+		perror("ioctl");
+		return -1;
 	}
-
-	if (!fractal->y) {
-		fprintf(stderr, "No y value specified in %s\n", filename);
-		goto err_free;
+	if (fractal->cols == 0) {
+		fractal->cols = res.xres;
+		printf("xres detected as %d.\n", res.xres);
 	}
-
-	if (!fractal->delta) {
-		fprintf(stderr, "No delta value specified in %s\n", filename);
-		goto err_free;
+	if (fractal->rows == 0) {
+		fractal->rows = res.yres;
+		printf("yres detected as %d.\n", res.yres);
 	}
 
-	if (!fractal->i_max) {
-		fprintf(stderr, "No i_max value specified in %s\n", filename);
-		goto err_free;
+	int close_fb_error = close(fb_file);
+	if(close_fb_error == -1) {
+		fprintf(stderr, "Warning: Could not close file handle used for /dev/fb0\n");
 	}
 
-	fclose(fp);
-	return fractal;
-
-err_free:
-	free(fractal);
-err_close:
-	fclose(fp);
-	return NULL;
-
-
+	return 0;
 }
-
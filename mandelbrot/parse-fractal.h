@@ -1,8 +1,46 @@
 #ifndef _PARSE_FRACTAL_H
 #define _PARSE_FRACTAL_H
 
+#include <stdio.h>
+
 #include "fractal.h"
 
-struct fractal_params *parse_fractal(const char *filename);
+/*
+ * The centre of the view as given in the parameters file, for deep zooms,
+ * which need more precision than fractal_params has
+ */
+struct fractal_view {
+	char x[128], y[128];
+};
+
+/* @view may be NULL */
+struct fractal_params *parse_fractal(const char *filename,
+		struct fractal_view *view);
+
+/* As parse_fractal(), from @fp, which came from @filename */
+struct fractal_params *parse_fractal_file(FILE *fp, const char *filename,
+		struct fractal_view *view);
+
+/*
+ * A parameters file can describe many views. A line saying just "view" ends
+ * one; the next starts as a copy of it, so only what changes need be given.
+ * A view with "frames = n" is a zoom path of n views, from its delta in to
+ * "zoom = z" times as deep; or without a zoom, n views leading to the next
+ * view, zooming steadily and homing in on its centre. Returns an array of
+ * the views, with how many there are in @n_views; @view gets the centre of
+ * the first.
+ */
+struct fractal_params *parse_fractal_views(const char *filename,
+		struct fractal_view *view, int *n_views);
+
+/* As parse_fractal_views(), from @fp, which came from @filename */
+struct fractal_params *parse_fractal_views_file(FILE *fp,
+		const char *filename, struct fractal_view *view, int *n_views);
+
+/*
+ * Fill in whichever of @fractal's rows and cols are missing with the size of
+ * the screen. Returns 0 on success.
+ */
+int fb_screen_size(struct fractal_params *fractal);
 
 #endif /* _PARSE_FRACTAL_H */
@@ -0,0 +1,239 @@
+/**
+ * The deep zoom kernel: perturbation from a reference orbit, written
+ * against the double-precision vector types in simd.h.
+ *
+ * Each pixel's c is C + dc, where C is the centre of the image, whose orbit
+ * Z_m was computed at high precision by the PPE. The pixel's own orbit is
+ * z = Z_m + dz, and
+ *
+ *	dz' = 2 Z_m dz + dz^2 + dc
+ *
+ * which only involves small numbers, so double precision is plenty however
+ * far the image is zoomed in.
+ *
+ * That breaks down when z comes near zero, where dz is as large as z itself
+ * and the pixel no longer follows the reference (a "glitch"). Then, or when
+ * the reference orbit runs out, the pixel is rebased: dz becomes z and it
+ * carries on from the start of the reference orbit, Z_0 = 0. Each lane has
+ * its own position m in the reference orbit.
+ *
+ * spe-fractal.c includes this once for each double vector shape, with and
+ * without KERNEL_ESCAPE_Z, as for kernel.h.
+ */
+
+#define VEC		simd_cat(v, KERNEL_SHAPE)
+#define V(op)		simd_cat(VEC, _##op)
+
+#ifdef KERNEL_ESCAPE_Z
+#define KERNEL(name)	simd_cat(name##_z_, KERNEL_SHAPE)
+
+/* count each iteration in vn, as in kernel.h */
+#define COUNT		vn
+#define BLOCK_START()	vn = vi
+#define NEXT_COUNT()	vn = V(add)(vn, one)
+#define RECORD_MAG()	escaped_mag = V(sel)(mag, escaped_mag, escaped)
+#else
+#define KERNEL(name)	simd_cat(name##_, KERNEL_SHAPE)
+
+#define COUNT		vi
+#define BLOCK_START()
+#define NEXT_COUNT()
+#define RECORD_MAG()
+#endif
+
+/*
+ * One iteration of every lane, recording in escaped_i the iteration count
+ * of the lanes that are still going
+ */
+#define ITERATE()	/* dz = 2 Z dz + dz^2 + dc */				\
+			tr = V(add)(V(mul)(two, V(sub)(V(mul)(Zr, dzr),		\
+					V(mul)(Zi, dzi))),			\
+				V(add)(V(sub)(V(mul)(dzr, dzr),			\
+					V(mul)(dzi, dzi)), dcr));		\
+			dzi = V(add)(V(mul)(two, V(add)(V(add)(			\
+					V(mul)(Zr, dzi), V(mul)(Zi, dzr)),	\
+					V(mul)(dzr, dzi))), dci);		\
+			dzr = tr;						\
+										\
+			/* z = Z + dz */					\
+			m = V(add)(m, one);					\
+			Zr = V(gather)(ref->re, m);				\
+			Zi = V(gather)(ref->im, m);				\
+			zr = V(add)(Zr, dzr);					\
+			zi = V(add)(Zi, dzi);					\
+			mag = V(add)(V(mul)(zr, zr), V(mul)(zi, zi));		\
+										\
+			/* escaped |= abs(z) > 2.0 */				\
+			RECORD_MAG();						\
+			escaped = V(mask_or)(escaped, V(cmpgt)(mag, limit));	\
+			NEXT_COUNT();						\
+			escaped_i = V(sel)(COUNT, escaped_i, escaped);		\
+										\
+			/* rebase if abs(z) < abs(dz), or at the end of	\
+			 * the reference */					\
+			rebase = V(mask_or)(V(cmpgt)(V(add)(			\
+					V(mul)(dzr, dzr), V(mul)(dzi, dzi)),	\
+					mag), V(cmpgt)(m, last_m));		\
+			rebases |= V(mask_bits)(rebase);			\
+			dzr = V(sel)(dzr, zr, rebase);				\
+			dzi = V(sel)(dzi, zi, rebase);				\
+			Zr = V(sel)(Zr, zero, rebase);				\
+			Zi = V(sel)(Zi, zero, rebase);				\
+			m = V(sel)(m, zero, rebase)
+
+#define ITERATE_16()	BLOCK_START();						\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE();		\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE();		\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE();		\
+			ITERATE(); ITERATE(); ITERATE(); ITERATE()
+
+/**
+ * As render_points() in kernel.h: find the escape counts of @n_points
+ * pixels of the tile at (@x0, @y0), with each lane moving on to the next
+ * point as soon as its own is done. No points are known to be in the set,
+ * so none get a count of i_max. @mags is as for render_fractal().
+ */
+static void KERNEL(render_perturb)(struct fractal_params *params,
+		const struct perturb_ref *ref, int x0, int y0,
+		const uint16_t *points, int n_points, float *counts,
+		float *mags, struct spe_stats *stats)
+{
+	/* per-lane state, spilled to memory while lanes are refilled */
+	double l_dcr[V(lanes)] __attribute__((aligned(64)));
+	double l_dci[V(lanes)] __attribute__((aligned(64)));
+	double l_dzr[V(lanes)] __attribute__((aligned(64)));
+	double l_dzi[V(lanes)] __attribute__((aligned(64)));
+	double l_m[V(lanes)] __attribute__((aligned(64)));
+	double l_i[V(lanes)] __attribute__((aligned(64)));
+	double l_escaped_i[V(lanes)] __attribute__((aligned(64)));
+#ifdef KERNEL_ESCAPE_Z
+	double l_mag[V(lanes)] __attribute__((aligned(64)));
+	VEC vn, escaped_mag;
+#endif
+	int pixel[V(lanes)];
+	VEC dcr, dci, dzr, dzi, zr, zi, Zr, Zi, m, tr, mag, vi, escaped_i;
+	V(mask) escaped, rebase;
+	const VEC limit = V(splat)(4.0);
+	const VEC two = V(splat)(2.0);
+	const VEC one = V(splat)(1.0);
+	const VEC zero = V(splat)(0.0);
+	const VEC sixteen = V(splat)(16.0);
+	const VEC last = V(splat)((double)(params->i_max - 1));
+	const VEC last_m = V(splat)(ref->len - 1.5);
+	unsigned int active, done, rebases;
+	int l, p, next;
+
+	next = 0;
+	active = 0;
+
+	/* Start lane l on the next point, or park it (on dc = 0, which
+	 * follows the reference) if there are none left */
+#define LOAD_LANE(l)								\
+	do {									\
+		if (next < n_points) {						\
+			pixel[l] = points[next++];				\
+			l_dcr[l] = ref->delta * ((x0 + pixel[l] % TILE_W) -	\
+				params->cols / 2.0);				\
+			l_dci[l] = ref->delta * ((y0 + pixel[l] / TILE_W) -	\
+				params->rows / 2.0);				\
+			active |= 1u << (l);					\
+		} else {							\
+			l_dcr[l] = l_dci[l] = 0.0;				\
+			active &= ~(1u << (l));					\
+		}								\
+		l_dzr[l] = l_dzi[l] = 0.0;					\
+		l_m[l] = l_i[l] = l_escaped_i[l] = 0.0;				\
+		LOAD_LANE_Z(l);							\
+	} while (0)
+#ifdef KERNEL_ESCAPE_Z
+#define LOAD_LANE_Z(l)	(l_mag[l] = 0.0)
+#else
+#define LOAD_LANE_Z(l)
+#endif
+
+	for (l = 0; l < V(lanes); l++)
+		LOAD_LANE(l);
+
+	dcr = V(load)(l_dcr);
+	dci = V(load)(l_dci);
+	dzr = dzi = zero;
+	Zr = Zi = zero;
+	m = vi = escaped_i = zero;
+#ifdef KERNEL_ESCAPE_Z
+	escaped_mag = zero;
+#endif
+
+	while (active) {
+		/* lanes that escaped in the last block have been refilled */
+		escaped = V(mask_none)();
+		rebases = 0;
+
+		stats->lane_iterations += 16 * V(lanes);
+		stats->useful_iterations += 16 * __builtin_popcount(active);
+
+		ITERATE_16();
+
+		/* lanes rebased in this block, at least once */
+		stats->rebases += __builtin_popcount(rebases & active &
+				~V(mask_bits)(escaped));
+
+		/* a lane is done if it escaped, or has run i_max iterations */
+		done = active & V(mask_bits)(V(mask_or)(escaped,
+					V(cmpgt)(V(add)(vi, sixteen), last)));
+		vi = V(add)(vi, sixteen);
+
+		if (!done)
+			continue;
+
+		V(store)(l_dcr, dcr);
+		V(store)(l_dci, dci);
+		V(store)(l_dzr, dzr);
+		V(store)(l_dzi, dzi);
+		V(store)(l_m, m);
+		V(store)(l_i, vi);
+		V(store)(l_escaped_i, escaped_i);
+#ifdef KERNEL_ESCAPE_Z
+		V(store)(l_mag, escaped_mag);
+#endif
+
+		for (l = 0; l < V(lanes); l++) {
+			if (!(done & (1u << l)))
+				continue;
+
+			p = pixel[l];
+#ifdef KERNEL_ESCAPE_Z
+			record_escape(params, &counts[p], &mags[p],
+					l_escaped_i[l], l_mag[l]);
+#else
+			counts[p] = l_escaped_i[l];
+#endif
+			LOAD_LANE(l);
+		}
+
+		dcr = V(load)(l_dcr);
+		dci = V(load)(l_dci);
+		dzr = V(load)(l_dzr);
+		dzi = V(load)(l_dzi);
+		m = V(load)(l_m);
+		vi = V(load)(l_i);
+		escaped_i = V(load)(l_escaped_i);
+#ifdef KERNEL_ESCAPE_Z
+		escaped_mag = V(load)(l_mag);
+#endif
+		Zr = V(gather)(ref->re, m);
+		Zi = V(gather)(ref->im, m);
+	}
+
+#undef LOAD_LANE_Z
+#undef LOAD_LANE
+}
+
+#undef ITERATE_16
+#undef ITERATE
+#undef RECORD_MAG
+#undef NEXT_COUNT
+#undef BLOCK_START
+#undef COUNT
+#undef KERNEL
+#undef V
+#undef VEC
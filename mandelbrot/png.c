@@ -1,8 +1,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "png.h"
 #include "fractal.h"
@@ -55,7 +58,594 @@ int write_png(const char *filename, int rows, int cols, struct pixel *image)
 
 	png_write_png(png, png_info, PNG_TRANSFORM_IDENTITY, NULL);
 
+	png_destroy_write_struct(&png, &png_info);
+	free(row_ptrs);
 	fclose(fp);
 
 	return 0;
 }
+
+int read_png(const char *filename, int rows, int cols, struct pixel *image)
+{
+	FILE *fp;
+	png_structp png;
+	png_infop png_info;
+	uint8_t **row_ptrs = NULL;
+	int i;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		perror("fopen");
+		return -1;
+	}
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png) {
+		fprintf(stderr, "Couldn't create png_read_struct\n");
+		fclose(fp);
+		return -1;
+	}
+
+	png_info = png_create_info_struct(png);
+	if (!png_info) {
+		fprintf(stderr, "Couldn't create png_info_struct\n");
+		png_destroy_read_struct(&png, NULL, NULL);
+		fclose(fp);
+		return -1;
+	}
+
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &png_info, NULL);
+		fclose(fp);
+		free(row_ptrs);
+		fprintf(stderr, "png reading failed\n");
+		return -1;
+	}
+
+	png_init_io(png, fp);
+	png_read_info(png, png_info);
+
+	if (png_get_image_width(png, png_info) != (png_uint_32)cols ||
+			png_get_image_height(png, png_info) !=
+				(png_uint_32)rows ||
+			png_get_bit_depth(png, png_info) != 8 ||
+			png_get_color_type(png, png_info) !=
+				PNG_COLOR_TYPE_RGB_ALPHA ||
+			png_get_interlace_type(png, png_info) !=
+				PNG_INTERLACE_NONE) {
+		fprintf(stderr, "%s isn't a %dx%d image as write_png() "
+				"writes them\n", filename, cols, rows);
+		png_error(png, "unexpected format");
+	}
+
+	row_ptrs = malloc(rows * sizeof(*row_ptrs));
+	if (!row_ptrs)
+		png_error(png, "out of memory");
+
+	for (i = 0; i < rows; i++)
+		row_ptrs[i] = (uint8_t *)&image[(size_t)i * cols];
+
+	png_read_image(png, row_ptrs);
+	png_read_end(png, NULL);
+
+	png_destroy_read_struct(&png, &png_info, NULL);
+	fclose(fp);
+	free(row_ptrs);
+
+	return 0;
+}
+
+/*
+ * The streaming writer builds the PNG itself, pigz-style: each band is
+ * filtered and deflated on its own by one of a pool of threads, as a raw
+ * deflate stream ending on a byte boundary (Z_SYNC_FLUSH) and primed with
+ * the end of the band above as its dictionary, so little is lost to the
+ * split. The bands are then written in order as IDAT chunks, which together
+ * hold a single zlib stream, whose Adler-32 is put together from the bands'.
+ */
+
+/* bytes per pixel, as RGBA */
+#define PNG_BPP		4
+
+enum band_state {
+	BAND_WAITING,	/* not finished yet */
+	BAND_DONE,	/* finished, not yet taken by a worker */
+	BAND_ENCODING,
+	BAND_ENCODED,
+};
+
+struct png_band {
+	enum band_state state;
+
+	/* the deflated band, and the Adler-32 of its filtered rows */
+	uint8_t *data;
+	size_t len;
+	uLong adler;
+	size_t raw_len;
+};
+
+struct png_stream {
+	FILE *fp;
+
+	struct pixel *image;
+	int rows, cols, band_rows, n_bands;
+	int level;
+
+	void (*release)(void *data, struct pixel *pixels, size_t size);
+	void *release_data;
+
+	/* the state of each band; closing is set by png_stream_close(), after
+	 * which no more bands will be finished */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct png_band *bands;
+	int closing;
+
+	/* the writer, and the workers that encode the bands */
+	pthread_t thread;
+	pthread_t *workers;
+	int n_workers;
+
+	int error;
+};
+
+/* The Paeth predictor, from the left (a), above (b) and above-left (c) */
+static inline int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+/*
+ * Filter the @len bytes of @row, under @prev, into @out, with whichever
+ * filter gives the smallest sum of absolute differences, as libpng picks.
+ * @try is scratch space for 5 filtered rows of @len + 1 bytes.
+ */
+static void filter_row(uint8_t *out, const uint8_t *row, const uint8_t *prev,
+		size_t len, uint8_t *try)
+{
+	uint8_t *f[5];
+	unsigned long sum, best_sum;
+	size_t i;
+	int t, best, a, c;
+
+	for (t = 0; t < 5; t++) {
+		f[t] = try + t * (len + 1);
+		f[t][0] = t;
+	}
+
+	for (i = 0; i < len; i++) {
+		a = i < PNG_BPP ? 0 : row[i - PNG_BPP];
+		c = i < PNG_BPP ? 0 : prev[i - PNG_BPP];
+
+		f[0][i + 1] = row[i];
+		f[1][i + 1] = row[i] - a;
+		f[2][i + 1] = row[i] - prev[i];
+		f[3][i + 1] = row[i] - ((a + prev[i]) >> 1);
+		f[4][i + 1] = row[i] - paeth(a, prev[i], c);
+	}
+
+	best = 0;
+	best_sum = ~0ul;
+	for (t = 0; t < 5; t++) {
+		sum = 0;
+		for (i = 1; i <= len; i++)
+			sum += abs((int8_t)f[t][i]);
+		if (sum < best_sum) {
+			best_sum = sum;
+			best = t;
+		}
+	}
+
+	memcpy(out, f[best], len + 1);
+}
+
+/* The @row'th row of @stream's image, as bytes */
+static const uint8_t *image_row(struct png_stream *stream, int row)
+{
+	return (const uint8_t *)&stream->image[(size_t)row * stream->cols];
+}
+
+/* Deflate all of @z's input into @band, with @flush, growing it to fit */
+static int band_deflate(z_stream *z, struct png_band *band, size_t *size,
+		int flush)
+{
+	int ret;
+
+	do {
+		if (band->len == *size) {
+			*size *= 2;
+			band->data = realloc(band->data, *size);
+			if (!band->data)
+				return -1;
+		}
+		z->next_out = band->data + band->len;
+		z->avail_out = *size - band->len;
+
+		ret = deflate(z, flush);
+		band->len = *size - z->avail_out;
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+	} while (!z->avail_out);
+
+	return 0;
+}
+
+/* Filter and deflate band @b of @stream, with the rows above it to hand */
+static int encode_band(struct png_stream *stream, int b, uint8_t *rowbuf,
+		uint8_t *try, const uint8_t *zeros)
+{
+	struct png_band *band = &stream->bands[b];
+	size_t row_len = (size_t)stream->cols * PNG_BPP, size;
+	int first = b * stream->band_rows, last, dict_first, r;
+	uint8_t *dict = NULL;
+	size_t dict_len = 0;
+	unsigned int header;
+	z_stream z;
+
+	last = first + stream->band_rows;
+	if (last > stream->rows)
+		last = stream->rows;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, stream->level, Z_DEFLATED, -15, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	/* re-filter the end of the band above, as far back as the 32 kB
+	 * window goes, without going beyond it: the band above that may be
+	 * gone already */
+	if (b) {
+		dict_first = first - (32768 + row_len) / (row_len + 1);
+		if (dict_first <= first - stream->band_rows)
+			dict_first = first - stream->band_rows + 1;
+
+		if (dict_first < first) {
+			dict = malloc((first - dict_first) * (row_len + 1));
+			if (!dict)
+				goto err;
+			for (r = dict_first; r < first; r++, dict_len += row_len + 1)
+				filter_row(dict + dict_len, image_row(stream, r),
+						image_row(stream, r - 1), row_len, try);
+			if (dict_len > 32768)
+				deflateSetDictionary(&z, dict + dict_len - 32768,
+						32768);
+			else
+				deflateSetDictionary(&z, dict, dict_len);
+		}
+	}
+
+	/* the first band starts the zlib stream, with a header */
+	size = deflateBound(&z, (last - first) * (row_len + 1)) + 64;
+	band->data = malloc(size);
+	if (!band->data)
+		goto err;
+	band->len = 0;
+	if (!b) {
+		header = 0x7800 | (stream->level < 0 || stream->level == 6 ? 2 :
+				stream->level < 2 ? 0 :
+				stream->level < 6 ? 1 : 3) << 6;
+		header += 31 - header % 31;
+		band->data[0] = header >> 8;
+		band->data[1] = header;
+		band->len = 2;
+	}
+
+	band->adler = adler32(0, NULL, 0);
+	band->raw_len = 0;
+	for (r = first; r < last; r++) {
+		filter_row(rowbuf, image_row(stream, r),
+				r ? image_row(stream, r - 1) : zeros, row_len,
+				try);
+		band->adler = adler32(band->adler, rowbuf, row_len + 1);
+		band->raw_len += row_len + 1;
+
+		z.next_in = rowbuf;
+		z.avail_in = row_len + 1;
+		if (band_deflate(&z, band, &size, last == stream->rows &&
+					r == last - 1 ? Z_FINISH :
+					r == last - 1 ? Z_SYNC_FLUSH :
+					Z_NO_FLUSH))
+			goto err;
+	}
+
+	deflateEnd(&z);
+	free(dict);
+	return 0;
+
+err:
+	deflateEnd(&z);
+	free(dict);
+	return -1;
+}
+
+/* Encode bands as soon as they, and the ones above them, are finished */
+static void *png_worker_fn(void *data)
+{
+	struct png_stream *stream = data;
+	size_t row_len = (size_t)stream->cols * PNG_BPP;
+	uint8_t *rowbuf, *try, *zeros;
+	int b, error;
+
+	rowbuf = malloc(row_len + 1);
+	try = malloc(5 * (row_len + 1));
+	zeros = calloc(1, row_len);
+
+	pthread_mutex_lock(&stream->lock);
+	for (;;) {
+		/* the first band that's ready, if any */
+		for (b = 0; b < stream->n_bands; b++)
+			if (stream->bands[b].state == BAND_DONE &&
+					(!b || stream->bands[b - 1].state !=
+					 BAND_WAITING))
+				break;
+
+		if (b == stream->n_bands) {
+			for (b = 0; b < stream->n_bands; b++)
+				if (stream->bands[b].state < BAND_ENCODING)
+					break;
+			/* all taken, or none ever will be */
+			if (b == stream->n_bands || stream->closing ||
+					stream->error)
+				break;
+			pthread_cond_wait(&stream->cond, &stream->lock);
+			continue;
+		}
+
+		stream->bands[b].state = BAND_ENCODING;
+		pthread_mutex_unlock(&stream->lock);
+
+		error = !rowbuf || !try || !zeros ||
+			encode_band(stream, b, rowbuf, try, zeros);
+
+		pthread_mutex_lock(&stream->lock);
+		stream->bands[b].state = BAND_ENCODED;
+		if (error)
+			stream->error = 1;
+		pthread_cond_broadcast(&stream->cond);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	free(rowbuf);
+	free(try);
+	free(zeros);
+	return NULL;
+}
+
+/* Write a PNG chunk of @type, with its length and CRC */
+static int write_chunk(FILE *fp, const char *type, const uint8_t *data,
+		size_t len)
+{
+	uint8_t word[4];
+	uLong crc;
+
+	/* crc32() with no data gives the initial CRC, not the one passed */
+	crc = crc32(crc32(0, NULL, 0), (const Bytef *)type, 4);
+	if (len)
+		crc = crc32(crc, data, len);
+
+	word[0] = len >> 24;
+	word[1] = len >> 16;
+	word[2] = len >> 8;
+	word[3] = len;
+	if (fwrite(word, 4, 1, fp) != 1 || fwrite(type, 4, 1, fp) != 1 ||
+			(len && fwrite(data, len, 1, fp) != 1))
+		return -1;
+
+	word[0] = crc >> 24;
+	word[1] = crc >> 16;
+	word[2] = crc >> 8;
+	word[3] = crc;
+	return fwrite(word, 4, 1, fp) == 1 ? 0 : -1;
+}
+
+/*
+ * Write each band, in order, once it's encoded, and give back the pixels of
+ * the one above it, which nothing will look at again
+ */
+static void *png_stream_fn(void *data)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	struct png_stream *stream = data;
+	struct png_band *band;
+	uint8_t ihdr[13];
+	size_t band_size = (size_t)stream->band_rows * stream->cols *
+		sizeof(*stream->image);
+	uLong adler;
+	int b;
+
+	ihdr[0] = stream->cols >> 24;
+	ihdr[1] = stream->cols >> 16;
+	ihdr[2] = stream->cols >> 8;
+	ihdr[3] = stream->cols;
+	ihdr[4] = stream->rows >> 24;
+	ihdr[5] = stream->rows >> 16;
+	ihdr[6] = stream->rows >> 8;
+	ihdr[7] = stream->rows;
+	ihdr[8] = 8;			/* bit depth */
+	ihdr[9] = PNG_COLOR_TYPE_RGB_ALPHA;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;	/* deflate, adaptive filters,
+						 * no interlacing */
+
+	if (fwrite(signature, sizeof(signature), 1, stream->fp) != 1 ||
+			write_chunk(stream->fp, "IHDR", ihdr, sizeof(ihdr)))
+		goto err_write;
+
+	adler = adler32(0, NULL, 0);
+	for (b = 0; b < stream->n_bands; b++) {
+		band = &stream->bands[b];
+
+		pthread_mutex_lock(&stream->lock);
+		while (band->state != BAND_ENCODED && !stream->error &&
+				!(stream->closing && band->state == BAND_WAITING))
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		pthread_mutex_unlock(&stream->lock);
+
+		if (stream->error) {
+			fprintf(stderr, "png encoding failed\n");
+			return NULL;
+		}
+		if (band->state != BAND_ENCODED) {
+			fprintf(stderr, "png stream closed before the image "
+					"was finished\n");
+			goto err;
+		}
+
+		/* the end of the zlib stream is the Adler-32 of it all */
+		adler = adler32_combine(adler, band->adler, band->raw_len);
+		if (b == stream->n_bands - 1) {
+			band->data = realloc(band->data, band->len + 4);
+			if (!band->data)
+				goto err_write;
+			band->data[band->len++] = adler >> 24;
+			band->data[band->len++] = adler >> 16;
+			band->data[band->len++] = adler >> 8;
+			band->data[band->len++] = adler;
+		}
+
+		if (write_chunk(stream->fp, "IDAT", band->data, band->len))
+			goto err_write;
+		free(band->data);
+		band->data = NULL;
+
+		if (b && stream->release)
+			stream->release(stream->release_data,
+					stream->image + (size_t)(b - 1) *
+					stream->band_rows * stream->cols,
+					band_size);
+	}
+
+	if (write_chunk(stream->fp, "IEND", NULL, 0))
+		goto err_write;
+
+	if (stream->release)
+		stream->release(stream->release_data, stream->image +
+				(size_t)(stream->n_bands - 1) *
+				stream->band_rows * stream->cols,
+				(size_t)(stream->rows - (stream->n_bands - 1) *
+					 stream->band_rows) *
+				stream->cols * sizeof(*stream->image));
+	return NULL;
+
+err_write:
+	perror("png write");
+err:
+	pthread_mutex_lock(&stream->lock);
+	stream->error = 1;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+	return NULL;
+}
+
+struct png_stream *png_stream_open(const char *filename, int rows, int cols,
+		struct pixel *image, int band_rows, int n_threads, int level,
+		void (*release)(void *data, struct pixel *pixels, size_t size),
+		void *release_data)
+{
+	struct png_stream *stream;
+	int i;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		perror("calloc");
+		return NULL;
+	}
+
+	stream->image = image;
+	stream->rows = rows;
+	stream->cols = cols;
+	stream->band_rows = band_rows;
+	stream->n_bands = (rows + band_rows - 1) / band_rows;
+	stream->level = level;
+	stream->release = release;
+	stream->release_data = release_data;
+
+	stream->bands = calloc(stream->n_bands, sizeof(*stream->bands));
+	stream->workers = calloc(n_threads, sizeof(*stream->workers));
+	if (!stream->bands || !stream->workers) {
+		perror("calloc");
+		goto err_free;
+	}
+
+	stream->fp = fopen(filename, "wb");
+	if (!stream->fp) {
+		perror("fopen");
+		goto err_free;
+	}
+
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&stream->workers[i], NULL, png_worker_fn,
+					stream))
+			break;
+		stream->n_workers++;
+	}
+
+	if (!stream->n_workers || pthread_create(&stream->thread, NULL,
+				png_stream_fn, stream)) {
+		fprintf(stderr, "Couldn't start the png writer\n");
+		goto err_join;
+	}
+
+	return stream;
+
+err_join:
+	pthread_mutex_lock(&stream->lock);
+	stream->error = 1;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+	for (i = 0; i < stream->n_workers; i++)
+		pthread_join(stream->workers[i], NULL);
+	fclose(stream->fp);
+err_free:
+	free(stream->workers);
+	free(stream->bands);
+	free(stream);
+	return NULL;
+}
+
+void png_stream_band_done(struct png_stream *stream, int band)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->bands[band].state = BAND_DONE;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+int png_stream_close(struct png_stream *stream)
+{
+	int error, i;
+
+	pthread_mutex_lock(&stream->lock);
+	stream->closing = 1;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+
+	pthread_join(stream->thread, NULL);
+	for (i = 0; i < stream->n_workers; i++)
+		pthread_join(stream->workers[i], NULL);
+
+	if (fclose(stream->fp)) {
+		perror("fclose");
+		stream->error = 1;
+	}
+
+	error = stream->error;
+	for (i = 0; i < stream->n_bands; i++)
+		free(stream->bands[i].data);
+	pthread_mutex_destroy(&stream->lock);
+	pthread_cond_destroy(&stream->cond);
+	free(stream->bands);
+	free(stream->workers);
+	free(stream);
+
+	return error ? -1 : 0;
+}
@@ -2,9 +2,45 @@
 #define _PNG_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "fractal.h"
 
 int write_png(const char *filename, int rows, int cols, struct pixel *image);
 
+/*
+ * Read a @rows x @cols PNG, as write_png() writes them, into @image.
+ * Returns 0 on success.
+ */
+int read_png(const char *filename, int rows, int cols, struct pixel *image);
+
+/*
+ * A PNG that is written out a band of rows at a time, as the bands are
+ * finished. The image is then encoded while the rest of it is still being
+ * rendered, and doesn't all need to stay in memory. The bands are
+ * compressed independently, on a pool of threads, so a large image isn't
+ * held up by a single core's deflate.
+ */
+struct png_stream;
+
+/*
+ * Start writing the @rows x @cols @image to @filename, in bands of
+ * @band_rows, compressed at zlib @level by @n_threads threads. Once each
+ * band is written and nothing needs it any more, @release (if not NULL) is
+ * called with @release_data and the band's pixels, which may then be freed.
+ */
+struct png_stream *png_stream_open(const char *filename, int rows, int cols,
+		struct pixel *image, int band_rows, int n_threads, int level,
+		void (*release)(void *data, struct pixel *pixels, size_t size),
+		void *release_data);
+
+/* Band @band of the image is finished; bands may finish in any order */
+void png_stream_band_done(struct png_stream *stream, int band);
+
+/*
+ * Wait for the finished bands to be written, and close the file. Returns 0
+ * on success, which needs every band to have been finished.
+ */
+int png_stream_close(struct png_stream *stream);
+
 #endif /* _PNG_H */
@@ -0,0 +1,310 @@
+/**
+ * Tile pyramids, for slippy-map viewers.
+ *
+ * Only the deepest level is rendered. Each tile above it is the four tiles
+ * below it, downsampled, which costs a few PNG reads and no iterations at
+ * all. Every tile goes into a cache named by a hash of what made it, so
+ * building the pyramid again, or another one that shares tiles with it,
+ * only makes the tiles that are new.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pyramid.h"
+#include "png.h"
+#include "offscreen.h"
+
+/* 64-bit FNV-1a, continuing from @hash */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+#define FNV_BASIS	0xcbf29ce484222325ull
+
+/* The hash of a tile rendered from @tile */
+static uint64_t render_key(const struct pyramid *pyramid,
+		const struct fractal_params *tile)
+{
+	char params[256];
+	int len;
+
+	/* %a, so that the hash is of the exact doubles */
+	len = snprintf(params, sizeof(params), "render %d %a %a %a %d %d %d",
+			PYRAMID_TILE, tile->x, tile->y, tile->delta,
+			tile->i_max, pyramid->smooth, pyramid->precision);
+	return fnv1a(FNV_BASIS, params, len);
+}
+
+/* The hash of a tile downsampled from the tiles of @children */
+static uint64_t downsample_key(const uint64_t children[4])
+{
+	return fnv1a(fnv1a(FNV_BASIS, "downsample", 10), children,
+			4 * sizeof(*children));
+}
+
+static void cache_path(char *path, const struct pyramid *pyramid,
+		uint64_t key)
+{
+	snprintf(path, PATH_MAX, "%s/%016llx.png", pyramid->cache,
+			(unsigned long long)key);
+}
+
+/* Make directory @path, and any of its parents that are missing */
+static int make_dirs(const char *path)
+{
+	char dir[PATH_MAX];
+	char *p;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (p = dir + 1; ; p++) {
+		if (*p && *p != '/')
+			continue;
+
+		*p = '\0';
+		if (mkdir(dir, 0755) && errno != EEXIST) {
+			perror(dir);
+			return -1;
+		}
+		if (!path[p - dir])
+			return 0;
+		*p = '/';
+	}
+}
+
+/*
+ * Write @image to the cache as @key, through a temporary file so that a
+ * reader never sees half a tile
+ */
+static int cache_write(const struct pyramid *pyramid, uint64_t key,
+		struct pixel *image)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+
+	cache_path(path, pyramid, key);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+	if (write_png(tmp, PYRAMID_TILE, PYRAMID_TILE, image))
+		return -1;
+
+	if (rename(tmp, path)) {
+		perror("rename");
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Link tile (@x, @y) of level @z, from the cache as @key, into the pyramid */
+static int publish(const struct pyramid *pyramid, int z, int x, int y,
+		uint64_t key)
+{
+	char path[PATH_MAX + 16], dir[PATH_MAX], target[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s/%d/%d", pyramid->dir, z, x);
+	if (!y && make_dirs(dir))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%d.png", dir, y);
+	cache_path(target, pyramid, key);
+	unlink(path);
+
+	/* a hard link if the cache is on the same filesystem; otherwise a
+	 * symbolic one, which needs the cache's full path */
+	if (!link(target, path))
+		return 0;
+
+	if (!realpath(target, dir) || symlink(dir, path)) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* The view of tile (@x, @y) of level @z */
+static void tile_params(const struct pyramid *pyramid, int z, int x, int y,
+		struct fractal_params *tile)
+{
+	const struct fractal_params *region = &pyramid->region;
+	int level_size = PYRAMID_TILE << z;
+
+	*tile = *region;
+	tile->cols = tile->rows = PYRAMID_TILE;
+	tile->delta = region->delta / (1 << z);
+	tile->x = region->x + (x * PYRAMID_TILE + PYRAMID_TILE / 2 -
+			level_size / 2) * tile->delta;
+	tile->y = region->y + (y * PYRAMID_TILE + PYRAMID_TILE / 2 -
+			level_size / 2) * tile->delta;
+}
+
+/*
+ * Fill the quarter of @image at (@qx, @qy) with @child shrunk to half its
+ * size, averaging each 2x2 block of pixels
+ */
+static void downsample_quarter(struct pixel *image, int qx, int qy,
+		const struct pixel *child)
+{
+	const int half = PYRAMID_TILE / 2;
+	const uint8_t *p, *q;
+	uint8_t *out;
+	int r, c, i;
+
+	for (r = 0; r < half; r++) {
+		out = (uint8_t *)&image[(qy * half + r) * PYRAMID_TILE +
+			qx * half];
+		p = (const uint8_t *)&child[2 * r * PYRAMID_TILE];
+		q = p + PYRAMID_TILE * sizeof(*child);
+
+		for (c = 0; c < half; c++) {
+			for (i = 0; i < (int)sizeof(*child); i++)
+				out[i] = (p[i] + p[i + sizeof(*child)] +
+					q[i] + q[i + sizeof(*child)] + 2) >> 2;
+			out += sizeof(*child);
+			p += 2 * sizeof(*child);
+			q += 2 * sizeof(*child);
+		}
+	}
+}
+
+/* Make a tile from the four @children, which are in the cache */
+static int downsample(const struct pyramid *pyramid,
+		const uint64_t children[4], struct pixel *image,
+		struct pixel *child)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		cache_path(path, pyramid, children[i]);
+		if (read_png(path, PYRAMID_TILE, PYRAMID_TILE, child))
+			return -1;
+		downsample_quarter(image, i & 1, i >> 1, child);
+	}
+	return 0;
+}
+
+/*
+ * Make tile (@x, @y) of level @z, unless it's in the cache, and put it in
+ * the pyramid. Its hash goes in @keys; @below has the hashes of the level
+ * below, if it isn't the deepest. @image and @child are scratch images.
+ */
+static int make_tile(const struct pyramid *pyramid,
+		const struct pyramid_ops *ops, void *data, int z, int x, int y,
+		uint64_t *keys, const uint64_t *below, struct pixel *image,
+		struct pixel *child, struct pyramid_stats *stats)
+{
+	struct fractal_params tile;
+	char path[PATH_MAX];
+	uint64_t children[4];
+	const uint64_t *c;
+	struct stat st;
+	double start = now_ms();
+	int n = 1 << z;
+	uint64_t *key = &keys[y * n + x];
+
+	tile_params(pyramid, z, x, y, &tile);
+	tile.imgbuf = image;
+
+	if (z == pyramid->levels) {
+		*key = render_key(pyramid, &tile);
+	} else {
+		c = &below[2 * y * 2 * n + 2 * x];
+		children[0] = c[0];
+		children[1] = c[1];
+		children[2] = c[2 * n];
+		children[3] = c[2 * n + 1];
+		*key = downsample_key(children);
+	}
+
+	cache_path(path, pyramid, *key);
+	if (!stat(path, &st)) {
+		stats->cached++;
+
+	} else if (z == pyramid->levels) {
+		if (ops->render(data, &tile) ||
+				cache_write(pyramid, *key, image))
+			return -1;
+		stats->rendered++;
+		stats->render_ms += now_ms() - start;
+
+	} else {
+		if (downsample(pyramid, children, image, child) ||
+				cache_write(pyramid, *key, image))
+			return -1;
+		stats->downsampled++;
+		stats->downsample_ms += now_ms() - start;
+	}
+
+	return publish(pyramid, z, x, y, *key);
+}
+
+int pyramid_build(const struct pyramid *pyramid,
+		const struct pyramid_ops *ops, void *data,
+		struct pyramid_stats *stats)
+{
+	struct fractal_params level;
+	struct offscreen image, child;
+	uint64_t *keys = NULL, *below = NULL;
+	int z, n, x, y, rc = -1;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (make_dirs(pyramid->cache) || make_dirs(pyramid->dir))
+		return -1;
+
+	if (offscreen_alloc(&image, PYRAMID_TILE, PYRAMID_TILE, 0))
+		return -1;
+	if (offscreen_alloc(&child, PYRAMID_TILE, PYRAMID_TILE, 0))
+		goto out_image;
+
+	/* from the bottom up, as each level is made from the one below */
+	for (z = pyramid->levels; z >= 0; z--) {
+		n = 1 << z;
+		keys = malloc((size_t)n * n * sizeof(*keys));
+		if (!keys) {
+			perror("malloc");
+			goto out;
+		}
+
+		if (z == pyramid->levels) {
+			level = pyramid->region;
+			level.cols = level.rows = PYRAMID_TILE << z;
+			level.delta /= n;
+			if (ops->begin_level(data, &level))
+				goto out;
+		}
+
+		for (y = 0; y < n; y++)
+			for (x = 0; x < n; x++)
+				if (make_tile(pyramid, ops, data, z, x, y,
+							keys, below,
+							image.pixels,
+							child.pixels, stats))
+					goto out;
+
+		free(below);
+		below = keys;
+		keys = NULL;
+	}
+
+	rc = 0;
+out:
+	free(keys);
+	free(below);
+	offscreen_free(&child);
+out_image:
+	offscreen_free(&image);
+	return rc;
+}
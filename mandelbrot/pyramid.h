@@ -0,0 +1,62 @@
+#ifndef _PYRAMID_H
+#define _PYRAMID_H
+
+#include "fractal.h"
+
+/* the size of a pyramid tile, in pixels each way */
+#define PYRAMID_TILE	256
+
+/* the deepest zoom level a pyramid can have */
+#define PYRAMID_MAX_LEVEL	12
+
+/*
+ * A quadtree of tiles, as a slippy map serves them: at level z, the region
+ * is 2^z x 2^z tiles of PYRAMID_TILE pixels, written to dir/z/x/y.png.
+ */
+struct pyramid {
+	/* the whole region as level 0's single tile */
+	struct fractal_params region;
+
+	/* the deepest level, which is the only one rendered; the levels
+	 * above are downsampled from it */
+	int levels;
+
+	const char *dir;
+
+	/*
+	 * Tiles are kept in cache named by a hash of everything that goes
+	 * into them: their view and how they are coloured for rendered
+	 * tiles, and the tiles they were made from for downsampled ones.
+	 * Each tile in dir is a link into cache.
+	 */
+	const char *cache;
+
+	/* mixed into rendered tiles' hashes, as they change the image */
+	int smooth, precision;
+};
+
+struct pyramid_ops {
+	/* About to render tiles of @level, which is the whole level as one
+	 * image. Returns 0 on success. */
+	int (*begin_level)(void *data, const struct fractal_params *level);
+
+	/* Render @tile into its imgbuf. Returns 0 on success. */
+	int (*render)(void *data, const struct fractal_params *tile);
+};
+
+/* how each tile was come by, and how long the tiles that were made took,
+ * writing them out included */
+struct pyramid_stats {
+	unsigned long rendered, downsampled, cached;
+	double render_ms, downsample_ms;
+};
+
+/*
+ * Write every tile of @pyramid that isn't in its cache already, rendering
+ * them with @ops and @data. Returns 0 on success.
+ */
+int pyramid_build(const struct pyramid *pyramid,
+		const struct pyramid_ops *ops, void *data,
+		struct pyramid_stats *stats);
+
+#endif /* _PYRAMID_H */
@@ -0,0 +1,232 @@
+/**
+ * Reference orbits for deep zooms.
+ *
+ * Past a zoom of about 1e-7 a float can't tell neighbouring pixels apart,
+ * and past about 1e-16 neither can a double. Instead, the orbit of the
+ * image's centre is computed once here, in fixed point with as many bits as
+ * the zoom needs, and the SPEs iterate each pixel's (small) offset from it
+ * in double precision.
+ *
+ * The fixed-point numbers are two's complement, in 32-bit limbs with the
+ * least significant first. The top limb is the integer part.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+#include <malloc.h>
+
+#include "common.h"
+#include "ref-orbit.h"
+
+/* 1280 bits, past where a double can hold the pixel offsets anyway */
+#define HP_MAX_LIMBS	41
+
+struct hp {
+	uint32_t l[HP_MAX_LIMBS];
+};
+
+static int hp_limbs;
+
+static int hp_negative(const struct hp *a)
+{
+	return a->l[hp_limbs - 1] >> 31;
+}
+
+static void hp_neg(struct hp *r, const struct hp *a)
+{
+	uint64_t carry = 1;
+	int i;
+
+	for (i = 0; i < hp_limbs; i++) {
+		carry += (uint32_t)~a->l[i];
+		r->l[i] = carry;
+		carry >>= 32;
+	}
+}
+
+static void hp_add(struct hp *r, const struct hp *a, const struct hp *b)
+{
+	uint64_t carry = 0;
+	int i;
+
+	for (i = 0; i < hp_limbs; i++) {
+		carry += (uint64_t)a->l[i] + b->l[i];
+		r->l[i] = carry;
+		carry >>= 32;
+	}
+}
+
+static void hp_sub(struct hp *r, const struct hp *a, const struct hp *b)
+{
+	struct hp nb;
+
+	hp_neg(&nb, b);
+	hp_add(r, a, &nb);
+}
+
+static void hp_mul(struct hp *r, const struct hp *a, const struct hp *b)
+{
+	uint32_t prod[2 * HP_MAX_LIMBS];
+	struct hp ua, ub;
+	uint64_t carry;
+	int i, j, neg;
+
+	neg = hp_negative(a) ^ hp_negative(b);
+	if (hp_negative(a))
+		hp_neg(&ua, a);
+	else
+		ua = *a;
+	if (hp_negative(b))
+		hp_neg(&ub, b);
+	else
+		ub = *b;
+
+	memset(prod, 0, sizeof(prod));
+	for (i = 0; i < hp_limbs; i++) {
+		carry = 0;
+		for (j = 0; j < hp_limbs; j++) {
+			carry += (uint64_t)ua.l[i] * ub.l[j] + prod[i + j];
+			prod[i + j] = carry;
+			carry >>= 32;
+		}
+		prod[i + hp_limbs] = carry;
+	}
+
+	/* drop the extra fraction limbs; the integer part is small enough
+	 * that nothing is lost off the top */
+	memcpy(r->l, &prod[hp_limbs - 1], hp_limbs * sizeof(r->l[0]));
+	if (neg)
+		hp_neg(r, r);
+}
+
+static double hp_to_double(const struct hp *a)
+{
+	struct hp u;
+	double d = 0;
+	int i;
+
+	if (hp_negative(a))
+		hp_neg(&u, a);
+	else
+		u = *a;
+
+	for (i = 0; i < hp_limbs; i++)
+		d += ldexp(u.l[i], 32 * (i - (hp_limbs - 1)));
+
+	return hp_negative(a) ? -d : d;
+}
+
+/* Parse a decimal number, such as -0.7436438870371587. Returns 0 on
+ * success */
+static int hp_from_string(struct hp *r, const char *s)
+{
+	const char *frac, *p;
+	uint64_t cur, rem;
+	int32_t integer;
+	int i, neg;
+
+	neg = *s == '-';
+	if (*s == '-' || *s == '+')
+		s++;
+
+	if (!isdigit(*s) && !(*s == '.' && isdigit(s[1])))
+		return -1;
+
+	memset(r, 0, sizeof(*r));
+
+	integer = strtol(s, (char **)&frac, 10);
+	if (*frac == '.')
+		frac++;
+
+	/* find the end of the fraction's digits, and work back from there,
+	 * dividing by ten as each digit is added on the left */
+	for (p = frac; isdigit(*p); p++)
+		;
+	if (*p)
+		return -1;
+
+	while (p-- > frac) {
+		rem = *p - '0';
+		for (i = hp_limbs - 2; i >= 0; i--) {
+			cur = (rem << 32) | r->l[i];
+			r->l[i] = cur / 10;
+			rem = cur % 10;
+		}
+	}
+
+	r->l[hp_limbs - 1] = integer;
+	if (neg)
+		hp_neg(r, r);
+
+	return 0;
+}
+
+int ref_orbit_init(struct ref_orbit *orbit, const char *x, const char *y,
+		double delta, int i_max)
+{
+	struct hp cr, ci, zr, zi, zr2, zi2, tmp;
+	double re, im;
+	int n;
+
+	/* enough fraction bits to place each pixel, and enough again for
+	 * the iteration to lose */
+	orbit->bits = -log2(delta) + 64;
+	hp_limbs = (orbit->bits + 31) / 32 + 1;
+	if (hp_limbs > HP_MAX_LIMBS) {
+		fprintf(stderr, "delta %g is too small for a deep zoom\n",
+				delta);
+		return -1;
+	}
+	orbit->bits = 32 * (hp_limbs - 1);
+
+	if (hp_from_string(&cr, x) || hp_from_string(&ci, y)) {
+		fprintf(stderr, "Invalid centre %s, %s\n", x, y);
+		return -1;
+	}
+
+	/* room for Z_0 .. Z_i_max, rounded up to whole vectors for DMA */
+	orbit->re = memalign(SPE_ALIGN, ((i_max + 2) & ~1) * sizeof(double));
+	orbit->im = memalign(SPE_ALIGN, ((i_max + 2) & ~1) * sizeof(double));
+	if (!orbit->re || !orbit->im) {
+		perror("memalign");
+		ref_orbit_free(orbit);
+		return -1;
+	}
+
+	memset(&zr, 0, sizeof(zr));
+	memset(&zi, 0, sizeof(zi));
+	orbit->re[0] = orbit->im[0] = 0;
+
+	for (n = 1; n <= i_max; n++) {
+		/* z = z^2 + c */
+		hp_mul(&zr2, &zr, &zr);
+		hp_mul(&zi2, &zi, &zi);
+		hp_mul(&tmp, &zr, &zi);
+		hp_add(&zi, &tmp, &tmp);
+		hp_add(&zi, &zi, &ci);
+		hp_sub(&zr, &zr2, &zi2);
+		hp_add(&zr, &zr, &cr);
+
+		orbit->re[n] = re = hp_to_double(&zr);
+		orbit->im[n] = im = hp_to_double(&zi);
+
+		if (re * re + im * im > 4.0) {
+			n++;
+			break;
+		}
+	}
+
+	orbit->len = n;
+	return 0;
+}
+
+void ref_orbit_free(struct ref_orbit *orbit)
+{
+	free(orbit->re);
+	free(orbit->im);
+	orbit->re = orbit->im = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef _REF_ORBIT_H
+#define _REF_ORBIT_H
+
+/*
+ * The orbit of the centre of a deep zoom: Z_0 .. Z_{len - 1}, computed at
+ * whatever precision the zoom needs, then rounded to double. It stops at
+ * i_max iterations, or at the first Z to escape.
+ */
+struct ref_orbit {
+	double *re, *im;
+	int len;
+
+	/* bits of precision it was computed with */
+	int bits;
+};
+
+/*
+ * Compute the orbit of @x + @yi, which are decimal strings, for an image
+ * whose pixels are @delta apart. Returns 0 on success.
+ */
+int ref_orbit_init(struct ref_orbit *orbit, const char *x, const char *y,
+		double delta, int i_max);
+
+void ref_orbit_free(struct ref_orbit *orbit);
+
+#endif /* _REF_ORBIT_H */
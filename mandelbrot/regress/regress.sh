@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Render each view here in block mode and by subdivision (-m), and check
+# that the images are the same. Any arguments are passed to both renders,
+# e.g. -n 2 -w 8 or -e. Build ../fractal first (make, or make HOST=1).
+
+dir=$(cd "$(dirname "$0")" && pwd)
+fractal="$dir/../fractal"
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+failed=0
+for params in "$dir"/*.data; do
+	view=$(basename "$params" .data)
+
+	if ! "$fractal" -H "$@" -p "$params" -o "$out/$view.png" \
+			> /dev/null ||
+			! "$fractal" -H -m "$@" -p "$params" \
+			-o "$out/$view-m.png" > /dev/null; then
+		echo "$view: render failed"
+		failed=1
+	elif ! cmp -s "$out/$view.png" "$out/$view-m.png"; then
+		echo "$view: -m differs from block mode"
+		failed=1
+	else
+		echo "$view: ok"
+	fi
+done
+
+exit $failed
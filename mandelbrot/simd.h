@@ -0,0 +1,745 @@
+/**
+ * Portable vector types for the escape-time kernel.
+ *
+ * Each vector shape has a type, a mask type and a small set of operations,
+ * all named for the shape: a vf32x4 holds four floats, vf32x4_add() adds two
+ * of them and vf32x4_cmpgt() gives a vf32x4_mask. vf32x4_lanes is the
+ * number of elements. The vf64 shapes hold doubles.
+ *
+ * vf32x4 and vf64x2 are built on the SPU intrinsics (natively on the SPU, or
+ * through ../spe-host elsewhere), or on SSE2 where that is available. On x86
+ * there are also vf32x8 and vf64x4, using AVX2, and vf32x16 and vf64x8,
+ * using AVX-512F. Those are
+ * compiled with the matching target options, so they may only be used from
+ * code compiled with the same options, and only after simd_max_lanes() has
+ * said the CPU supports them.
+ */
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <stdint.h>
+
+#define __simd_cat(a, b) a##b
+#define simd_cat(a, b) __simd_cat(a, b)
+
+#if defined(__SSE2__)
+
+#include <immintrin.h>
+
+#define SIMD_HAVE_F32X8
+#define SIMD_HAVE_F32X16
+
+/* vf32x4: SSE2 */
+
+typedef __m128 vf32x4;
+typedef __m128 vf32x4_mask;
+typedef float vf32x4_scalar;
+#define vf32x4_lanes 4
+#define vf32x4_name "SSE2"
+
+static inline vf32x4 vf32x4_splat(float a)
+{
+	return _mm_set1_ps(a);
+}
+
+/* { 0, 1, 2, ... } */
+static inline vf32x4 vf32x4_iota(void)
+{
+	return _mm_set_ps(3, 2, 1, 0);
+}
+
+static inline vf32x4 vf32x4_add(vf32x4 a, vf32x4 b)
+{
+	return _mm_add_ps(a, b);
+}
+
+static inline vf32x4 vf32x4_sub(vf32x4 a, vf32x4 b)
+{
+	return _mm_sub_ps(a, b);
+}
+
+static inline vf32x4 vf32x4_mul(vf32x4 a, vf32x4 b)
+{
+	return _mm_mul_ps(a, b);
+}
+
+static inline vf32x4_mask vf32x4_cmpgt(vf32x4 a, vf32x4 b)
+{
+	return _mm_cmpgt_ps(a, b);
+}
+
+/* elements of b where the mask is set, otherwise a */
+static inline vf32x4 vf32x4_sel(vf32x4 a, vf32x4 b, vf32x4_mask m)
+{
+	return _mm_or_ps(_mm_andnot_ps(m, a), _mm_and_ps(m, b));
+}
+
+static inline vf32x4_mask vf32x4_mask_none(void)
+{
+	return _mm_setzero_ps();
+}
+
+static inline vf32x4_mask vf32x4_mask_or(vf32x4_mask a, vf32x4_mask b)
+{
+	return _mm_or_ps(a, b);
+}
+
+static inline int vf32x4_mask_all(vf32x4_mask m)
+{
+	return _mm_movemask_ps(m) == 0xf;
+}
+
+/* one bit per lane, lane 0 in bit 0 */
+static inline unsigned int vf32x4_mask_bits(vf32x4_mask m)
+{
+	return _mm_movemask_ps(m);
+}
+
+static inline vf32x4 vf32x4_load(const float *p)
+{
+	return _mm_load_ps(p);
+}
+
+static inline void vf32x4_store(float *p, vf32x4 a)
+{
+	_mm_store_ps(p, a);
+}
+
+/* each element rounded towards zero */
+static inline vf32x4 vf32x4_trunc(vf32x4 a)
+{
+	return _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+}
+
+/* { base[index[0]], base[index[1]], ... }, where index holds whole numbers */
+static inline vf32x4 vf32x4_gather(const float *base, vf32x4 index)
+{
+	int32_t i[4] __attribute__((aligned(16)));
+
+	_mm_store_si128((__m128i *)i, _mm_cvttps_epi32(index));
+	return _mm_set_ps(base[i[3]], base[i[2]], base[i[1]], base[i[0]]);
+}
+
+/*
+ * dst[i] = table[index[i]] for each lane, where index holds whole numbers;
+ * dst is aligned as for store
+ */
+static inline void vf32x4_lookup(uint32_t *dst, const uint32_t *table,
+		vf32x4 index)
+{
+	int32_t i[4] __attribute__((aligned(16)));
+
+	_mm_store_si128((__m128i *)i, _mm_cvttps_epi32(index));
+	_mm_store_si128((__m128i *)dst, _mm_set_epi32(table[i[3]],
+			table[i[2]], table[i[1]], table[i[0]]));
+}
+
+/* vf64x2: SSE2 */
+
+typedef __m128d vf64x2;
+typedef __m128d vf64x2_mask;
+typedef double vf64x2_scalar;
+#define vf64x2_lanes 2
+#define vf64x2_name "SSE2"
+
+static inline vf64x2 vf64x2_splat(double a)
+{
+	return _mm_set1_pd(a);
+}
+
+static inline vf64x2 vf64x2_iota(void)
+{
+	return _mm_set_pd(1, 0);
+}
+
+static inline vf64x2 vf64x2_add(vf64x2 a, vf64x2 b)
+{
+	return _mm_add_pd(a, b);
+}
+
+static inline vf64x2 vf64x2_sub(vf64x2 a, vf64x2 b)
+{
+	return _mm_sub_pd(a, b);
+}
+
+static inline vf64x2 vf64x2_mul(vf64x2 a, vf64x2 b)
+{
+	return _mm_mul_pd(a, b);
+}
+
+static inline vf64x2_mask vf64x2_cmpgt(vf64x2 a, vf64x2 b)
+{
+	return _mm_cmpgt_pd(a, b);
+}
+
+static inline vf64x2 vf64x2_sel(vf64x2 a, vf64x2 b, vf64x2_mask m)
+{
+	return _mm_or_pd(_mm_andnot_pd(m, a), _mm_and_pd(m, b));
+}
+
+static inline vf64x2_mask vf64x2_mask_none(void)
+{
+	return _mm_setzero_pd();
+}
+
+static inline vf64x2_mask vf64x2_mask_or(vf64x2_mask a, vf64x2_mask b)
+{
+	return _mm_or_pd(a, b);
+}
+
+static inline unsigned int vf64x2_mask_bits(vf64x2_mask m)
+{
+	return _mm_movemask_pd(m);
+}
+
+static inline vf64x2 vf64x2_load(const double *p)
+{
+	return _mm_load_pd(p);
+}
+
+static inline void vf64x2_store(double *p, vf64x2 a)
+{
+	_mm_store_pd(p, a);
+}
+
+/* { base[index[0]], base[index[1]], ... }, where index holds whole numbers */
+static inline vf64x2 vf64x2_gather(const double *base, vf64x2 index)
+{
+	__m128i i = _mm_cvttpd_epi32(index);
+
+	return _mm_set_pd(base[_mm_cvtsi128_si32(_mm_srli_si128(i, 4))],
+			base[_mm_cvtsi128_si32(i)]);
+}
+
+/* vf32x8: AVX2 */
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+typedef __m256 vf32x8;
+typedef __m256 vf32x8_mask;
+typedef float vf32x8_scalar;
+#define vf32x8_lanes 8
+#define vf32x8_name "AVX2"
+
+static inline vf32x8 vf32x8_splat(float a)
+{
+	return _mm256_set1_ps(a);
+}
+
+static inline vf32x8 vf32x8_iota(void)
+{
+	return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+}
+
+static inline vf32x8 vf32x8_add(vf32x8 a, vf32x8 b)
+{
+	return _mm256_add_ps(a, b);
+}
+
+static inline vf32x8 vf32x8_sub(vf32x8 a, vf32x8 b)
+{
+	return _mm256_sub_ps(a, b);
+}
+
+static inline vf32x8 vf32x8_mul(vf32x8 a, vf32x8 b)
+{
+	return _mm256_mul_ps(a, b);
+}
+
+static inline vf32x8_mask vf32x8_cmpgt(vf32x8 a, vf32x8 b)
+{
+	return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+}
+
+static inline vf32x8 vf32x8_sel(vf32x8 a, vf32x8 b, vf32x8_mask m)
+{
+	return _mm256_blendv_ps(a, b, m);
+}
+
+static inline vf32x8_mask vf32x8_mask_none(void)
+{
+	return _mm256_setzero_ps();
+}
+
+static inline vf32x8_mask vf32x8_mask_or(vf32x8_mask a, vf32x8_mask b)
+{
+	return _mm256_or_ps(a, b);
+}
+
+static inline int vf32x8_mask_all(vf32x8_mask m)
+{
+	return _mm256_movemask_ps(m) == 0xff;
+}
+
+static inline unsigned int vf32x8_mask_bits(vf32x8_mask m)
+{
+	return _mm256_movemask_ps(m);
+}
+
+static inline vf32x8 vf32x8_load(const float *p)
+{
+	return _mm256_load_ps(p);
+}
+
+static inline void vf32x8_store(float *p, vf32x8 a)
+{
+	_mm256_store_ps(p, a);
+}
+
+static inline vf32x8 vf32x8_trunc(vf32x8 a)
+{
+	return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a));
+}
+
+static inline vf32x8 vf32x8_gather(const float *base, vf32x8 index)
+{
+	return _mm256_i32gather_ps(base, _mm256_cvttps_epi32(index), 4);
+}
+
+static inline void vf32x8_lookup(uint32_t *dst, const uint32_t *table,
+		vf32x8 index)
+{
+	_mm256_store_si256((__m256i *)dst, _mm256_i32gather_epi32(
+			(const int *)table, _mm256_cvttps_epi32(index), 4));
+}
+
+/* vf64x4: AVX2 */
+
+typedef __m256d vf64x4;
+typedef __m256d vf64x4_mask;
+typedef double vf64x4_scalar;
+#define vf64x4_lanes 4
+#define vf64x4_name "AVX2"
+
+static inline vf64x4 vf64x4_splat(double a)
+{
+	return _mm256_set1_pd(a);
+}
+
+static inline vf64x4 vf64x4_iota(void)
+{
+	return _mm256_set_pd(3, 2, 1, 0);
+}
+
+static inline vf64x4 vf64x4_add(vf64x4 a, vf64x4 b)
+{
+	return _mm256_add_pd(a, b);
+}
+
+static inline vf64x4 vf64x4_sub(vf64x4 a, vf64x4 b)
+{
+	return _mm256_sub_pd(a, b);
+}
+
+static inline vf64x4 vf64x4_mul(vf64x4 a, vf64x4 b)
+{
+	return _mm256_mul_pd(a, b);
+}
+
+static inline vf64x4_mask vf64x4_cmpgt(vf64x4 a, vf64x4 b)
+{
+	return _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+}
+
+static inline vf64x4 vf64x4_sel(vf64x4 a, vf64x4 b, vf64x4_mask m)
+{
+	return _mm256_blendv_pd(a, b, m);
+}
+
+static inline vf64x4_mask vf64x4_mask_none(void)
+{
+	return _mm256_setzero_pd();
+}
+
+static inline vf64x4_mask vf64x4_mask_or(vf64x4_mask a, vf64x4_mask b)
+{
+	return _mm256_or_pd(a, b);
+}
+
+static inline unsigned int vf64x4_mask_bits(vf64x4_mask m)
+{
+	return _mm256_movemask_pd(m);
+}
+
+static inline vf64x4 vf64x4_load(const double *p)
+{
+	return _mm256_load_pd(p);
+}
+
+static inline void vf64x4_store(double *p, vf64x4 a)
+{
+	_mm256_store_pd(p, a);
+}
+
+static inline vf64x4 vf64x4_gather(const double *base, vf64x4 index)
+{
+	return _mm256_i32gather_pd(base, _mm256_cvttpd_epi32(index), 8);
+}
+
+#pragma GCC pop_options
+
+/* vf32x16: AVX-512F */
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+typedef __m512 vf32x16;
+typedef __mmask16 vf32x16_mask;
+typedef float vf32x16_scalar;
+#define vf32x16_lanes 16
+#define vf32x16_name "AVX-512"
+
+static inline vf32x16 vf32x16_splat(float a)
+{
+	return _mm512_set1_ps(a);
+}
+
+static inline vf32x16 vf32x16_iota(void)
+{
+	return _mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0);
+}
+
+static inline vf32x16 vf32x16_add(vf32x16 a, vf32x16 b)
+{
+	return _mm512_add_ps(a, b);
+}
+
+static inline vf32x16 vf32x16_sub(vf32x16 a, vf32x16 b)
+{
+	return _mm512_sub_ps(a, b);
+}
+
+static inline vf32x16 vf32x16_mul(vf32x16 a, vf32x16 b)
+{
+	return _mm512_mul_ps(a, b);
+}
+
+static inline vf32x16_mask vf32x16_cmpgt(vf32x16 a, vf32x16 b)
+{
+	return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+}
+
+static inline vf32x16 vf32x16_sel(vf32x16 a, vf32x16 b, vf32x16_mask m)
+{
+	return _mm512_mask_blend_ps(m, a, b);
+}
+
+static inline vf32x16_mask vf32x16_mask_none(void)
+{
+	return 0;
+}
+
+static inline vf32x16_mask vf32x16_mask_or(vf32x16_mask a, vf32x16_mask b)
+{
+	return a | b;
+}
+
+static inline int vf32x16_mask_all(vf32x16_mask m)
+{
+	return m == 0xffff;
+}
+
+static inline unsigned int vf32x16_mask_bits(vf32x16_mask m)
+{
+	return m;
+}
+
+static inline vf32x16 vf32x16_load(const float *p)
+{
+	return _mm512_load_ps(p);
+}
+
+static inline void vf32x16_store(float *p, vf32x16 a)
+{
+	_mm512_store_ps(p, a);
+}
+
+static inline vf32x16 vf32x16_trunc(vf32x16 a)
+{
+	return _mm512_cvtepi32_ps(_mm512_cvttps_epi32(a));
+}
+
+static inline vf32x16 vf32x16_gather(const float *base, vf32x16 index)
+{
+	return _mm512_i32gather_ps(_mm512_cvttps_epi32(index), base, 4);
+}
+
+static inline void vf32x16_lookup(uint32_t *dst, const uint32_t *table,
+		vf32x16 index)
+{
+	_mm512_store_si512(dst, _mm512_i32gather_epi32(
+			_mm512_cvttps_epi32(index), table, 4));
+}
+
+/* vf64x8: AVX-512F */
+
+typedef __m512d vf64x8;
+typedef __mmask8 vf64x8_mask;
+typedef double vf64x8_scalar;
+#define vf64x8_lanes 8
+#define vf64x8_name "AVX-512"
+
+static inline vf64x8 vf64x8_splat(double a)
+{
+	return _mm512_set1_pd(a);
+}
+
+static inline vf64x8 vf64x8_iota(void)
+{
+	return _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+}
+
+static inline vf64x8 vf64x8_add(vf64x8 a, vf64x8 b)
+{
+	return _mm512_add_pd(a, b);
+}
+
+static inline vf64x8 vf64x8_sub(vf64x8 a, vf64x8 b)
+{
+	return _mm512_sub_pd(a, b);
+}
+
+static inline vf64x8 vf64x8_mul(vf64x8 a, vf64x8 b)
+{
+	return _mm512_mul_pd(a, b);
+}
+
+static inline vf64x8_mask vf64x8_cmpgt(vf64x8 a, vf64x8 b)
+{
+	return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);
+}
+
+static inline vf64x8 vf64x8_sel(vf64x8 a, vf64x8 b, vf64x8_mask m)
+{
+	return _mm512_mask_blend_pd(m, a, b);
+}
+
+static inline vf64x8_mask vf64x8_mask_none(void)
+{
+	return 0;
+}
+
+static inline vf64x8_mask vf64x8_mask_or(vf64x8_mask a, vf64x8_mask b)
+{
+	return a | b;
+}
+
+static inline unsigned int vf64x8_mask_bits(vf64x8_mask m)
+{
+	return m;
+}
+
+static inline vf64x8 vf64x8_load(const double *p)
+{
+	return _mm512_load_pd(p);
+}
+
+static inline void vf64x8_store(double *p, vf64x8 a)
+{
+	_mm512_store_pd(p, a);
+}
+
+static inline vf64x8 vf64x8_gather(const double *base, vf64x8 index)
+{
+	return _mm512_i32gather_pd(_mm512_cvttpd_epi32(index), base, 8);
+}
+
+#pragma GCC pop_options
+
+/* The widest shape the CPU we're running on can use */
+static inline int simd_max_lanes(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return 16;
+	if (__builtin_cpu_supports("avx2"))
+		return 8;
+	return 4;
+}
+
+#else /* !__SSE2__ */
+
+#include <spu_intrinsics.h>
+
+/* vf32x4: SPU */
+
+typedef vector float vf32x4;
+typedef vector unsigned int vf32x4_mask;
+typedef float vf32x4_scalar;
+#define vf32x4_lanes 4
+#define vf32x4_name "SPU"
+
+static inline vf32x4 vf32x4_splat(float a)
+{
+	return spu_splats(a);
+}
+
+static inline vf32x4 vf32x4_iota(void)
+{
+	return (vector float){0.0f, 1.0f, 2.0f, 3.0f};
+}
+
+static inline vf32x4 vf32x4_add(vf32x4 a, vf32x4 b)
+{
+	return a + b;
+}
+
+static inline vf32x4 vf32x4_sub(vf32x4 a, vf32x4 b)
+{
+	return a - b;
+}
+
+static inline vf32x4 vf32x4_mul(vf32x4 a, vf32x4 b)
+{
+	return a * b;
+}
+
+static inline vf32x4_mask vf32x4_cmpgt(vf32x4 a, vf32x4 b)
+{
+	return spu_cmpgt(a, b);
+}
+
+static inline vf32x4 vf32x4_sel(vf32x4 a, vf32x4 b, vf32x4_mask m)
+{
+	return spu_sel(a, b, m);
+}
+
+static inline vf32x4_mask vf32x4_mask_none(void)
+{
+	return spu_splats(0u);
+}
+
+static inline vf32x4_mask vf32x4_mask_or(vf32x4_mask a, vf32x4_mask b)
+{
+	return a | b;
+}
+
+static inline int vf32x4_mask_all(vf32x4_mask m)
+{
+	return !spu_extract(spu_orx(~m), 0);
+}
+
+static inline unsigned int vf32x4_mask_bits(vf32x4_mask m)
+{
+	return (spu_extract(m, 0) & 1) | (spu_extract(m, 1) & 2) |
+		(spu_extract(m, 2) & 4) | (spu_extract(m, 3) & 8);
+}
+
+static inline vf32x4 vf32x4_load(const float *p)
+{
+	return *(const vf32x4 *)p;
+}
+
+static inline void vf32x4_store(float *p, vf32x4 a)
+{
+	*(vf32x4 *)p = a;
+}
+
+static inline vf32x4 vf32x4_trunc(vf32x4 a)
+{
+	return spu_convtf(spu_convts(a, 0), 0);
+}
+
+static inline vf32x4 vf32x4_gather(const float *base, vf32x4 index)
+{
+	vector unsigned int i = spu_convtu(index, 0);
+
+	return (vf32x4){ base[spu_extract(i, 0)], base[spu_extract(i, 1)],
+		base[spu_extract(i, 2)], base[spu_extract(i, 3)] };
+}
+
+static inline void vf32x4_lookup(uint32_t *dst, const uint32_t *table,
+		vf32x4 index)
+{
+	vector unsigned int i = spu_convtu(index, 0);
+
+	*(vector unsigned int *)dst = (vector unsigned int){
+		table[spu_extract(i, 0)], table[spu_extract(i, 1)],
+		table[spu_extract(i, 2)], table[spu_extract(i, 3)] };
+}
+
+/* vf64x2: SPU */
+
+typedef vector double vf64x2;
+typedef vector unsigned long long vf64x2_mask;
+typedef double vf64x2_scalar;
+#define vf64x2_lanes 2
+#define vf64x2_name "SPU"
+
+static inline vf64x2 vf64x2_splat(double a)
+{
+	return spu_splats(a);
+}
+
+static inline vf64x2 vf64x2_iota(void)
+{
+	return (vf64x2){ 0, 1 };
+}
+
+static inline vf64x2 vf64x2_add(vf64x2 a, vf64x2 b)
+{
+	return a + b;
+}
+
+static inline vf64x2 vf64x2_sub(vf64x2 a, vf64x2 b)
+{
+	return a - b;
+}
+
+static inline vf64x2 vf64x2_mul(vf64x2 a, vf64x2 b)
+{
+	return a * b;
+}
+
+static inline vf64x2_mask vf64x2_cmpgt(vf64x2 a, vf64x2 b)
+{
+	return (vf64x2_mask)spu_cmpgt(a, b);
+}
+
+static inline vf64x2 vf64x2_sel(vf64x2 a, vf64x2 b, vf64x2_mask m)
+{
+	return spu_sel(a, b, m);
+}
+
+static inline vf64x2_mask vf64x2_mask_none(void)
+{
+	return spu_splats(0ull);
+}
+
+static inline vf64x2_mask vf64x2_mask_or(vf64x2_mask a, vf64x2_mask b)
+{
+	return a | b;
+}
+
+static inline unsigned int vf64x2_mask_bits(vf64x2_mask m)
+{
+	return (spu_extract(m, 0) & 1) | (spu_extract(m, 1) & 2);
+}
+
+static inline vf64x2 vf64x2_load(const double *p)
+{
+	return *(const vf64x2 *)p;
+}
+
+static inline void vf64x2_store(double *p, vf64x2 a)
+{
+	*(vf64x2 *)p = a;
+}
+
+static inline vf64x2 vf64x2_gather(const double *base, vf64x2 index)
+{
+	return (vf64x2){ base[(int)spu_extract(index, 0)],
+		base[(int)spu_extract(index, 1)] };
+}
+
+static inline int simd_max_lanes(void)
+{
+	return 4;
+}
+
+#endif /* __SSE2__ */
+
+#endif /* _SIMD_H */
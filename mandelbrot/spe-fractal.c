@@ -21,10 +21,10 @@
 #include <spu_mfcio.h>
 #include <string.h>
 #include <math.h>
+#include <malloc.h>
 
 #include "common.h"
-
-#define CHUNK_SIZE 16384
+#include "simd.h"
 
 #define unlikely(x) (__builtin_expect(!!(x), 0))
 
@@ -41,139 +41,874 @@ static float interpolate(float x, float x_min, float x_max,
 }
 
 /*
- * given a the i and i_max values from a point in our (x,y) coorinates,
- * compute the colour of the pixel at that point.
+ * given a hue from 0 to 1, compute the colour of a pixel.
  *
  * This function does a simplified Hue,Saturation,Value transformation to
- * RGB. We take i/i_max as the Hue, and keep the saturation and value
- * components fixed.
+ * RGB, keeping the saturation and value components fixed.
  */
-void colour_map(struct pixel *pix, vector unsigned int i,
-		unsigned int i_max)
+static void colour_map(struct pixel *pix, float hue)
 {
 	const float saturation = 0.8;
 	const float value = 0.8;
-	float v_min, hue, desc, asc, step;
-	int x;
+	float v_min;
 
-	for (x = 0; x < 4; x++) {
+	v_min = value * (1 - saturation);
 
+	if (hue < 0.25) {
+		pix->r = value * 255;
+		pix->g = interpolate(hue, 0.0, 0.25, v_min, value)
+			* 255;
+		pix->b = v_min * 255;
 
-		hue = spu_extract(spu_convtf(i, 0), x) / (i_max + 1);
-		v_min = value * (1 - saturation);
+	} else if (hue < 0.5) {
+		pix->r = interpolate(hue, 0.25, 0.5, value, v_min)
+			* 255;
+		pix->g = value * 255;
+		pix->b = v_min * 255;
 
-		/* create two linear curves, between value and v_min, of the
-		 * proportion of a colour to include in the rgb output. One
-		 * is ascending over the 60 degrees, the other descending
-		 */
-		step = (float)((int)floor(hue) % 60) / 60.0;
-		asc  = (step * value) + ((1.0 - step) * v_min);
-		desc = (step * v_min) + ((1.0 - step) * value);
+	} else if (hue < 0.75) {
+		pix->r = v_min * 255;
+		pix->g = value * 255;
+		pix->b = interpolate(hue, 0.5, 0.75, v_min, value)
+			* 255;
 
-		if (hue < 0.25) {
-			pix->r = value * 255;
-			pix->g = interpolate(hue, 0.0, 0.25, v_min, value)
-				* 255;
-			pix->b = v_min * 255;
+	} else {
+		pix->r = v_min * 255;
+		pix->g = interpolate(hue, 0.75, 1.0, value, v_min)
+			* 255;
+		pix->b = value * 255;
+	}
+	pix->a = 255;
+}
 
-		} else if (hue < 0.5) {
-			pix->r = interpolate(hue, 0.25, 0.5, value, v_min)
-				* 255;
-			pix->g = value * 255;
-			pix->b = v_min * 255;
+/* The number of colours in the palette for continuous counts */
+#define PALETTE_STEPS	4096
 
-		} else if (hue < 0.75) {
-			pix->r = v_min * 255;
-			pix->g = value * 255;
-			pix->b = interpolate(hue, 0.5, 0.75, v_min, value)
-				* 255;
+/*
+ * One kernel for each vector shape we can build, in float and double, each
+ * with and without |z|^2 at escape. The wider ones need instruction set
+ * extensions, so are compiled for those targets and only chosen if the CPU
+ * has them.
+ */
 
-		} else {
-			pix->r = v_min * 255;
-			pix->g = interpolate(hue, 0.75, 1.0, value, v_min)
-				* 255;
-			pix->b = value * 255;
-		}
-		pix->a = 255;
+/* The reference orbit for deep zooms, in local store */
+struct perturb_ref {
+	const double *re, *im;
+	int len;
 
-		pix++;
+	/* spacing of the pixels */
+	double delta;
+};
+
+/*
+ * Record the exact count and |z|^2 of a point that the KERNEL_ESCAPE_Z
+ * kernels didn't find to be in the set. A point whose count has reached
+ * i_max ran out of iterations, even if it escaped in the overrun of its last
+ * block of 16, so it is recorded as ran out: i_max - 1, with no |z|^2.
+ */
+static inline void record_escape(const struct fractal_params *params,
+		float *count, float *mag, float escaped_i, float escaped_mag)
+{
+	if (escaped_i < params->i_max) {
+		*count = escaped_i;
+		*mag = escaped_mag;
+	} else {
+		*count = params->i_max - 1;
+		*mag = 0.0f;
 	}
+}
+
+#define KERNEL_SHAPE f32x4
+#include "kernel.h"
+#include "colour.h"
+#define KERNEL_ESCAPE_Z
+#include "kernel.h"
+#undef KERNEL_ESCAPE_Z
+#undef KERNEL_SHAPE
+#define KERNEL_SHAPE f64x2
+#include "kernel.h"
+#include "perturb.h"
+#define KERNEL_ESCAPE_Z
+#include "kernel.h"
+#include "perturb.h"
+#undef KERNEL_ESCAPE_Z
+#undef KERNEL_SHAPE
+
+#ifdef SIMD_HAVE_F32X8
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define KERNEL_SHAPE f32x8
+#include "kernel.h"
+#include "colour.h"
+#define KERNEL_ESCAPE_Z
+#include "kernel.h"
+#undef KERNEL_ESCAPE_Z
+#undef KERNEL_SHAPE
+#define KERNEL_SHAPE f64x4
+#include "kernel.h"
+#include "perturb.h"
+#define KERNEL_ESCAPE_Z
+#include "kernel.h"
+#include "perturb.h"
+#undef KERNEL_ESCAPE_Z
+#undef KERNEL_SHAPE
+#pragma GCC pop_options
+#endif
+
+#ifdef SIMD_HAVE_F32X16
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define KERNEL_SHAPE f32x16
+#include "kernel.h"
+#include "colour.h"
+#define KERNEL_ESCAPE_Z
+#include "kernel.h"
+#undef KERNEL_ESCAPE_Z
+#undef KERNEL_SHAPE
+#define KERNEL_SHAPE f64x8
+#include "kernel.h"
+#include "perturb.h"
+#define KERNEL_ESCAPE_Z
+#include "kernel.h"
+#include "perturb.h"
+#undef KERNEL_ESCAPE_Z
+#undef KERNEL_SHAPE
+#pragma GCC pop_options
+#endif
+
+struct kernel_fns {
+	void (*render_fractal)(struct fractal_params *params,
+			int x0, int y0, int w, int h, float *counts,
+			float *mags, struct spe_stats *stats);
+
+	void (*render_points)(struct fractal_params *params,
+			int x0, int y0, const uint16_t *points, int n_points,
+			float *counts, float *mags, struct spe_stats *stats);
+
+	/* the deep zoom kernel, for double shapes only */
+	void (*render_perturb)(struct fractal_params *params,
+			const struct perturb_ref *ref, int x0, int y0,
+			const uint16_t *points, int n_points, float *counts,
+			float *mags, struct spe_stats *stats);
+};
 
+struct kernel {
+	const char *name, *shape;
+	int lanes;
+
+	/* an enum kernel_precision */
+	int precision;
+
+	/* the kernels, and their KERNEL_ESCAPE_Z versions */
+	struct kernel_fns fns, fns_z;
+
+	/* the colour pass, on the float shape of the same width */
+	void (*colour_tile)(const uint32_t *palette, float last_i,
+			const float *counts, struct pixel *pixels, int w, int h);
+	void (*colour_tile_smooth)(const uint32_t *palette,
+			const float *hues, float last_i, const float *counts,
+			struct pixel *pixels, int w, int h);
+};
+
+#define KERNEL_ENTRY(vshape, prec, cshape)				\
+	.name = simd_cat(v, simd_cat(vshape, _name)),			\
+	.shape = #vshape,						\
+	.lanes = simd_cat(v, simd_cat(vshape, _lanes)),			\
+	.precision = prec,						\
+	.fns.render_fractal = simd_cat(render_fractal_, vshape),	\
+	.fns.render_points = simd_cat(render_points_, vshape),		\
+	.fns_z.render_fractal = simd_cat(render_fractal_z_, vshape),	\
+	.fns_z.render_points = simd_cat(render_points_z_, vshape),	\
+	.colour_tile = simd_cat(colour_tile_, cshape),			\
+	.colour_tile_smooth = simd_cat(colour_tile_smooth_, cshape)
+
+#define F32_KERNEL(vshape) {						\
+	KERNEL_ENTRY(vshape, PRECISION_F32, vshape),			\
 }
-/**
- * Render a fractal, given the parameters specified in @params
+
+#define F64_KERNEL(vshape, cshape) {					\
+	KERNEL_ENTRY(vshape, PRECISION_F64, cshape),			\
+	.fns.render_perturb = simd_cat(render_perturb_, vshape),	\
+	.fns_z.render_perturb = simd_cat(render_perturb_z_, vshape),	\
+}
+
+/* narrowest first */
+static const struct kernel kernels[] = {
+	F32_KERNEL(f32x4),
+	F64_KERNEL(f64x2, f32x4),
+#ifdef SIMD_HAVE_F32X8
+	F32_KERNEL(f32x8),
+	F64_KERNEL(f64x4, f32x8),
+#endif
+#ifdef SIMD_HAVE_F32X16
+	F32_KERNEL(f32x16),
+	F64_KERNEL(f64x8, f32x16),
+#endif
+};
+
+/*
+ * Pick the widest kernel of @precision that the CPU supports, and that has
+ * no more than @lanes lanes (if non-zero). A double vector is as wide as a
+ * float one with twice the lanes.
  */
-void render_fractal(struct fractal_params *params,
-		int start_row, int n_rows)
+static const struct kernel *select_kernel(int lanes, int precision)
 {
-	int r, x, y;
+	const struct kernel *kernel = NULL;
+	int max_lanes = simd_max_lanes();
 	unsigned int i;
-	/* complex numbers: c and z */
-	vector float cr, ci, zr, zi;
-	vector float x_min, y_min, tmp;
-	vector float increments;
-	vector unsigned int escaped;
-	vector unsigned int escaped_i;
-	/* we can't pass commas to a macro, so use a const var instead */
-	const vector float limit = {4.0f, 4.0f, 4.0f, 4.0f};
-
-	increments = spu_splats(params->delta) *
-		(vector float){0.0f, 1.0f, 2.0f, 3.0f};
-
-	x_min = spu_splats(params->x - (params->delta * params->cols / 2)) +
-		increments;
-	y_min = spu_splats(params->y - (params->delta * params->rows / 2));
-
-	for (r = 0; r < params->rows && r < n_rows; r++) {
-		y = r + start_row;
-		ci = y_min + spu_splats((float)(y * params->delta));
-
-		for (x = 0; x < params->cols; x += 4) {
-			escaped_i = (vector unsigned int){0, 0, 0, 0};
-			cr = x_min + spu_splats(params->delta * x);
-
-			zr = (vector float){0, 0, 0, 0};
-			zi = (vector float){0, 0, 0, 0};
-
-			for (i = 0; i < params->i_max; i+=16)  {
-
-#define ITERATE()		/* z = z^2 + c */				\
-				tmp = zr*zr - zi*zi + cr;			\
-				zi =  (vector float){2.0f, 2.0f, 2.0f, 2.0f}	\
-					* zr * zi + ci;				\
-				zr = tmp;					\
-										\
-				/* escaped = abs(z) > 2.0 */			\
-				escaped = spu_cmpgt(zr * zr + zi * zi, limit);	\
-										\
-				/* escaped_i = escaped ? escaped_i : i */	\
-				escaped_i = spu_sel(spu_splats(i), escaped_i,	\
-						escaped)			\
-									
-				ITERATE(); ITERATE(); ITERATE(); ITERATE();
-				ITERATE(); ITERATE(); ITERATE(); ITERATE();
-				ITERATE(); ITERATE(); ITERATE(); ITERATE();
-				ITERATE(); ITERATE(); ITERATE(); ITERATE();
-
-				/* if all four words in escaped are non-zero,
-				 * we're done */
-				if (!spu_extract(spu_orx(~escaped), 0))
-					break;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (kernels[i].precision != precision)
+			continue;
+
+		if (kernel && ((lanes && kernels[i].lanes > lanes) ||
+				kernels[i].lanes *
+					(precision == PRECISION_F64 ? 2 : 1)
+					> max_lanes))
+			break;
+
+		kernel = &kernels[i];
+	}
+
+	return kernel;
+}
+
+/*
+ * Our local buffers to DMA out to the PPE: one is rendered into while the
+ * other is being transferred. These need to be aligned to a SPE_ALIGN-byte
+ * boundary
+ */
+struct pixel buf[2][TILE_W * TILE_H] __attribute__((aligned(SPE_ALIGN)));
+
+/* Our statistics, DMAed out to args.stats when we're done */
+static struct spe_stats stats __attribute__((aligned(16)));
+
+/* Local copy of a tile queue's lock line */
+static struct tile_queue queue_line __attribute__((aligned(128)));
+
+/*
+ * Take the tile at the front of the queue at @queue_ea, returning -1 if the
+ * queue is empty
+ */
+static int tile_queue_pop(uint64_t queue_ea)
+{
+	int tile;
+
+	do {
+		mfc_getllar(&queue_line, queue_ea, 0, 0);
+		mfc_read_atomic_status();
+
+		if (queue_line.begin >= queue_line.end)
+			return -1;
+
+		tile = queue_line.begin++;
+
+		mfc_putllc(&queue_line, queue_ea, 0, 0);
+	} while (mfc_read_atomic_status() & MFC_PUTLLC_STATUS);
+
+	return tile;
+}
+
+/*
+ * Move the back half of the tiles in the queue at @victim_ea to our own
+ * (empty) queue at @queue_ea. Returns the number of tiles stolen.
+ */
+static int tile_queue_steal(uint64_t queue_ea, uint64_t victim_ea)
+{
+	uint32_t begin, end;
+
+	do {
+		mfc_getllar(&queue_line, victim_ea, 0, 0);
+		mfc_read_atomic_status();
+
+		if (queue_line.begin >= queue_line.end)
+			return 0;
+
+		end = queue_line.end;
+		begin = queue_line.begin +
+			(queue_line.end - queue_line.begin) / 2;
+		queue_line.end = begin;
+
+		mfc_putllc(&queue_line, victim_ea, 0, 0);
+	} while (mfc_read_atomic_status() & MFC_PUTLLC_STATUS);
+
+	/* Nobody else adds to an empty queue, so this needn't be
+	 * conditional */
+	queue_line.begin = begin;
+	queue_line.end = end;
+	mfc_putlluc(&queue_line, queue_ea, 0, 0);
+	mfc_read_atomic_status();
+
+	return end - begin;
+}
+
+/*
+ * Find the next tile to render: from our own queue if possible, otherwise
+ * from whichever other thread we can steal from. Returns -1 once every
+ * queue is empty.
+ */
+static int next_tile(struct spe_args *args, uint32_t *steals)
+{
+	uint64_t queues_ea = (uint64_t)(unsigned long)args->queues;
+	uint64_t own_ea = queues_ea +
+		args->thread_idx * sizeof(struct tile_queue);
+	int tile, i, victim;
+
+	for (;;) {
+		tile = tile_queue_pop(own_ea);
+		if (tile >= 0)
+			return tile;
+
+		for (i = 1; i < args->n_threads; i++) {
+			victim = (args->thread_idx + i) % args->n_threads;
+			if (tile_queue_steal(own_ea, queues_ea +
+					victim * sizeof(struct tile_queue)))
+				break;
+		}
+
+		if (i == args->n_threads)
+			return -1;
+
+		(*steals)++;
+	}
+}
+
+/* Escape counts for the tile being rendered, in rows of TILE_W, and |z|^2
+ * as each point escaped if that's wanted */
+static float counts[TILE_W * TILE_H] __attribute__((aligned(64)));
+static float mags[TILE_W * TILE_H] __attribute__((aligned(64)));
+
+/* Buffers for DMAing |z|^2 out, as for buf */
+static float mag_buf[2][TILE_W * TILE_H] __attribute__((aligned(SPE_ALIGN)));
+
+/* Pixels of the tile waiting to be passed to render_points() */
+static uint16_t points[TILE_W * TILE_H];
+static int n_points;
+
+static void add_row(int x, int y, int n)
+{
+	while (n--)
+		points[n_points++] = y * TILE_W + x++;
+}
+
+static void add_column(int x, int y, int n)
+{
+	while (n--)
+		points[n_points++] = y++ * TILE_W + x;
+}
+
+/* The deep zoom reference orbit, if there is one */
+static struct perturb_ref ref;
+
+/* The colour of each escape count, 0 to last_count(), as struct pixels; or
+ * for continuous counts, PALETTE_STEPS colours of hues from 0 to 1 */
+static uint32_t *palette;
+
+/* For continuous counts, the hue of each escape count, 0 to last_count() + 1 */
+static float *hues;
+
+/* This thread's histogram bins, for equalisation */
+static uint32_t *bins;
+
+/*
+ * Free whatever the last run allocated. The PPE runs a context again and
+ * again without reloading the program, so nothing can be left behind.
+ */
+static void free_buffers(void)
+{
+	free((void *)ref.re);
+	free((void *)ref.im);
+	free(palette);
+	free(hues);
+	free(bins);
+	memset(&ref, 0, sizeof(ref));
+	palette = NULL;
+	hues = NULL;
+	bins = NULL;
+}
+
+static void render_pending(const struct kernel_fns *kernel,
+		struct fractal_params *params, int x0, int y0)
+{
+	if (ref.len)
+		kernel->render_perturb(params, &ref, x0, y0, points, n_points,
+				counts, mags, &stats);
+	else
+		kernel->render_points(params, x0, y0, points, n_points,
+				counts, mags, &stats);
+	n_points = 0;
+}
+
+/*
+ * Mariani-Silver subdivision. The escape counts of each rectangle's border
+ * are known; if they're all in the set, so is everything inside. Otherwise
+ * the rectangle is split across its longer side, and the two halves (which
+ * share the dividing line) are looked at in turn. Rectangles with less than
+ * SUBDIVIDE_MIN_AREA pixels inside are just rendered.
+ *
+ * The rectangles are handled a generation at a time, so that the points of
+ * every dividing line in the generation go to the kernel together and
+ * fill its lanes.
+ */
+#define SUBDIVIDE_MIN_AREA	64
+#define SUBDIVIDE_MAX_RECTS	(2 * TILE_W * TILE_H / SUBDIVIDE_MIN_AREA)
+
+struct rect {
+	uint8_t x, y, w, h;
+};
+
+static struct rect rects[2][SUBDIVIDE_MAX_RECTS];
+
+static int border_uniform(const struct rect *rect)
+{
+	const float *row0 = &counts[rect->y * TILE_W + rect->x];
+	const float *row1 = &counts[(rect->y + rect->h - 1) * TILE_W + rect->x];
+	float count = row0[0];
+	int i;
+
+	for (i = 0; i < rect->w; i++)
+		if (row0[i] != count || row1[i] != count)
+			return 0;
+
+	for (i = 1; i < rect->h - 1; i++)
+		if (row0[i * TILE_W] != count ||
+				row0[i * TILE_W + rect->w - 1] != count)
+			return 0;
+
+	return 1;
+}
+
+static void render_tile_subdivide(const struct kernel_fns *kernel,
+		struct fractal_params *params, int x0, int y0, int w, int h)
+{
+	struct rect *rect, *cur, *next;
+	int n_cur, n_next, i, r, x, m;
+	float count;
+
+	/* the tile's own border */
+	add_row(0, 0, w);
+	if (h > 1)
+		add_row(0, h - 1, w);
+	if (h > 2) {
+		add_column(0, 1, h - 2);
+		if (w > 1)
+			add_column(w - 1, 1, h - 2);
+	}
+	render_pending(kernel, params, x0, y0);
+
+	cur = rects[0];
+	next = rects[1];
+	cur[0] = (struct rect){ 0, 0, w, h };
+	n_cur = 1;
+
+	while (n_cur) {
+		n_next = 0;
+
+		for (i = 0; i < n_cur; i++) {
+			rect = &cur[i];
+
+			/* nothing inside the border */
+			if (rect->w <= 2 || rect->h <= 2)
+				continue;
+
+			/* Only fill in points known to be in the set. Escape
+			 * count bands, and points that merely ran out of
+			 * iterations, can hide features between the border's
+			 * pixels that the full render would find */
+			count = counts[rect->y * TILE_W + rect->x];
+			if (count == params->i_max && border_uniform(rect)) {
+				for (r = rect->y + 1; r < rect->y + rect->h - 1; r++)
+					for (x = rect->x + 1;
+						x < rect->x + rect->w - 1; x++) {
+						counts[r * TILE_W + x] = count;
+						mags[r * TILE_W + x] = 0.0f;
+					}
+				stats.filled += (rect->w - 2) * (rect->h - 2);
+				continue;
 			}
 
-			colour_map(&params->imgbuf[r * params->cols + x],
-					escaped_i, params->i_max);
+			if ((rect->w - 2) * (rect->h - 2) < SUBDIVIDE_MIN_AREA) {
+				for (r = rect->y + 1; r < rect->y + rect->h - 1; r++)
+					add_row(rect->x + 1, r, rect->w - 2);
+				continue;
+			}
+
+			if (rect->w >= rect->h) {
+				m = rect->w / 2;
+				add_column(rect->x + m, rect->y + 1, rect->h - 2);
+				next[n_next++] = (struct rect){ rect->x, rect->y,
+					m + 1, rect->h };
+				next[n_next++] = (struct rect){ rect->x + m,
+					rect->y, rect->w - m, rect->h };
+			} else {
+				m = rect->h / 2;
+				add_row(rect->x + 1, rect->y + m, rect->w - 2);
+				next[n_next++] = (struct rect){ rect->x, rect->y,
+					rect->w, m + 1 };
+				next[n_next++] = (struct rect){ rect->x,
+					rect->y + m, rect->w, rect->h - m };
+			}
+		}
+
+		render_pending(kernel, params, x0, y0);
+
+		rect = cur;
+		cur = next;
+		next = rect;
+		n_cur = n_next;
+	}
+}
+
+/*
+ * Find the escape counts of the @w x @h pixel tile at (@x0, @y0), into
+ * counts (and mags).
+ */
+static void render_tile(const struct kernel_fns *kernel, int mode,
+		struct fractal_params *params, int x0, int y0, int w, int h)
+{
+	int r;
+
+	switch (mode) {
+	case RENDER_BLOCK:
+		/* there's no block version of the deep zoom kernel */
+		if (!ref.len) {
+			kernel->render_fractal(params, x0, y0, w, h, counts,
+					mags, &stats);
+			break;
+		}
+		/* fall through */
+	case RENDER_REFILL:
+		for (r = 0; r < h; r++)
+			add_row(0, r, w);
+		render_pending(kernel, params, x0, y0);
+		break;
+	case RENDER_SUBDIVIDE:
+		render_tile_subdivide(kernel, params, x0, y0, w, h);
+		break;
+	}
+}
+
+/*
+ * Colour counts into @pixels. Points known to be in the set are coloured as
+ * those that ran out of iterations are.
+ */
+static void colour_tile(const struct kernel *kernel,
+		struct fractal_params *params, struct pixel *pixels,
+		int w, int h)
+{
+	if (hues)
+		kernel->colour_tile_smooth(palette, hues,
+				last_count(params), counts, pixels, w, h);
+	else
+		kernel->colour_tile(palette, last_count(params),
+				counts, pixels, w, h);
+}
+
+/*
+ * Turn exact counts into continuous ones, n + 1 - log2(log2 |z|), using
+ * |z|^2 from mags. Points that didn't escape keep their counts.
+ */
+static void smooth_counts(int w, int h)
+{
+	int r, x, i;
+
+	for (r = 0; r < h; r++) {
+		for (x = 0; x < w; x++) {
+			i = r * TILE_W + x;
+			if (mags[i] > 4.0f)
+				counts[i] = fmaxf(counts[i] + 1.0f -
+					log2f(0.5f * log2f(mags[i])), 0.0f);
+		}
+	}
+}
 
+/* Add the tile's counts to bins, with those above @last in the last bin */
+static void bin_counts(int last, int w, int h)
+{
+	int r, x;
+	float count;
+
+	for (r = 0; r < h; r++) {
+		for (x = 0; x < w; x++) {
+			count = counts[r * TILE_W + x];
+			bins[count < last ? (int)count : last]++;
 		}
 	}
 }
 
 /*
- * Our local buffer to DMA out to the PPE. This needs to be aligned to
- * a SPE_ALIGN-byte boundary
+ * Start DMAs of the @w x @h tile at @ls, in rows of TILE_W elements of @size
+ * bytes, to (@x, @y) of the image at @ea, which has @cols elements a row
+ */
+static void put_tile(void *ls, uint64_t ea, int cols, int size,
+		int x, int y, int w, int h, int tag)
+{
+	int r;
+
+	for (r = 0; r < h; r++)
+		mfc_put((char *)ls + r * TILE_W * size, ea +
+				((uint64_t)(y + r) * cols + x) * size,
+				w * size, tag, 0, 0);
+}
+
+/* As put_tile(), but from the image into local store */
+static void get_tile(void *ls, uint64_t ea, int cols, int size,
+		int x, int y, int w, int h, int tag)
+{
+	int r;
+
+	for (r = 0; r < h; r++)
+		mfc_get((char *)ls + r * TILE_W * size, ea +
+				((uint64_t)(y + r) * cols + x) * size,
+				w * size, tag, 0, 0);
+}
+
+/* Pack counts into @raw, as @bytes-byte integers */
+static void pack_counts(void *raw, int bytes, int w, int h)
+{
+	int r, x, i;
+
+	for (r = 0; r < h; r++) {
+		for (x = 0; x < w; x++) {
+			i = r * TILE_W + x;
+			if (bytes == 2)
+				((uint16_t *)raw)[i] = counts[i];
+			else
+				((uint32_t *)raw)[i] = counts[i];
+		}
+	}
+}
+
+/* The reverse of pack_counts() */
+static void unpack_counts(const void *raw, int bytes, int w, int h)
+{
+	int r, x, i;
+
+	for (r = 0; r < h; r++) {
+		for (x = 0; x < w; x++) {
+			i = r * TILE_W + x;
+			counts[i] = bytes == 2 ? ((const uint16_t *)raw)[i] :
+				((const uint32_t *)raw)[i];
+		}
+	}
+}
+
+/*
+ * DMA @size bytes from @ea into local store, a 16kB transfer at a time, and
+ * wait for them to arrive
+ */
+static void get_array(void *ls, uint64_t ea, uint32_t size)
+{
+	uint32_t offset, chunk;
+
+	for (offset = 0; offset < size; offset += chunk) {
+		chunk = size - offset < 16384 ? size - offset : 16384;
+		mfc_get((char *)ls + offset, ea + offset, chunk, 0, 0, 0);
+	}
+	mfc_write_tag_mask(1 << 0);
+	mfc_read_tag_status_all();
+}
+
+/* As get_array(), but from local store out to @ea */
+static void put_array(const void *ls, uint64_t ea, uint32_t size)
+{
+	uint32_t offset, chunk;
+
+	for (offset = 0; offset < size; offset += chunk) {
+		chunk = size - offset < 16384 ? size - offset : 16384;
+		mfc_put((char *)ls + offset, ea + offset, chunk, 0, 0, 0);
+	}
+	mfc_write_tag_mask(1 << 0);
+	mfc_read_tag_status_all();
+}
+
+/*
+ * PASS_SCAN: add up this thread's run of bins across every thread's row of
+ * the histogram, and replace the first row's run with its running total. A
+ * run's total is then its last entry, so whoever reads the row can carry
+ * each run's total into the next. Returns 0 on success.
  */
-struct pixel buf[CHUNK_SIZE / sizeof(struct pixel)]
-	__attribute__((aligned(SPE_ALIGN)));
+static int scan_hist(struct spe_args *args)
+{
+	uint64_t hist_ea = (uint64_t)(unsigned long)args->hist;
+	int chunk, first, t, i;
+	uint32_t *sum, *row;
+
+	chunk = hist_chunk(&args->fractal, args->n_threads);
+	first = args->thread_idx * chunk;
+	if (first > last_count(&args->fractal))
+		return 0;
+
+	sum = memalign(SPE_ALIGN, chunk * sizeof(*sum));
+	row = memalign(SPE_ALIGN, chunk * sizeof(*row));
+	if (!sum || !row)
+		return -1;
+
+	memset(sum, 0, chunk * sizeof(*sum));
+	for (t = 0; t < args->n_threads; t++) {
+		get_array(row, hist_ea + ((uint64_t)t * args->n_threads *
+				chunk + first) * sizeof(*row),
+				chunk * sizeof(*row));
+		for (i = 0; i < chunk; i++)
+			sum[i] += row[i];
+	}
+
+	for (i = 1; i < chunk; i++)
+		sum[i] += sum[i - 1];
+
+	put_array(sum, hist_ea + first * sizeof(*sum), chunk * sizeof(*sum));
+
+	free(row);
+	free(sum);
+	return 0;
+}
+
+/*
+ * Histogram equalisation: give each count, up to last, the share of the
+ * escaped points that have a lower count as its hue, from the running totals
+ * left in hist by PASS_SCAN. Every colour then covers about as many pixels.
+ * Returns 0 on success.
+ */
+static int equalise_hues(struct spe_args *args, int last)
+{
+	int chunk, size, i;
+	uint32_t *total, base;
+
+	chunk = hist_chunk(&args->fractal, args->n_threads);
+	size = args->n_threads * chunk * sizeof(*total);
+
+	total = memalign(SPE_ALIGN, size);
+	if (!total)
+		return -1;
+	get_array(total, (uint64_t)(unsigned long)args->hist, size);
+
+	/* carry each run's total into the next */
+	base = 0;
+	for (i = 0; i <= last; i++) {
+		if (i % chunk == 0)
+			base = i ? total[i - 1] : 0;
+		total[i] += base;
+	}
+
+	for (i = 0; i <= last; i++)
+		hues[i] = !last || !total[last - 1] ?
+			(float)i / (args->fractal.i_max + 1) :
+			(float)((double)(i ? total[i - 1] : 0) /
+				total[last - 1]);
+
+	free(total);
+	return 0;
+}
+
+/*
+ * Build the palette for @args, and the hues of the counts, which are kept
+ * for smooth colouring. Returns 0 on success.
+ */
+static int build_palette(struct spe_args *args)
+{
+	struct pixel pix;
+	int last, n_colours, i;
+
+	last = last_count(&args->fractal);
+	hues = memalign(SPE_ALIGN, (last + 2) * sizeof(*hues));
+	if (!hues)
+		return -1;
+
+	if (args->hist) {
+		if (equalise_hues(args, last))
+			return -1;
+	} else {
+		for (i = 0; i <= last; i++)
+			hues[i] = (float)i / (args->fractal.i_max + 1);
+	}
+	hues[last + 1] = hues[last];
+
+	n_colours = args->smooth ? PALETTE_STEPS : last + 1;
+	palette = memalign(SPE_ALIGN, n_colours * sizeof(*palette));
+	if (!palette)
+		return -1;
+
+	for (i = 0; i < n_colours; i++) {
+		colour_map(&pix, args->smooth ?
+				(float)i / (PALETTE_STEPS - 1) : hues[i]);
+		memcpy(&palette[i], &pix, sizeof(pix));
+	}
+
+	if (!args->smooth) {
+		free(hues);
+		hues = NULL;
+	}
+
+	return 0;
+}
+
+/* For a batch, the job in args.fractal and args.precision */
+static int current_job;
+
+/* Bring job @job of a batch into @args */
+static void load_job(struct spe_args *args, int job)
+{
+	struct spe_job spe_job __attribute__((aligned(16)));
+
+	get_array(&spe_job, (uint64_t)(unsigned long)(args->jobs + job),
+			sizeof(spe_job));
+	args->fractal = spe_job.fractal;
+	args->precision = spe_job.precision;
+	current_job = job;
+}
+
+/*
+ * For a batch: make @tile the number of a tile of its job, and bring that
+ * job into @args, with its palette if it's colouring. Returns 1 if the job
+ * has no such tile, as the smaller jobs' tiles run out first, or -1 if
+ * there's no room for the palette.
+ */
+static int job_tile(struct spe_args *args, int *tile, int colouring)
+{
+	int job = *tile % args->n_jobs, i_max = args->fractal.i_max;
+
+	if (job != current_job) {
+		load_job(args, job);
+
+		if (colouring && args->fractal.i_max != i_max) {
+			free(palette);
+			free(hues);
+			palette = NULL;
+			hues = NULL;
+			if (build_palette(args))
+				return -1;
+		}
+	}
+
+	*tile /= args->n_jobs;
+	return *tile < n_tiles(&args->fractal) ? 0 : 1;
+}
+
+/*
+ * DMA the reference orbit into local store. Returns 0 on success.
+ */
+static int load_ref_orbit(struct spe_args *args)
+{
+	uint32_t size;
+	double *re, *im;
+
+	/* the PPE rounds the orbit up to a whole number of vectors */
+	size = ((args->ref_len + 1) & ~1) * sizeof(double);
+
+	re = memalign(SPE_ALIGN, size);
+	im = memalign(SPE_ALIGN, size);
+	if (!re || !im)
+		return -1;
+
+	get_array(re, (uint64_t)(unsigned long)args->ref_re, size);
+	get_array(im, (uint64_t)(unsigned long)args->ref_im, size);
+
+	ref.re = re;
+	ref.im = im;
+	ref.len = args->ref_len;
+	ref.delta = args->fractal.delta;
+	return 0;
+}
 
 /*
  * The argv argument will be populated with the address that the PPE provided,
@@ -182,8 +917,17 @@ struct pixel buf[CHUNK_SIZE / sizeof(struct pixel)]
 int main(uint64_t speid, uint64_t argv, uint64_t envp)
 {
 	struct spe_args args __attribute__((aligned(SPE_ALIGN)));
-	int row, bytes_per_row, rows_per_dma, rows_per_spe;
-	uint64_t ppe_buf;
+	int tile, x, y, w, h, r, b, cols, colouring, hist_row;
+	/* the tile whose pixels are on their way out of each buffer */
+	int sent[2] = { -1, -1 };
+	uint64_t img_ea, counts_ea, mags_ea;
+	const struct kernel *kernel;
+	const struct kernel_fns *fns;
+	static const char *mode_names[] = {
+		[RENDER_BLOCK] = "",
+		[RENDER_REFILL] = ", with lane refill",
+		[RENDER_SUBDIVIDE] = ", with subdivision",
+	};
 
 	/* DMA the spe_args struct into the SPE. The mfc_get function
 	 * takes the following arguments, in order:
@@ -202,30 +946,169 @@ int main(uint64_t speid, uint64_t argv, uint64_t envp)
 	mfc_write_tag_mask(1 << 0);
 	mfc_read_tag_status_all();
 
-	/* initialise our local buffer */
-	ppe_buf = (uint64_t)(unsigned long)args.fractal.imgbuf;
-	args.fractal.imgbuf = buf;
+	/* in case the last run gave up part way through */
+	free_buffers();
 
-	rows_per_spe = args.fractal.rows / args.n_threads;
-	bytes_per_row = sizeof(*buf) * args.fractal.cols;
-	rows_per_dma = sizeof(buf) / bytes_per_row;
+	/* a batch's palette is made for the first job, and again for any
+	 * job with a different i_max; and its kernel is chosen likewise */
+	if (args.jobs)
+		load_job(&args, 0);
 
-	for (row = rows_per_dma * args.thread_idx;
-			row < args.fractal.rows;
-			row += rows_per_dma * args.n_threads) {
+	if (args.pass == PASS_SCAN) {
+		if (scan_hist(&args)) {
+			fprintf(stderr, "SPE %d: no room for the histogram\n",
+					args.thread_idx);
+			return 1;
+		}
+		return 0;
+	}
 
-		render_fractal(&args.fractal, row,
-				rows_per_dma);
+	/* the colour pass is in float whatever the kernel */
+	kernel = select_kernel(args.simd_lanes,
+			args.pass != PASS_RENDER ? PRECISION_F32 :
+			args.ref_len ? PRECISION_F64 : args.precision);
+	fns = args.mags ? &kernel->fns_z : &kernel->fns;
+	if (args.thread_idx == 0 && args.pass == PASS_RENDER && !args.quiet)
+		printf("Using %s %s %s kernel%s%s\n", kernel->name,
+				kernel->shape,
+				args.ref_len ? "perturbation" : "escape-time",
+				mode_names[args.mode],
+				args.mags ? ", recording |z|^2" : "");
+
+	colouring = args.pass == PASS_COLOUR ||
+		(args.pass == PASS_RENDER && !args.counts);
+	if (colouring && build_palette(&args)) {
+		fprintf(stderr, "SPE %d: no room for the palette\n",
+				args.thread_idx);
+		return 1;
+	}
 
-		mfc_put(buf, ppe_buf + row * bytes_per_row,
-				bytes_per_row * rows_per_dma,
-				0, 0, 0);
+	/* the rendering or binning thread's row of the histogram */
+	hist_row = args.n_threads * hist_chunk(&args.fractal, args.n_threads);
+	if (args.hist && !colouring) {
+		bins = memalign(SPE_ALIGN, hist_row * sizeof(*bins));
+		if (!bins) {
+			fprintf(stderr, "SPE %d: no room for the histogram\n",
+					args.thread_idx);
+			return 1;
+		}
+		memset(bins, 0, hist_row * sizeof(*bins));
+	}
+
+	if (args.ref_len && args.pass == PASS_RENDER && load_ref_orbit(&args)) {
+		fprintf(stderr, "SPE %d: no room for the reference orbit\n",
+				args.thread_idx);
+		return 1;
+	}
 
-		/* Wait for the DMA to complete */
-		mfc_write_tag_mask(1 << 0);
+	counts_ea = (uint64_t)(unsigned long)args.counts;
+	mags_ea = (uint64_t)(unsigned long)args.mags;
+
+	b = 0;
+	memset(&stats, 0, sizeof(stats));
+
+	while ((tile = next_tile(&args, &stats.steals)) >= 0) {
+		/* a batch's tiles are of many jobs, each with its own
+		 * view, palette and kernel */
+		if (args.jobs && (r = job_tile(&args, &tile, colouring))) {
+			if (r > 0)
+				continue;
+			fprintf(stderr, "SPE %d: no room for the palette\n",
+					args.thread_idx);
+			return 1;
+		}
+
+		if (args.jobs && kernel->precision != args.precision) {
+			kernel = select_kernel(args.simd_lanes,
+					args.precision);
+			fns = &kernel->fns;
+		}
+
+		img_ea = (uint64_t)(unsigned long)args.fractal.imgbuf;
+		cols = args.fractal.cols;
+		x = (tile % tiles_across(&args.fractal)) * TILE_W;
+		y = (tile / tiles_across(&args.fractal)) * TILE_H;
+		w = args.fractal.cols - x < TILE_W ?
+			args.fractal.cols - x : TILE_W;
+		h = args.fractal.rows - y < TILE_H ?
+			args.fractal.rows - y : TILE_H;
+
+		/* Wait for the last DMA out of this buffer to complete. We
+		 * use the buffer index as the tag */
+		mfc_write_tag_mask(1 << b);
 		mfc_read_tag_status_all();
+
+		if (sent[b] >= 0) {
+			spu_write_out_intr_mbox(sent[b]);
+			sent[b] = -1;
+		}
+
+		if (args.pass == PASS_RENDER) {
+			render_tile(fns, args.mode, &args.fractal, x, y, w, h);
+
+		} else {
+			/* the counts come in through the pixel buffer,
+			 * which is big enough for them */
+			get_tile(buf[b], counts_ea, cols, args.count_bytes,
+					x, y, w, h, b);
+			if (args.smooth && colouring)
+				get_tile(mags, mags_ea, cols, sizeof(float),
+						x, y, w, h, b);
+			mfc_read_tag_status_all();
+			unpack_counts(buf[b], args.count_bytes, w, h);
+
+			if (args.smooth && colouring)
+				smooth_counts(w, h);
+		}
+
+		/* bin the tile while it's to hand, rather than going over
+		 * the image again */
+		if (bins)
+			bin_counts(last_count(&args.fractal), w, h);
+
+		if (colouring) {
+			colour_tile(kernel, &args.fractal, buf[b], w, h);
+			put_tile(buf[b], img_ea, cols, sizeof(struct pixel),
+					x, y, w, h, b);
+			if (args.notify_tiles)
+				sent[b] = tile;
+
+		} else if (args.pass == PASS_RENDER) {
+			pack_counts(buf[b], args.count_bytes, w, h);
+			put_tile(buf[b], counts_ea, cols, args.count_bytes,
+					x, y, w, h, b);
+
+			if (args.mags) {
+				for (r = 0; r < h; r++)
+					memcpy(&mag_buf[b][r * TILE_W],
+						&mags[r * TILE_W],
+						w * sizeof(float));
+				put_tile(mag_buf[b], mags_ea, cols,
+						sizeof(float), x, y, w, h, b);
+			}
+		}
+
+		b ^= 1;
+		stats.tiles++;
 	}
 
+	if (bins)
+		put_array(bins, (uint64_t)(unsigned long)(args.hist +
+				(uint64_t)args.thread_idx * hist_row),
+				hist_row * sizeof(*bins));
+
+	if (args.pass == PASS_RENDER)
+		mfc_put(&stats, (uint64_t)(unsigned long)
+				(args.stats + args.thread_idx),
+				sizeof(stats), 0, 0, 0);
+
+	mfc_write_tag_mask((1 << 0) | (1 << 1));
+	mfc_read_tag_status_all();
+
+	for (b = 0; b < 2; b++)
+		if (sent[b] >= 0)
+			spu_write_out_intr_mbox(sent[b]);
 
+	free_buffers();
 	return 0;
 }
@@ -0,0 +1,234 @@
+/**
+ * YUV4MPEG2 output, for piping a zoom's frames to a video encoder.
+ *
+ * The colour conversion is done on vectors of four pixels at a time, with
+ * GCC's generic vector types, which come out as SSE on x86 and AltiVec on
+ * the PPE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "y4m.h"
+
+typedef int32_t v4i32 __attribute__((vector_size(16)));
+typedef uint8_t v4u8 __attribute__((vector_size(4)));
+
+/* where each channel is in a pixel loaded as a 32-bit word */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SHIFT(channel)	(8 * offsetof(struct pixel, channel))
+#else
+#define SHIFT(channel)	(24 - 8 * offsetof(struct pixel, channel))
+#endif
+
+/* stdout, as it was before y4m_take_stdout(); or -1 */
+static int stdout_fd = -1;
+
+struct y4m_stream {
+	FILE *fp;
+	int cols, rows;
+
+	/* a frame's planes: Y, then Cb, then Cr */
+	uint8_t *planes;
+};
+
+/*
+ * BT.601 studio range, in 8.8 fixed point. The chroma is of the average of
+ * each 2x2 block of pixels.
+ */
+#define Y(r, g, b)	(((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define CB(r, g, b)	(((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define CR(r, g, b)	(((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+static inline int channel(const struct pixel *p, int c)
+{
+	return c == 0 ? p->r : c == 1 ? p->g : p->b;
+}
+
+/* The 2x2 block of pixels at @p, in rows of @cols, as Y, Cb and Cr */
+static void convert_block(const struct pixel *p, int cols, uint8_t *y0,
+		uint8_t *y1, uint8_t *cb, uint8_t *cr)
+{
+	const struct pixel *q = p + cols;
+	int sum[3], c;
+
+	y0[0] = Y(p[0].r, p[0].g, p[0].b);
+	y0[1] = Y(p[1].r, p[1].g, p[1].b);
+	y1[0] = Y(q[0].r, q[0].g, q[0].b);
+	y1[1] = Y(q[1].r, q[1].g, q[1].b);
+
+	for (c = 0; c < 3; c++)
+		sum[c] = (channel(&p[0], c) + channel(&p[1], c) +
+				channel(&q[0], c) + channel(&q[1], c) + 2) >> 2;
+
+	*cb = CB(sum[0], sum[1], sum[2]);
+	*cr = CR(sum[0], sum[1], sum[2]);
+}
+
+static inline v4i32 load4(const struct pixel *p)
+{
+	v4i32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store4(uint8_t *p, v4i32 v)
+{
+	v4u8 b = __builtin_convertvector(v, v4u8);
+
+	memcpy(p, &b, sizeof(b));
+}
+
+static inline v4i32 luma(v4i32 px)
+{
+	v4i32 r = (px >> SHIFT(r)) & 0xff;
+	v4i32 g = (px >> SHIFT(g)) & 0xff;
+	v4i32 b = (px >> SHIFT(b)) & 0xff;
+
+	return Y(r, g, b);
+}
+
+/* The sum of each horizontal pair of @lo and @hi's four lanes each */
+static inline v4i32 pairs(v4i32 lo, v4i32 hi)
+{
+	const v4i32 even = { 0, 2, 4, 6 };
+	const v4i32 odd = { 1, 3, 5, 7 };
+
+	return __builtin_shuffle(lo, hi, even) + __builtin_shuffle(lo, hi, odd);
+}
+
+/* Two rows of @cols pixels at @p into two rows of Y and a row of chroma */
+static void convert_rows(const struct pixel *p, int cols, uint8_t *y0,
+		uint8_t *y1, uint8_t *cb, uint8_t *cr)
+{
+	v4i32 a0, a1, b0, b1, r, g, b;
+	int x;
+
+	/* eight pixels across at a time, making four of chroma */
+	for (x = 0; x + 8 <= cols; x += 8) {
+		a0 = load4(p + x);
+		a1 = load4(p + x + 4);
+		b0 = load4(p + cols + x);
+		b1 = load4(p + cols + x + 4);
+
+		store4(y0 + x, luma(a0));
+		store4(y0 + x + 4, luma(a1));
+		store4(y1 + x, luma(b0));
+		store4(y1 + x + 4, luma(b1));
+
+		r = (pairs((a0 >> SHIFT(r)) & 0xff, (a1 >> SHIFT(r)) & 0xff) +
+			pairs((b0 >> SHIFT(r)) & 0xff,
+				(b1 >> SHIFT(r)) & 0xff) + 2) >> 2;
+		g = (pairs((a0 >> SHIFT(g)) & 0xff, (a1 >> SHIFT(g)) & 0xff) +
+			pairs((b0 >> SHIFT(g)) & 0xff,
+				(b1 >> SHIFT(g)) & 0xff) + 2) >> 2;
+		b = (pairs((a0 >> SHIFT(b)) & 0xff, (a1 >> SHIFT(b)) & 0xff) +
+			pairs((b0 >> SHIFT(b)) & 0xff,
+				(b1 >> SHIFT(b)) & 0xff) + 2) >> 2;
+
+		store4(cb + x / 2, CB(r, g, b));
+		store4(cr + x / 2, CR(r, g, b));
+	}
+
+	for (; x < cols; x += 2)
+		convert_block(p + x, cols, y0 + x, y1 + x, cb + x / 2,
+				cr + x / 2);
+}
+
+struct y4m_stream *y4m_open(const char *filename, int cols, int rows,
+		int fps)
+{
+	struct y4m_stream *stream;
+
+	if ((cols | rows) & 1) {
+		fprintf(stderr, "A video's frames must be an even number of "
+				"pixels each way, not %dx%d\n", cols, rows);
+		return NULL;
+	}
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		perror("calloc");
+		return NULL;
+	}
+	stream->cols = cols;
+	stream->rows = rows;
+
+	stream->planes = malloc((size_t)cols * rows * 3 / 2);
+	if (!stream->planes) {
+		perror("malloc");
+		goto err_free;
+	}
+
+	/* a copy of stdout, which can then be pointed somewhere else for
+	 * anything that's printed */
+	if (!strcmp(filename, "-")) {
+		stream->fp = fdopen(stdout_fd >= 0 ? stdout_fd :
+				dup(STDOUT_FILENO), "w");
+		stdout_fd = -1;
+	} else
+		stream->fp = fopen(filename, "w");
+	if (!stream->fp) {
+		perror(filename);
+		goto err_free;
+	}
+
+	fprintf(stream->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+			cols, rows, fps);
+	return stream;
+
+err_free:
+	free(stream->planes);
+	free(stream);
+	return NULL;
+}
+
+int y4m_take_stdout(void)
+{
+	fflush(stdout);
+	stdout_fd = dup(STDOUT_FILENO);
+	if (stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("dup");
+		return -1;
+	}
+	return 0;
+}
+
+int y4m_write_frame(struct y4m_stream *stream, const struct pixel *image)
+{
+	size_t luma_size = (size_t)stream->cols * stream->rows;
+	uint8_t *y = stream->planes;
+	uint8_t *cb = y + luma_size;
+	uint8_t *cr = cb + luma_size / 4;
+	int r;
+
+	for (r = 0; r < stream->rows; r += 2)
+		convert_rows(image + (size_t)r * stream->cols, stream->cols,
+				y + (size_t)r * stream->cols,
+				y + (size_t)(r + 1) * stream->cols,
+				cb + (size_t)r / 2 * stream->cols / 2,
+				cr + (size_t)r / 2 * stream->cols / 2);
+
+	fputs("FRAME\n", stream->fp);
+	if (fwrite(stream->planes, 1, luma_size * 3 / 2, stream->fp) !=
+			luma_size * 3 / 2) {
+		perror("fwrite");
+		return -1;
+	}
+	return 0;
+}
+
+int y4m_close(struct y4m_stream *stream)
+{
+	int rc = fclose(stream->fp);
+
+	if (rc)
+		perror("fclose");
+	free(stream->planes);
+	free(stream);
+	return rc ? -1 : 0;
+}
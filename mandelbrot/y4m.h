@@ -0,0 +1,36 @@
+#ifndef _Y4M_H
+#define _Y4M_H
+
+#include "fractal.h"
+
+/*
+ * A YUV4MPEG2 stream, which video encoders read: a header line, then for
+ * each frame, "FRAME" and its Y, Cb and Cr planes, the chroma planes at half
+ * the resolution each way (4:2:0), all in BT.601's studio range.
+ */
+struct y4m_stream;
+
+/*
+ * Set stdout aside for a stream to "-", and point stdout itself at stderr,
+ * so that nothing printed from then on can get into the video. Call it
+ * before anything is printed. Returns 0 on success.
+ */
+int y4m_take_stdout(void);
+
+/*
+ * Start a stream of @cols x @rows frames at @fps a second, to @filename, or
+ * to stdout if that's "-": the stdout set aside by y4m_take_stdout(), if it
+ * was called. The frames must be an even number of pixels each way. Returns
+ * NULL on failure.
+ */
+struct y4m_stream *y4m_open(const char *filename, int cols, int rows,
+		int fps);
+
+/* Convert @image, of the stream's size, and write it as the next frame.
+ * Returns 0 on success. */
+int y4m_write_frame(struct y4m_stream *stream, const struct pixel *image);
+
+/* Finish the stream. Returns 0 if everything was written. */
+int y4m_close(struct y4m_stream *stream);
+
+#endif /* _Y4M_H */
@@ -0,0 +1,101 @@
+/**
+ * Host implementation of the subset of libspe2 used by the programs in this
+ * repository.
+ *
+ * An SPE context is a private copy of the SPE program, loaded with dlopen(),
+ * and spe_context_run() calls its main() on the calling thread - which, as
+ * with libspe2, is expected to be a pthread dedicated to that context.
+ * Mailboxes and signal notification registers are emulated with a mutex and
+ * condition variable per context.
+ */
+#ifndef _LIBSPE2_H
+#define _LIBSPE2_H
+
+#include <stdint.h>
+#include <limits.h>
+
+/* An SPE program, embedded in the PPE executable by spe-embed.S. The image
+ * is a shared object built from the SPE sources with the host compiler */
+typedef struct spe_program_handle {
+	unsigned int handle_size;
+	const void *elf_image;
+	unsigned long elf_size;
+} spe_program_handle_t;
+
+typedef struct spe_context *spe_context_ptr_t;
+typedef struct spe_gang_context *spe_gang_context_ptr_t;
+typedef void *spe_event_handler_ptr_t;
+
+typedef union spe_event_data {
+	void *ptr;
+	unsigned int u32;
+	unsigned long long u64;
+} spe_event_data_t;
+
+typedef struct spe_event_unit {
+	unsigned int events;
+	spe_context_ptr_t spe;
+	spe_event_data_t data;
+} spe_event_unit_t;
+
+typedef struct spe_stop_info {
+	unsigned int stop_reason;
+	union {
+		int spe_exit_code;
+		int spe_signal_code;
+	} result;
+	int spu_status;
+} spe_stop_info_t;
+
+/* spe_context_create() flags */
+#define SPE_CFG_SIGNOTIFY1_OR		0x00000010
+#define SPE_CFG_SIGNOTIFY2_OR		0x00000020
+#define SPE_EVENTS_ENABLE		0x00001000
+
+/* spe_context_run() entry point */
+#define SPE_DEFAULT_ENTRY		UINT_MAX
+
+/* stop reasons */
+#define SPE_EXIT			1
+
+/* events */
+#define SPE_EVENT_OUT_INTR_MBOX		0x00000001
+
+/* mailbox read behaviour */
+#define SPE_MBOX_ALL_BLOCKING		1
+#define SPE_MBOX_ANY_BLOCKING		2
+#define SPE_MBOX_ANY_NONBLOCKING	3
+
+/* signal notification registers */
+#define SPE_SIG_NOTIFY_REG_1		0x0001
+#define SPE_SIG_NOTIFY_REG_2		0x0002
+
+/* spe_cpu_info_get() requests */
+#define SPE_COUNT_PHYSICAL_CPU_NODES	1
+#define SPE_COUNT_PHYSICAL_SPES		2
+#define SPE_COUNT_USABLE_SPES		3
+
+spe_context_ptr_t spe_context_create(unsigned int flags,
+		spe_gang_context_ptr_t gang);
+int spe_context_destroy(spe_context_ptr_t spe);
+int spe_program_load(spe_context_ptr_t spe, spe_program_handle_t *program);
+int spe_context_run(spe_context_ptr_t spe, unsigned int *entry,
+		unsigned int runflags, void *argp, void *envp,
+		spe_stop_info_t *stopinfo);
+
+spe_event_handler_ptr_t spe_event_handler_create(void);
+int spe_event_handler_destroy(spe_event_handler_ptr_t evhandler);
+int spe_event_handler_register(spe_event_handler_ptr_t evhandler,
+		spe_event_unit_t *event);
+int spe_event_wait(spe_event_handler_ptr_t evhandler,
+		spe_event_unit_t *events, int max_events, int timeout);
+
+int spe_out_intr_mbox_read(spe_context_ptr_t spe, unsigned int *mbox_data,
+		int count, unsigned int behavior);
+int spe_signal_write(spe_context_ptr_t spe, unsigned int signal_reg,
+		unsigned int data);
+
+/* On the host an "SPE" is a hardware thread */
+int spe_cpu_info_get(int info_requested, int cpu_node);
+
+#endif /* _LIBSPE2_H */
@@ -0,0 +1,502 @@
+/**
+ * Host SPE runtime: libspe2 contexts as pthreads.
+ *
+ * Each context gets its own copy of the SPE program. The embedded image is
+ * written to an anonymous memfd and dlopen()ed from there, and since every
+ * memfd is a distinct file the dynamic loader maps a fresh instance each
+ * time - so the program's globals and statics are private to the context,
+ * as they would be in a real SPE local store. The loader also matches
+ * objects by path, so the memfd stays open (and its /proc/self/fd name
+ * unique) for the life of the context.
+ *
+ * The SPE program must be built with -Dmain=spu_main (see the HOST section
+ * of the Makefiles), and the PPE executable must export this file's symbols
+ * (-rdynamic) so that the program can reach the channel functions below.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "libspe2.h"
+#include "spu_mfcio.h"
+
+#define SPE_HOST_ENTRY "spu_main"
+
+/* PS3 timebase, in Hz */
+#define SPE_HOST_TIMEBASE 79800000ull
+
+#define LOCK_LINE_SIZE 128
+#define N_LOCK_LINE_LOCKS 64
+
+struct spe_event_handler {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n_units;
+	spe_event_unit_t *units;
+};
+
+struct spe_context {
+	unsigned int flags;
+
+	int image_fd;
+	void *program;
+	int (*entry)(uint64_t speid, uint64_t argp, uint64_t envp);
+
+	/* protects the channel state below */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* outbound interrupt mailbox, one entry deep as on hardware */
+	unsigned int intr_mbox;
+	int intr_mbox_count;
+
+	/* signal notification register 1 */
+	unsigned int signal1;
+	int signal1_count;
+
+	/* handler to wake when the mailbox is written */
+	struct spe_event_handler *handler;
+
+	/* decrementer: value written, and when */
+	unsigned int dec_count;
+	uint64_t dec_written;
+
+	/* lock line reservation, and the line as it was read */
+	uint64_t reservation_ea;
+	int reservation_valid;
+	unsigned char reservation[LOCK_LINE_SIZE];
+	unsigned int atomic_status;
+};
+
+/* serialises lock line accesses, hashed by line address */
+static pthread_mutex_t lock_line_locks[N_LOCK_LINE_LOCKS] = {
+	[0 ... N_LOCK_LINE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* the context running on this thread, for the SPU-side channel calls */
+static __thread struct spe_context *current;
+
+spe_context_ptr_t spe_context_create(unsigned int flags,
+		spe_gang_context_ptr_t gang)
+{
+	struct spe_context *spe;
+
+	spe = calloc(1, sizeof(*spe));
+	if (!spe)
+		return NULL;
+
+	spe->flags = flags;
+	spe->image_fd = -1;
+	pthread_mutex_init(&spe->lock, NULL);
+	pthread_cond_init(&spe->cond, NULL);
+
+	return spe;
+}
+
+int spe_context_destroy(spe_context_ptr_t spe)
+{
+	if (spe->program)
+		dlclose(spe->program);
+	if (spe->image_fd >= 0)
+		close(spe->image_fd);
+
+	pthread_cond_destroy(&spe->cond);
+	pthread_mutex_destroy(&spe->lock);
+	free(spe);
+
+	return 0;
+}
+
+int spe_program_load(spe_context_ptr_t spe, spe_program_handle_t *program)
+{
+	const char *image = program->elf_image;
+	size_t remaining = program->elf_size;
+	char path[32];
+	int fd;
+
+	fd = memfd_create("spe-program", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	while (remaining) {
+		ssize_t n = write(fd, image, remaining);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		image += n;
+		remaining -= n;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	spe->program = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!spe->program) {
+		fprintf(stderr, "spe_program_load: %s\n", dlerror());
+		close(fd);
+		errno = ENOEXEC;
+		return -1;
+	}
+
+	spe->entry = (int (*)(uint64_t, uint64_t, uint64_t))
+		dlsym(spe->program, SPE_HOST_ENTRY);
+	if (!spe->entry) {
+		fprintf(stderr, "spe_program_load: no %s in SPE program\n",
+				SPE_HOST_ENTRY);
+		dlclose(spe->program);
+		spe->program = NULL;
+		close(fd);
+		errno = ENOEXEC;
+		return -1;
+	}
+
+	spe->image_fd = fd;
+
+	return 0;
+}
+
+int spe_context_run(spe_context_ptr_t spe, unsigned int *entry,
+		unsigned int runflags, void *argp, void *envp,
+		spe_stop_info_t *stopinfo)
+{
+	int rc;
+
+	if (!spe->entry) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	current = spe;
+	rc = spe->entry((uintptr_t)spe, (uintptr_t)argp, (uintptr_t)envp);
+	current = NULL;
+
+	*entry = SPE_DEFAULT_ENTRY;
+	if (stopinfo) {
+		memset(stopinfo, 0, sizeof(*stopinfo));
+		stopinfo->stop_reason = SPE_EXIT;
+		stopinfo->result.spe_exit_code = rc;
+	}
+
+	return 0;
+}
+
+spe_event_handler_ptr_t spe_event_handler_create(void)
+{
+	struct spe_event_handler *handler;
+
+	handler = calloc(1, sizeof(*handler));
+	if (!handler)
+		return NULL;
+
+	pthread_mutex_init(&handler->lock, NULL);
+	pthread_cond_init(&handler->cond, NULL);
+
+	return handler;
+}
+
+int spe_event_handler_destroy(spe_event_handler_ptr_t evhandler)
+{
+	struct spe_event_handler *handler = evhandler;
+
+	pthread_cond_destroy(&handler->cond);
+	pthread_mutex_destroy(&handler->lock);
+	free(handler->units);
+	free(handler);
+
+	return 0;
+}
+
+int spe_event_handler_register(spe_event_handler_ptr_t evhandler,
+		spe_event_unit_t *event)
+{
+	struct spe_event_handler *handler = evhandler;
+	spe_event_unit_t *units;
+
+	if (!(event->spe->flags & SPE_EVENTS_ENABLE) ||
+			event->events & ~SPE_EVENT_OUT_INTR_MBOX) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	pthread_mutex_lock(&handler->lock);
+
+	units = realloc(handler->units,
+			(handler->n_units + 1) * sizeof(*units));
+	if (!units) {
+		pthread_mutex_unlock(&handler->lock);
+		return -1;
+	}
+
+	units[handler->n_units++] = *event;
+	handler->units = units;
+
+	pthread_mutex_unlock(&handler->lock);
+
+	pthread_mutex_lock(&event->spe->lock);
+	event->spe->handler = handler;
+	pthread_mutex_unlock(&event->spe->lock);
+
+	return 0;
+}
+
+/*
+ * Events are level triggered: a context is reported for as long as there is
+ * something in its interrupt mailbox.
+ */
+int spe_event_wait(spe_event_handler_ptr_t evhandler,
+		spe_event_unit_t *events, int max_events, int timeout)
+{
+	struct spe_event_handler *handler = evhandler;
+	struct timespec deadline;
+	int i, n = 0;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&handler->lock);
+
+	for (;;) {
+		for (i = 0; i < handler->n_units && n < max_events; i++) {
+			spe_event_unit_t *unit = &handler->units[i];
+
+			if (__atomic_load_n(&unit->spe->intr_mbox_count,
+						__ATOMIC_ACQUIRE)) {
+				events[n] = *unit;
+				events[n].events = SPE_EVENT_OUT_INTR_MBOX;
+				n++;
+			}
+		}
+
+		if (n || timeout == 0)
+			break;
+
+		if (timeout < 0) {
+			pthread_cond_wait(&handler->cond, &handler->lock);
+		} else if (pthread_cond_timedwait(&handler->cond,
+					&handler->lock, &deadline)) {
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&handler->lock);
+
+	return n;
+}
+
+int spe_out_intr_mbox_read(spe_context_ptr_t spe, unsigned int *mbox_data,
+		int count, unsigned int behavior)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&spe->lock);
+
+	while (n < count) {
+		if (!spe->intr_mbox_count) {
+			if (behavior == SPE_MBOX_ANY_NONBLOCKING ||
+					(behavior == SPE_MBOX_ANY_BLOCKING && n))
+				break;
+			pthread_cond_wait(&spe->cond, &spe->lock);
+			continue;
+		}
+
+		mbox_data[n++] = spe->intr_mbox;
+		__atomic_store_n(&spe->intr_mbox_count, 0, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&spe->cond);
+	}
+
+	pthread_mutex_unlock(&spe->lock);
+
+	return n;
+}
+
+int spe_signal_write(spe_context_ptr_t spe, unsigned int signal_reg,
+		unsigned int data)
+{
+	if (signal_reg != SPE_SIG_NOTIFY_REG_1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&spe->lock);
+
+	if (spe->flags & SPE_CFG_SIGNOTIFY1_OR)
+		spe->signal1 |= data;
+	else
+		spe->signal1 = data;
+	spe->signal1_count = 1;
+	pthread_cond_broadcast(&spe->cond);
+
+	pthread_mutex_unlock(&spe->lock);
+
+	return 0;
+}
+
+int spe_cpu_info_get(int info_requested, int cpu_node)
+{
+	switch (info_requested) {
+	case SPE_COUNT_PHYSICAL_CPU_NODES:
+		return 1;
+	case SPE_COUNT_PHYSICAL_SPES:
+	case SPE_COUNT_USABLE_SPES:
+		return sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * SPU side: these are called by the SPE program, on its context's thread.
+ */
+
+void spu_write_out_intr_mbox(unsigned int data)
+{
+	struct spe_context *spe = current;
+	struct spe_event_handler *handler;
+
+	pthread_mutex_lock(&spe->lock);
+
+	while (spe->intr_mbox_count)
+		pthread_cond_wait(&spe->cond, &spe->lock);
+
+	spe->intr_mbox = data;
+	__atomic_store_n(&spe->intr_mbox_count, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&spe->cond);
+	handler = spe->handler;
+
+	pthread_mutex_unlock(&spe->lock);
+
+	if (handler) {
+		pthread_mutex_lock(&handler->lock);
+		pthread_cond_broadcast(&handler->cond);
+		pthread_mutex_unlock(&handler->lock);
+	}
+}
+
+unsigned int spu_stat_out_intr_mbox(void)
+{
+	return !__atomic_load_n(&current->intr_mbox_count, __ATOMIC_ACQUIRE);
+}
+
+unsigned int spu_read_signal1(void)
+{
+	struct spe_context *spe = current;
+	unsigned int data;
+
+	pthread_mutex_lock(&spe->lock);
+
+	while (!spe->signal1_count)
+		pthread_cond_wait(&spe->cond, &spe->lock);
+
+	data = spe->signal1;
+	spe->signal1 = 0;
+	spe->signal1_count = 0;
+
+	pthread_mutex_unlock(&spe->lock);
+
+	return data;
+}
+
+static uint64_t timebase_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * SPE_HOST_TIMEBASE +
+		ts.tv_nsec * SPE_HOST_TIMEBASE / 1000000000ull;
+}
+
+void spu_write_decrementer(unsigned int count)
+{
+	current->dec_count = count;
+	current->dec_written = timebase_now();
+}
+
+unsigned int spu_read_decrementer(void)
+{
+	return current->dec_count -
+		(unsigned int)(timebase_now() - current->dec_written);
+}
+
+static pthread_mutex_t *lock_line_lock(uint64_t ea)
+{
+	return &lock_line_locks[(ea / LOCK_LINE_SIZE) % N_LOCK_LINE_LOCKS];
+}
+
+void mfc_getllar(volatile void *ls, uint64_t ea, uint32_t tid, uint32_t rid)
+{
+	struct spe_context *spe = current;
+	pthread_mutex_t *lock = lock_line_lock(ea);
+
+	ea &= ~(uint64_t)(LOCK_LINE_SIZE - 1);
+
+	pthread_mutex_lock(lock);
+	memcpy(spe->reservation, (void *)(uintptr_t)ea, LOCK_LINE_SIZE);
+	pthread_mutex_unlock(lock);
+
+	memcpy((void *)ls, spe->reservation, LOCK_LINE_SIZE);
+	spe->reservation_ea = ea;
+	spe->reservation_valid = 1;
+	spe->atomic_status = MFC_GETLLAR_STATUS;
+}
+
+void mfc_putllc(volatile void *ls, uint64_t ea, uint32_t tid, uint32_t rid)
+{
+	struct spe_context *spe = current;
+	pthread_mutex_t *lock = lock_line_lock(ea);
+	void *line;
+
+	ea &= ~(uint64_t)(LOCK_LINE_SIZE - 1);
+	line = (void *)(uintptr_t)ea;
+
+	spe->atomic_status = MFC_PUTLLC_STATUS;
+
+	if (spe->reservation_valid && spe->reservation_ea == ea) {
+		pthread_mutex_lock(lock);
+		if (!memcmp(line, spe->reservation, LOCK_LINE_SIZE)) {
+			memcpy(line, (void *)ls, LOCK_LINE_SIZE);
+			spe->atomic_status = 0;
+		}
+		pthread_mutex_unlock(lock);
+	}
+
+	spe->reservation_valid = 0;
+}
+
+void mfc_putlluc(volatile void *ls, uint64_t ea, uint32_t tid, uint32_t rid)
+{
+	struct spe_context *spe = current;
+	pthread_mutex_t *lock = lock_line_lock(ea);
+
+	ea &= ~(uint64_t)(LOCK_LINE_SIZE - 1);
+
+	pthread_mutex_lock(lock);
+	memcpy((void *)(uintptr_t)ea, (void *)ls, LOCK_LINE_SIZE);
+	pthread_mutex_unlock(lock);
+
+	spe->reservation_valid = 0;
+	spe->atomic_status = MFC_PUTLLUC_STATUS;
+}
+
+unsigned int mfc_read_atomic_status(void)
+{
+	return current->atomic_status;
+}
@@ -0,0 +1,109 @@
+/**
+ * Host implementation of the SPU language extensions used by the SPE
+ * programs in this repository.
+ *
+ * The vector types are plain GCC vector extensions, so the usual arithmetic
+ * operators work on them just as they do with spu-gcc. Only the intrinsics
+ * that are actually used have been implemented.
+ */
+#ifndef _SPU_INTRINSICS_H
+#define _SPU_INTRINSICS_H
+
+#include <stdint.h>
+
+/* 'vector' is a context-sensitive keyword for spu-gcc and altivec. Here it
+ * is just shorthand for a 16-byte GCC vector of the following type. */
+#define vector __attribute__((vector_size(16)))
+
+typedef vector unsigned char vec_uchar16;
+typedef vector signed char vec_char16;
+typedef vector unsigned short vec_ushort8;
+typedef vector signed short vec_short8;
+typedef vector unsigned int vec_uint4;
+typedef vector signed int vec_int4;
+typedef vector unsigned long long vec_ullong2;
+typedef vector signed long long vec_llong2;
+typedef vector float vec_float4;
+typedef vector double vec_double2;
+
+static inline vec_uint4 __spu_splats_u32(unsigned int x)
+{
+	return (vec_uint4){ x, x, x, x };
+}
+
+static inline vec_int4 __spu_splats_s32(int x)
+{
+	return (vec_int4){ x, x, x, x };
+}
+
+static inline vec_float4 __spu_splats_f32(float x)
+{
+	return (vec_float4){ x, x, x, x };
+}
+
+static inline vec_ullong2 __spu_splats_u64(unsigned long long x)
+{
+	return (vec_ullong2){ x, x };
+}
+
+static inline vec_llong2 __spu_splats_s64(long long x)
+{
+	return (vec_llong2){ x, x };
+}
+
+static inline vec_double2 __spu_splats_f64(double x)
+{
+	return (vec_double2){ x, x };
+}
+
+/* replicate a scalar across all elements of a vector */
+#define spu_splats(x) _Generic((x),					\
+		unsigned int: __spu_splats_u32,				\
+		int: __spu_splats_s32,					\
+		float: __spu_splats_f32,				\
+		unsigned long long: __spu_splats_u64,			\
+		long long: __spu_splats_s64,				\
+		double: __spu_splats_f64)(x)
+
+/* extract element n of vector v */
+#define spu_extract(v, n) ((v)[(n)])
+
+/* element-wise a > b, giving all-ones or all-zeros in each element */
+#define spu_cmpgt(a, b) ((vec_uint4)((a) > (b)))
+
+/* element-wise a == b, giving all-ones or all-zeros in each element */
+#define spu_cmpeq(a, b) ((vec_uint4)((a) == (b)))
+
+/* bitwise select: bits from b where pattern is set, otherwise from a */
+#define spu_sel(a, b, pattern) ({					\
+		__typeof__(a) __a = (a);				\
+		__typeof__(a) __b = (b);				\
+		vec_uint4 __m = (vec_uint4)(pattern);			\
+		(__typeof__(a))(((vec_uint4)__a & ~__m) |		\
+				((vec_uint4)__b & __m));		\
+	})
+
+/* OR across the four words of a, result in element 0 */
+static inline vec_uint4 spu_orx(vec_uint4 a)
+{
+	return (vec_uint4){ a[0] | a[1] | a[2] | a[3], 0, 0, 0 };
+}
+
+static inline vec_float4 __spu_convtf_u32(vec_uint4 a, unsigned int scale)
+{
+	return __builtin_convertvector(a, vec_float4) /
+		__spu_splats_f32((float)(1u << scale));
+}
+
+static inline vec_float4 __spu_convtf_s32(vec_int4 a, unsigned int scale)
+{
+	return __builtin_convertvector(a, vec_float4) /
+		__spu_splats_f32((float)(1u << scale));
+}
+
+/* convert integer elements to float, dividing by 2^scale */
+#define spu_convtf(a, scale) _Generic((a),				\
+		vec_uint4: __spu_convtf_u32,				\
+		vec_int4: __spu_convtf_s32)((a), (scale))
+
+#endif /* _SPU_INTRINSICS_H */
@@ -0,0 +1,116 @@
+/**
+ * Host implementation of the SPU-side MFC and channel interface.
+ *
+ * On the host an SPE program shares the address space of the PPE program
+ * that loaded it, so a DMA is a memcpy that has completed by the time it is
+ * issued. Tag groups are tracked only so that mfc_read_tag_status_*() return
+ * what the caller asked for.
+ *
+ * The channels that talk to the PPE side (mailboxes, signal notification,
+ * the decrementer) are implemented in spe-host.c, against the context that
+ * is running on the calling thread.
+ */
+#ifndef _SPU_MFCIO_H
+#define _SPU_MFCIO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <spu_intrinsics.h>
+
+/* Each loaded SPE program gets a private copy of this, just as each SPE has
+ * its own MFC */
+static unsigned int __mfc_tag_mask __attribute__((unused));
+
+static inline void mfc_get(volatile void *ls, uint64_t ea, uint32_t size,
+		uint32_t tag, uint32_t tid, uint32_t rid)
+{
+	memcpy((void *)ls, (const void *)(uintptr_t)ea, size);
+}
+
+static inline void mfc_put(volatile void *ls, uint64_t ea, uint32_t size,
+		uint32_t tag, uint32_t tid, uint32_t rid)
+{
+	memcpy((void *)(uintptr_t)ea, (const void *)ls, size);
+}
+
+/* fenced variants: nothing may pass an earlier transfer in the same tag
+ * group, so order this copy after every store already made */
+static inline void mfc_getf(volatile void *ls, uint64_t ea, uint32_t size,
+		uint32_t tag, uint32_t tid, uint32_t rid)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	mfc_get(ls, ea, size, tag, tid, rid);
+}
+
+static inline void mfc_putf(volatile void *ls, uint64_t ea, uint32_t size,
+		uint32_t tag, uint32_t tid, uint32_t rid)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	mfc_put(ls, ea, size, tag, tid, rid);
+}
+
+static inline void mfc_write_tag_mask(unsigned int mask)
+{
+	__mfc_tag_mask = mask;
+}
+
+/*
+ * All transfers complete immediately, so every tag in the mask is done.
+ * A completed put is visible to every processor, and nothing the SPE reads
+ * afterwards can be from before it, so this is a full barrier.
+ */
+static inline unsigned int mfc_read_tag_status_all(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __mfc_tag_mask;
+}
+
+static inline unsigned int mfc_read_tag_status_any(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __mfc_tag_mask;
+}
+
+static inline unsigned int mfc_read_tag_status_immediate(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __mfc_tag_mask;
+}
+
+/*
+ * Atomic update of a 128-byte lock line: mfc_getllar() loads the line and
+ * takes a reservation on it, and mfc_putllc() stores it back only if the
+ * reservation still holds, which mfc_read_atomic_status() reports.
+ *
+ * The host can't watch for other writers to the line, so a reservation is
+ * lost when the line's contents differ from what mfc_getllar() read. All
+ * lock line accesses are serialised, so that is exact unless a line is
+ * changed and then changed back between the two.
+ */
+#define MFC_PUTLLC_STATUS	0x00000001	/* putllc failed */
+#define MFC_PUTLLUC_STATUS	0x00000002
+#define MFC_GETLLAR_STATUS	0x00000004
+
+void mfc_getllar(volatile void *ls, uint64_t ea, uint32_t tid, uint32_t rid);
+void mfc_putllc(volatile void *ls, uint64_t ea, uint32_t tid, uint32_t rid);
+void mfc_putlluc(volatile void *ls, uint64_t ea, uint32_t tid, uint32_t rid);
+unsigned int mfc_read_atomic_status(void);
+
+/* SPU outbound interrupt mailbox. Blocks while the (single entry) mailbox
+ * is still full */
+void spu_write_out_intr_mbox(unsigned int data);
+
+/* How many entries of the outbound interrupt mailbox are free: 0 or 1 */
+unsigned int spu_stat_out_intr_mbox(void);
+
+/* Read signal notification register 1, blocking until a signal has been
+ * written. Reading clears the register */
+unsigned int spu_read_signal1(void);
+
+/* The decrementer counts down at the PS3 timebase frequency */
+void spu_write_decrementer(unsigned int count);
+unsigned int spu_read_decrementer(void);
+
+#endif /* _SPU_MFCIO_H */